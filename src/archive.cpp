@@ -0,0 +1,422 @@
+#include "archive.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <fmt/core.h>
+#include <zlib.h>
+
+namespace fs = std::filesystem;
+
+namespace archive {
+
+namespace {
+
+// Anything claiming to decompress to more than this is refused: sizes in a
+// damaged (or malicious) archive can be anything.
+constexpr u64 MAX_FILE_SIZE  = 256 * 1024 * 1024;
+constexpr u64 CACHE_CAPACITY = 128 * 1024 * 1024;
+constexpr std::size_t MAX_INDEXES = 16;
+
+constexpr u32 EOCD_SIGNATURE         = 0x06054b50;
+constexpr u32 CENTRAL_SIGNATURE      = 0x02014b50;
+constexpr u32 LOCAL_SIGNATURE        = 0x04034b50;
+constexpr std::size_t EOCD_SIZE      = 22;
+constexpr std::size_t CENTRAL_SIZE   = 46;
+constexpr std::size_t LOCAL_SIZE     = 30;
+constexpr u16 METHOD_STORED  = 0;
+constexpr u16 METHOD_DEFLATE = 8;
+
+using Blob = std::shared_ptr<const std::vector<u8>>;
+
+std::error_code invalid() { return std::make_error_code(std::errc::illegal_byte_sequence); }
+
+u16 get16(const u8 *p) { return u16(p[0] | p[1] << 8); }
+u32 get32(const u8 *p) { return u32(p[0]) | u32(p[1]) << 8 | u32(p[2]) << 16 | u32(p[3]) << 24; }
+
+bool is_gzip(std::span<const u8> data)
+{
+    return data.size() >= 3 && data[0] == 0x1f && data[1] == 0x8b && data[2] == 8;
+}
+
+// Tells whether a file changed since it was last looked at.
+struct Stamp {
+    u64 size  = 0;
+    i64 mtime = 0;
+
+    friend bool operator==(const Stamp &, const Stamp &) = default;
+};
+
+io::Result<Stamp> stamp_of(const fs::path &path)
+{
+    std::error_code ec;
+    auto size = fs::file_size(path, ec);
+    if (ec)
+        return tl::unexpected(ec);
+    auto mtime = fs::last_write_time(path, ec);
+    if (ec)
+        return tl::unexpected(ec);
+    return Stamp { size, i64(mtime.time_since_epoch().count()) };
+}
+
+std::string cache_key(const fs::path &path, Stamp stamp)
+{
+    return fmt::format("{}\n{}:{}", path.string(), stamp.size, stamp.mtime);
+}
+
+// Inflates @in, stopping once @limit bytes are out. @window_bits selects the
+// container, as in zlib's inflateInit2().
+io::Result<std::vector<u8>> inflate_data(std::span<const u8> in, int window_bits, u64 size_hint, u64 limit)
+{
+    z_stream zs = {};
+    if (inflateInit2(&zs, window_bits) != Z_OK)
+        return tl::unexpected(std::make_error_code(std::errc::not_enough_memory));
+    std::vector<u8> out(std::min<u64>(std::max<u64>(size_hint, 1024), limit));
+    std::size_t in_pos = 0, out_pos = 0;
+    int ret = Z_OK;
+    while (ret != Z_STREAM_END && out_pos < limit) {
+        if (out_pos == out.size())
+            out.resize(std::min<u64>(out.size() * 2, limit));
+        auto in_chunk  = uInt(std::min<std::size_t>(in.size() - in_pos, UINT_MAX));
+        auto out_chunk = uInt(std::min<std::size_t>(out.size() - out_pos, UINT_MAX));
+        zs.next_in   = const_cast<u8 *>(in.data() + in_pos);
+        zs.avail_in  = in_chunk;
+        zs.next_out  = out.data() + out_pos;
+        zs.avail_out = out_chunk;
+        ret = inflate(&zs, Z_NO_FLUSH);
+        in_pos  += in_chunk  - zs.avail_in;
+        out_pos += out_chunk - zs.avail_out;
+        // no progress with room left for output: the input is cut short
+        if ((ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+         || (ret == Z_BUF_ERROR && zs.avail_out != 0)) {
+            inflateEnd(&zs);
+            return tl::unexpected(invalid());
+        }
+    }
+    inflateEnd(&zs);
+    out.resize(out_pos);
+    return out;
+}
+
+io::Result<std::vector<u8>> gunzip(std::span<const u8> in, u64 limit)
+{
+    // the size is stored at the end, modulo 2^32
+    auto hint = in.size() >= 4 ? get32(in.data() + in.size() - 4) : 0;
+    return inflate_data(in, 16 + MAX_WBITS, hint, limit);
+}
+
+struct Entry {
+    u64 offset;     // of the local header
+    u64 compressed;
+    u64 size;
+    u16 method;
+};
+
+// The central directory of a zip archive, which is all it takes to list it
+// and find its members.
+struct Index {
+    Stamp stamp;
+    std::vector<std::string> names; // in the order of the archive
+    std::unordered_map<std::string, Entry> entries;
+};
+
+bool is_safe_name(std::string_view name)
+{
+    if (name.empty() || name.back() == '/' || name.front() == '/')
+        return false;
+    for (const auto &part : fs::path(name))
+        if (part == "..")
+            return false;
+    return true;
+}
+
+io::Result<Index> read_index(std::span<const u8> data)
+{
+    if (data.size() < EOCD_SIZE)
+        return tl::unexpected(invalid());
+    // the end record is followed by a comment of up to 64k
+    auto min_pos = data.size() - std::min<std::size_t>(data.size(), EOCD_SIZE + 0xFFFF);
+    auto pos = data.size() - EOCD_SIZE;
+    while (get32(&data[pos]) != EOCD_SIGNATURE) {
+        if (pos == min_pos)
+            return tl::unexpected(invalid());
+        pos--;
+    }
+    const auto *eocd = &data[pos];
+    u64 count = get16(eocd + 10), cd_size = get32(eocd + 12), cd_offset = get32(eocd + 16);
+    if (count == 0xFFFF || cd_offset == 0xFFFFFFFF)
+        return tl::unexpected(std::make_error_code(std::errc::not_supported)); // zip64
+    if (cd_offset + cd_size > pos)
+        return tl::unexpected(invalid());
+
+    Index index;
+    auto cd = data.subspan(cd_offset, cd_size);
+    std::size_t p = 0;
+    for (u64 i = 0; i < count; i++) {
+        if (p + CENTRAL_SIZE > cd.size() || get32(&cd[p]) != CENTRAL_SIGNATURE)
+            return tl::unexpected(invalid());
+        const auto *h = &cd[p];
+        auto flags = get16(h + 8), method = get16(h + 10);
+        auto name_len = get16(h + 28), extra_len = get16(h + 30), comment_len = get16(h + 32);
+        if (p + CENTRAL_SIZE + name_len > cd.size())
+            return tl::unexpected(invalid());
+        auto name = std::string(reinterpret_cast<const char *>(h + CENTRAL_SIZE), name_len);
+        auto entry = Entry {
+            .offset     = get32(h + 42),
+            .compressed = get32(h + 20),
+            .size       = get32(h + 24),
+            .method     = method,
+        };
+        p += CENTRAL_SIZE + name_len + extra_len + comment_len;
+        // directories, encrypted members and what can't be decompressed
+        // are left out
+        if (!is_safe_name(name) || (flags & 1)
+         || (method != METHOD_STORED && method != METHOD_DEFLATE)
+         || entry.size > MAX_FILE_SIZE)
+            continue;
+        if (index.entries.emplace(name, entry).second)
+            index.names.push_back(std::move(name));
+    }
+    return index;
+}
+
+// Decompresses the first @limit bytes of a member (at most, all of it).
+io::Result<std::vector<u8>> extract(std::span<const u8> data, const Entry &entry, u64 limit)
+{
+    if (entry.offset + LOCAL_SIZE > data.size() || get32(&data[entry.offset]) != LOCAL_SIGNATURE)
+        return tl::unexpected(invalid());
+    const auto *h = &data[entry.offset];
+    auto start = entry.offset + LOCAL_SIZE + get16(h + 26) + get16(h + 28);
+    if (start + entry.compressed > data.size())
+        return tl::unexpected(invalid());
+    auto in = data.subspan(start, entry.compressed);
+    limit = std::min(limit, entry.size);
+    if (entry.method == METHOD_STORED) {
+        if (entry.compressed != entry.size)
+            return tl::unexpected(invalid());
+        return std::vector<u8>(in.begin(), in.begin() + limit);
+    }
+    auto out = inflate_data(in, -MAX_WBITS, limit, limit);
+    if (out && out.value().size() != limit)
+        return tl::unexpected(invalid());
+    return out;
+}
+
+// The decompressed files used last, up to a total size.
+class BlobCache {
+    std::mutex mutex;
+    std::list<std::pair<std::string, Blob>> lru; // most recent first
+    std::unordered_map<std::string, decltype(lru)::iterator> map;
+    u64 bytes = 0;
+
+public:
+    Blob get(const std::string &key)
+    {
+        std::lock_guard lock(mutex);
+        auto it = map.find(key);
+        if (it == map.end())
+            return nullptr;
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->second;
+    }
+
+    void put(const std::string &key, Blob blob)
+    {
+        if (blob->size() > CACHE_CAPACITY)
+            return;
+        std::lock_guard lock(mutex);
+        if (map.contains(key))
+            return;
+        bytes += blob->size();
+        lru.emplace_front(key, std::move(blob));
+        map[key] = lru.begin();
+        while (bytes > CACHE_CAPACITY) {
+            bytes -= lru.back().second->size();
+            map.erase(lru.back().first);
+            lru.pop_back();
+        }
+    }
+};
+
+BlobCache &blobs()
+{
+    static BlobCache cache;
+    return cache;
+}
+
+// The indexes of the archives used last, most recent last.
+struct IndexCache {
+    std::mutex mutex;
+    std::vector<std::pair<std::string, std::shared_ptr<const Index>>> indexes;
+};
+
+IndexCache &indexes()
+{
+    static IndexCache cache;
+    return cache;
+}
+
+io::Result<std::shared_ptr<const Index>> index_of(const fs::path &path, const io::MappedFile &file, Stamp stamp)
+{
+    auto &cache = indexes();
+    {
+        std::lock_guard lock(cache.mutex);
+        auto it = std::find_if(cache.indexes.begin(), cache.indexes.end(), [&](const auto &p) {
+            return p.first == path.native();
+        });
+        if (it != cache.indexes.end()) {
+            if (it->second->stamp == stamp)
+                return it->second;
+            cache.indexes.erase(it);
+        }
+    }
+    auto index = read_index(file.bytes());
+    if (!index)
+        return tl::unexpected(index.error());
+    index.value().stamp = stamp;
+    auto ptr = std::make_shared<const Index>(std::move(index.value()));
+    std::lock_guard lock(cache.mutex);
+    cache.indexes.emplace_back(path.native(), ptr);
+    if (cache.indexes.size() > MAX_INDEXES)
+        cache.indexes.erase(cache.indexes.begin());
+    return ptr;
+}
+
+// An open archive, along with its index.
+struct OpenArchive {
+    io::MappedFile file;
+    std::shared_ptr<const Index> index;
+};
+
+io::Result<OpenArchive> open_archive(const fs::path &path)
+{
+    auto stamp = stamp_of(path);
+    if (!stamp)
+        return tl::unexpected(stamp.error());
+    auto file = io::MappedFile::open(path, io::Access::Read);
+    if (!file)
+        return tl::unexpected(file.error());
+    auto index = index_of(path, file.value(), stamp.value());
+    if (!index)
+        return tl::unexpected(index.error());
+    return OpenArchive { std::move(file.value()), std::move(index.value()) };
+}
+
+io::Result<io::MappedFile> open_member(const fs::path &path, const fs::path &archive, const fs::path &member)
+{
+    auto stamp = stamp_of(archive);
+    if (!stamp)
+        return tl::unexpected(stamp.error());
+    auto key = cache_key(path, stamp.value());
+    if (auto blob = blobs().get(key); blob)
+        return io::MappedFile::from_memory(std::move(blob), path);
+    auto a = open_archive(archive);
+    if (!a)
+        return tl::unexpected(a.error());
+    auto it = a.value().index->entries.find(member.generic_string());
+    if (it == a.value().index->entries.end())
+        return tl::unexpected(std::make_error_code(std::errc::no_such_file_or_directory));
+    auto data = extract(a.value().file.bytes(), it->second, it->second.size);
+    if (!data)
+        return tl::unexpected(data.error());
+    auto blob = std::make_shared<const std::vector<u8>>(std::move(data.value()));
+    blobs().put(key, blob);
+    return io::MappedFile::from_memory(std::move(blob), path);
+}
+
+} // namespace
+
+io::Result<io::MappedFile> open(const fs::path &path)
+{
+    if (auto parts = split(path); parts)
+        return open_member(path, parts->first, parts->second);
+    auto file = io::MappedFile::open(path, io::Access::Read);
+    if (!file || !is_gzip(file.value().bytes()))
+        return file;
+    auto stamp = stamp_of(path);
+    if (!stamp)
+        return tl::unexpected(stamp.error());
+    auto key = cache_key(path, stamp.value());
+    if (auto blob = blobs().get(key); blob)
+        return io::MappedFile::from_memory(std::move(blob), path);
+    auto data = gunzip(file.value().bytes(), MAX_FILE_SIZE + 1);
+    if (!data)
+        return tl::unexpected(data.error());
+    if (data.value().size() > MAX_FILE_SIZE)
+        return tl::unexpected(std::make_error_code(std::errc::file_too_large));
+    auto blob = std::make_shared<const std::vector<u8>>(std::move(data.value()));
+    blobs().put(key, blob);
+    return io::MappedFile::from_memory(std::move(blob), path);
+}
+
+io::Result<std::vector<u8>> read_header(const fs::path &path, std::size_t size)
+{
+    if (auto parts = split(path); parts) {
+        auto a = open_archive(parts->first);
+        if (!a)
+            return tl::unexpected(a.error());
+        auto it = a.value().index->entries.find(parts->second.generic_string());
+        if (it == a.value().index->entries.end())
+            return tl::unexpected(std::make_error_code(std::errc::no_such_file_or_directory));
+        return extract(a.value().file.bytes(), it->second, size);
+    }
+    auto file = io::File::open(path, io::Access::Read);
+    if (!file)
+        return tl::unexpected(file.error());
+    std::vector<u8> header(size);
+    header.resize(std::fread(header.data(), 1, header.size(), file.value().data()));
+    if (!is_gzip(header))
+        return header;
+    auto mapped = io::MappedFile::open(path, io::Access::Read);
+    if (!mapped)
+        return tl::unexpected(mapped.error());
+    auto out = gunzip(mapped.value().bytes(), size);
+    // a truncated stream still has a header worth looking at
+    return out ? out : header;
+}
+
+bool is_archive(const fs::path &path)
+{
+    auto ext = path.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+    return ext == ".zip";
+}
+
+std::optional<std::pair<fs::path, fs::path>> split(const fs::path &path)
+{
+    fs::path prefix;
+    for (auto it = path.begin(); it != path.end() && std::next(it) != path.end(); ++it) {
+        prefix /= *it;
+        std::error_code ec;
+        if (!is_archive(prefix) || !fs::is_regular_file(prefix, ec))
+            continue;
+        fs::path member;
+        for (auto rest = std::next(it); rest != path.end(); ++rest)
+            member /= *rest;
+        return std::make_pair(prefix, member);
+    }
+    return std::nullopt;
+}
+
+io::Result<std::vector<Member>> list(const fs::path &path, std::size_t header_size)
+{
+    auto a = open_archive(path);
+    if (!a)
+        return tl::unexpected(a.error());
+    std::vector<Member> members;
+    for (const auto &name : a.value().index->names) {
+        auto header = extract(a.value().file.bytes(), a.value().index->entries.at(name), header_size);
+        if (header)
+            members.push_back({ path / name, std::move(header.value()) });
+    }
+    return members;
+}
+
+} // namespace archive
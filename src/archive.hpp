@@ -0,0 +1,49 @@
+/*
+ * Reading music files out of archives and compressed files, without ever
+ * extracting them to disk.
+ *
+ * A zip archive is seen as a directory: a member is addressed by the path of
+ * the archive followed by the member's path inside it (for example
+ * "rips/game.zip/01 title.spc"). A gzip'd file (such as a .vgz) is seen as
+ * the file it decompresses to, under its own name.
+ * Archive indexes are read once and kept for the archives used last, and
+ * decompressed files are kept in a cache shared by everyone, bounded in size,
+ * so that playing the same file again doesn't decompress it again. Both go
+ * by the archive's size and modification time, so that nothing stale is used
+ * once it changes on disk.
+ *
+ * @open: opens a file for reading, which may be an archive member, a gzip'd
+ *        file or just a plain file, which is mapped as usual;
+ * @read_header: reads the first @size bytes (or less) of anything open()
+ *               takes, decompressing no more than that;
+ * @is_archive: whether @path has the name of an archive that can be looked
+ *              into;
+ * @split: splits a path going through an archive into the archive and the
+ *         member's path inside it;
+ * @list: the members of an archive which are files, as full paths, along
+ *        with the first @header_size bytes of each;
+ */
+
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <utility>
+#include <vector>
+#include "common.hpp"
+#include "io.hpp"
+
+namespace archive {
+
+struct Member {
+    std::filesystem::path path;
+    std::vector<u8> header;
+};
+
+io::Result<io::MappedFile> open(const std::filesystem::path &path);
+io::Result<std::vector<u8>> read_header(const std::filesystem::path &path, std::size_t size);
+bool is_archive(const std::filesystem::path &path);
+std::optional<std::pair<std::filesystem::path, std::filesystem::path>> split(const std::filesystem::path &path);
+io::Result<std::vector<Member>> list(const std::filesystem::path &path, std::size_t header_size);
+
+} // namespace archive
@@ -6,6 +6,7 @@
 #include <array>
 #include "math.hpp"
 #include "concepts.hpp"
+#include "intern.hpp"
 
 namespace gmplayer {
 
@@ -27,7 +28,7 @@ struct Error {
 struct Metadata {
     enum Field { System = 0, Game, Song, Author, Copyright, Comment, Dumper };
     int length;
-    std::array<std::string, 7> info;
+    std::array<intern::String, 7> info;
 };
 
 inline int tempo_to_int(double value) { return math::map(std::log2(value), -2.0, 2.0, 0.0, 100.0); }
@@ -0,0 +1,72 @@
+/*
+ * A bounded, lock-free queue for many producer threads and a single consumer
+ * thread, used to send commands to the audio thread. Each slot carries a
+ * sequence number telling whether it's free for the producer claiming it or
+ * ready for the consumer, so that producers only contend on a single counter
+ * and the consumer never waits: a slot still being written just reads as
+ * empty until it's done.
+ *
+ * @push: adds @value at the back. Returns false if the queue is full, in which
+ *        case nothing is added;
+ * @pop: removes and returns the value at the front, or nullopt if there's
+ *       nothing ready. Only one thread at a time may call this;
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+template <typename T, std::size_t N>
+class CommandQueue {
+    static_assert(std::has_single_bit(N), "size must be a power of two");
+
+    struct Slot {
+        std::atomic<std::size_t> seq;
+        T value;
+    };
+
+    std::array<Slot, N> slots;
+    alignas(64) std::atomic<std::size_t> tail = 0;
+    alignas(64) std::size_t head = 0;
+
+public:
+    CommandQueue()
+    {
+        for (auto i = 0u; i < N; i++)
+            slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool push(T value)
+    {
+        auto pos = tail.load(std::memory_order_relaxed);
+        for (;;) {
+            auto &slot = slots[pos % N];
+            auto diff = std::intptr_t(slot.seq.load(std::memory_order_acquire)) - std::intptr_t(pos);
+            if (diff < 0)
+                return false;
+            if (diff > 0)
+                pos = tail.load(std::memory_order_relaxed);
+            else if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                slot.value = std::move(value);
+                slot.seq.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        }
+    }
+
+    std::optional<T> pop()
+    {
+        auto &slot = slots[head % N];
+        if (slot.seq.load(std::memory_order_acquire) != head + 1)
+            return std::nullopt;
+        auto value = std::move(slot.value);
+        slot.seq.store(head + N, std::memory_order_release);
+        head++;
+        return value;
+    }
+};
@@ -1,87 +1,229 @@
 #pragma once
 
-#include <unordered_map>
-#include <fmt/core.h>
+#include <array>
+#include <atomic>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <string_view>
+#include <type_traits>
+#include <fmt/core.h>
 #include "common.hpp"
 #include "const.hpp"
 #include "audio.hpp"
 #include "conf.hpp"
 #include "callback_handler.hpp"
 
+/*
+ * Every configuration key, along with its type and default value. Everything
+ * else is generated from this list: the defaults used when parsing, the key
+ * names, and a typed constant for each key (see cfg below), which indexes
+ * straight into the configuration's values.
+ */
+#define CONFIG_KEYS(X)                                                  \
+    /* player options */                                                \
+    X(autoplay,             bool,            conf::Value(false))        \
+    X(repeat_file,          bool,            conf::Value(false))        \
+    X(repeat_track,         bool,            conf::Value(false))        \
+    X(default_duration,     int,             conf::Value(3_min))        \
+    X(fade,                 int,             0_v)                       \
+    X(fade_in,              int,             0_v)                       \
+    X(tempo,                int,             50_v)                      \
+    X(volume,               int,             conf::Value(MAX_VOLUME_VALUE)) \
+    X(watched_dirs,         conf::ValueList, conf::Value{ conf::ValueList{} }) \
+    X(skip_duplicates,      bool,            conf::Value(false))        \
+    /* gui options */                                                   \
+    X(last_visited,         std::string,     ""_v)                      \
+    X(status_format_string, std::string,     "%s - %g - %a"_v)          \
+    X(file_format_string,   std::string,     "%f"_v)                    \
+    X(track_format_string,  std::string,     "%s"_v)                    \
+    X(recent_files,         conf::ValueList, conf::Value{ conf::ValueList{} }) \
+    X(recent_playlists,     conf::ValueList, conf::Value{ conf::ValueList{} }) \
+    /* shortcuts */                                                     \
+    X(play_pause,           std::string,     "Ctrl+Space"_v)            \
+    X(next,                 std::string,     "Ctrl+Right"_v)            \
+    X(prev,                 std::string,     "Ctrl+Left"_v)             \
+    X(stop,                 std::string,     "Ctrl+S"_v)                \
+    X(seek_forward,         std::string,     "Right"_v)                 \
+    X(seek_backward,        std::string,     "Left"_v)                  \
+    X(volume_up,            std::string,     "0"_v)                     \
+    X(volume_down,          std::string,     "9"_v)                     \
+
 namespace detail {
 
 using namespace gmplayer::literals;
 using namespace conf::literals;
 
+enum class KeyIndex : std::size_t {
+#define X(name, type, value) name,
+    CONFIG_KEYS(X)
+#undef X
+    Count,
+};
+
+inline constexpr std::size_t NUM_KEYS = std::size_t(KeyIndex::Count);
+
+inline constexpr std::array<std::string_view, NUM_KEYS> key_names = {
+#define X(name, type, value) #name,
+    CONFIG_KEYS(X)
+#undef X
+};
+
 const conf::Data defaults = {
-    // player options
-    { "autoplay",               conf::Value(false) },
-    { "repeat_file",            conf::Value(false) },
-    { "repeat_track",           conf::Value(false) },
-    { "default_duration",       conf::Value(3_min) },
-    { "fade",                   0_v },
-    { "fade_in",                0_v },
-    { "tempo",                  50_v },
-    { "volume",                 conf::Value(MAX_VOLUME_VALUE) },
-    // gui options
-    { "last_visited",           ""_v },
-    { "status_format_string",   "%s - %g - %a"_v },
-    { "file_format_string",     "%f"_v },
-    { "track_format_string",    "%s"_v },
-    { "recent_files",           conf::Value{ conf::ValueList{} } },
-    { "recent_playlists",       conf::Value{ conf::ValueList{} } },
-    // shortcuts
-    { "play_pause",             "Ctrl+Space"_v },
-    { "next",                   "Ctrl+Right"_v },
-    { "prev",                   "Ctrl+Left"_v },
-    { "stop",                   "Ctrl+S"_v    },
-    { "seek_forward",           "Right"_v },
-    { "seek_backward",          "Left"_v },
-    { "volume_up",              "0"_v },
-    { "volume_down",            "9"_v },
+#define X(name, type, value) { #name, value },
+    CONFIG_KEYS(X)
+#undef X
 };
 
 } // namespace detail
 
+template <typename T>
+struct ConfigKey {
+    std::size_t index;
+    constexpr std::string_view name() const { return detail::key_names[index]; }
+};
+
+namespace cfg {
+#define X(name, type, value) inline constexpr ConfigKey<type> name = { std::size_t(detail::KeyIndex::name) };
+    CONFIG_KEYS(X)
+#undef X
+} // namespace cfg
+
+/*
+ * The configuration. Values live in an immutable snapshot: readers load a
+ * pointer to it, while writers copy it, change the copy and publish it in
+ * place of the old one, which is freed once its last reader is done with it.
+ * Reading is thus safe from any thread, but not lock-free: an atomic
+ * shared_ptr takes a short internal lock on common standard libraries.
+ * Booleans and integers, which is what the player reads while playing, are
+ * also kept in atomics of their own, and reading those through a typed key
+ * never locks anything, so it's fine from the audio thread.
+ *
+ * @get: reads a single value. Use the typed keys from cfg; keys given as
+ *       strings are only for those known at runtime, and cost a lookup.
+ *       Strings and lists go through the snapshot;
+ * @snapshot: returns the current values, for reading several of them at once
+ *            and consistently;
+ * @set: changes a value and calls whoever is waiting for that key to change,
+ *       on the calling thread;
+ */
 struct Config {
-    conf::Data data;
-    std::unordered_map<std::string, CallbackHandler<void(const conf::Value &)>> callbacks;
-    // mutable std::mutex mut;
+    using Values = std::array<conf::Value, detail::NUM_KEYS>;
+
+private:
+    std::atomic<std::shared_ptr<const Values>> values;
+    // bools and ints, mirrored from the snapshot (0 for other types)
+    std::array<std::atomic<i64>, detail::NUM_KEYS> scalars = {};
+    std::mutex write_mutex;
+
+    static_assert(std::atomic<i64>::is_always_lock_free);
+    std::array<CallbackHandler<void(const conf::Value &)>, detail::NUM_KEYS> callbacks;
+
+    static std::shared_ptr<const Values> from_data(const conf::Data &data)
+    {
+        auto v = std::make_shared<Values>();
+        for (auto i = 0u; i < detail::NUM_KEYS; i++) {
+            auto it = data.find(std::string(detail::key_names[i]));
+            (*v)[i] = it != data.end() ? it->second : detail::defaults.at(std::string(detail::key_names[i]));
+        }
+        return v;
+    }
+
+    static i64 to_scalar(const conf::Value &v)
+    {
+        if (auto *i = std::get_if<int>(&v.value))  return *i;
+        if (auto *b = std::get_if<bool>(&v.value)) return *b;
+        return 0;
+    }
+
+    void publish(std::shared_ptr<const Values> v)
+    {
+        for (auto i = 0u; i < detail::NUM_KEYS; i++)
+            scalars[i].store(to_scalar((*v)[i]), std::memory_order_relaxed);
+        values.store(std::move(v), std::memory_order_release);
+    }
+
+    static std::size_t index_of(std::string_view key)
+    {
+        for (auto i = 0u; i < detail::NUM_KEYS; i++)
+            if (detail::key_names[i] == key)
+                return i;
+        fmt::print("Config: missing key {}\n", key);
+        return detail::NUM_KEYS;
+    }
+
+    void set_value(std::size_t i, conf::Value v)
+    {
+        if (i >= detail::NUM_KEYS)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(write_mutex);
+            auto next = std::make_shared<Values>(*values.load(std::memory_order_acquire));
+            (*next)[i] = v;
+            publish(std::move(next));
+        }
+        callbacks[i](v);
+    }
+
+public:
+    Config() { publish(from_data(detail::defaults)); }
 
     auto load()
     {
         auto [data, errors] = conf::parse_or_create(APP_NAME, detail::defaults);
-        this->data = std::move(data);
+        std::lock_guard<std::mutex> lock(write_mutex);
+        publish(from_data(data));
         return errors;
     }
 
+    std::shared_ptr<const Values> snapshot() const { return values.load(std::memory_order_acquire); }
+
+    template <typename T>
+    T get(ConfigKey<T> key) const
+    {
+        if constexpr (std::is_same_v<T, bool> || std::is_same_v<T, int>)
+            return T(scalars[key.index].load(std::memory_order_relaxed));
+        else
+            return (*snapshot())[key.index].template as<T>();
+    }
+
+    template <typename T>
+    T get(std::string_view key) const
+    {
+        auto i = index_of(key);
+        return i < detail::NUM_KEYS ? (*snapshot())[i].template as<T>() : T{};
+    }
+
+    template <typename T>
+    void set(ConfigKey<T> key, const std::type_identity_t<T> &value)
+    {
+        set_value(key.index, conf::Value(value));
+    }
+
     template <typename T>
-    T get(const std::string &key) const
+    void set(std::string_view key, const T &value)
     {
-        // std::lock_guard<std::mutex> lock(mut);
-        auto it = data.find(key);
-        if (it == data.end())
-            fmt::print("Config::get(): missing key {}\n", key);
-        return it->second.as<T>();
+        set_value(index_of(key), conf::Value(value));
     }
 
     template <typename T>
-    void set(const std::string &key, const T &value)
+    void when_set(ConfigKey<T> key, auto &&fn)
     {
-        // std::lock_guard<std::mutex> lock(mut);
-        auto v = conf::Value(value);
-        data[key] = v;
-        callbacks[key](v);
+        callbacks[key.index].add(fn);
     }
 
-    void when_set(const std::string &key, auto &&fn)
+    void when_set(std::string_view key, auto &&fn)
     {
-        callbacks[key].add(fn);
+        if (auto i = index_of(key); i < detail::NUM_KEYS)
+            callbacks[i].add(fn);
     }
 
     void save()
     {
+        auto v = snapshot();
+        conf::Data data;
+        for (auto i = 0u; i < detail::NUM_KEYS; i++)
+            data[std::string(detail::key_names[i])] = (*v)[i];
         conf::write(APP_NAME, data);
     }
 };
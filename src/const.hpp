@@ -5,6 +5,7 @@
 static const char *APP_NAME = "gmplayer";
 static const char *VERSION = "v1.1";
 
+inline constexpr int SAMPLE_RATE        = 44100;
 inline constexpr int NUM_FRAMES         = 2048;
 inline constexpr int NUM_CHANNELS       = 2;
 inline constexpr int NUM_VOICES         = 8;
@@ -0,0 +1,58 @@
+#include "engine.hpp"
+
+#include <algorithm>
+#include <mutex>
+#include "const.hpp"
+
+namespace gmplayer {
+
+Engine::Engine()
+{
+    spec.freq     = SAMPLE_RATE;
+    spec.format   = AUDIO_F32;
+    spec.channels = NUM_CHANNELS;
+    spec.samples  = NUM_FRAMES;
+    spec.userdata = this;
+    spec.callback = [] (void *userdata, u8 *stream, int length) {
+        ((Engine *) userdata)->callback({stream, std::size_t(length)});
+    };
+    dev_id = SDL_OpenAudioDevice(nullptr, 0, &spec, &spec, 0);
+    device_mutex = SDLMutex(dev_id);
+}
+
+Engine::~Engine()
+{
+    SDL_CloseAudioDevice(dev_id);
+}
+
+// The device holds its lock while calling this.
+void Engine::callback(std::span<u8> stream)
+{
+    std::fill(stream.begin(), stream.end(), 0); // fill stream with silence
+    // a session may stop rendering (and pause the device) from within
+    for (auto *s : sessions)
+        if (s->is_rendering())
+            s->render(stream);
+}
+
+void Engine::attach(Session *session)
+{
+    std::lock_guard<SDLMutex> lock(device_mutex);
+    sessions.push_back(session);
+    update_device();
+}
+
+void Engine::detach(Session *session)
+{
+    std::lock_guard<SDLMutex> lock(device_mutex);
+    std::erase(sessions, session);
+    update_device();
+}
+
+void Engine::update_device()
+{
+    auto any = std::any_of(sessions.begin(), sessions.end(), [](const Session *s) { return s->is_rendering(); });
+    SDL_PauseAudioDevice(dev_id, any ? 0 : 1);
+}
+
+} // namespace gmplayer
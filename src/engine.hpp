@@ -0,0 +1,81 @@
+/*
+ * What playback sessions share, so that a process can run several of them.
+ *
+ * An Engine owns the audio device: its callback mixes every session that is
+ * playing into the same stream, and the device only runs while at least one
+ * of them is. It also owns the prefetcher (see prefetch.hpp), which reads
+ * ahead for all of its sessions. The rest of what sessions share, interned
+ * strings and paths (see intern.hpp) and the cache of decompressed files (see
+ * archive.hpp), is process-wide already.
+ * A Session is anything that renders samples (a Player is one). Sessions are
+ * rendered with the device's lock held, which is also the lock they take to
+ * change what they play: one session can't be changed while another is
+ * rendered, but changes are short and rendering doesn't wait on anything.
+ * The engine has to outlive its sessions.
+ *
+ * Engine:
+ * @attach, @detach: adds and removes a session. A detached session isn't
+ *                   rendered anymore once detach() returns;
+ * @update_device: starts or pauses the device, depending on whether any
+ *                 session is rendering. Called with the lock held, by
+ *                 sessions starting or stopping;
+ * @mutex: the device's lock;
+ * @sample_format: the format of the device's samples;
+ * @prefetcher: the prefetcher shared by all sessions;
+ *
+ * Session:
+ * @is_rendering: whether the session wants to be rendered. Only changes with
+ *                the lock held, followed by a call to update_device();
+ * @render: mixes the session's next samples into @stream, which may already
+ *          hold other sessions' samples;
+ */
+
+#pragma once
+
+#include <span>
+#include <vector>
+#include <SDL_audio.h> // SDL_AudioDeviceID
+#include "common.hpp"
+#include "prefetch.hpp"
+
+namespace gmplayer {
+
+struct SDLMutex {
+    SDL_AudioDeviceID id;
+    SDLMutex() = default;
+    SDLMutex(SDL_AudioDeviceID id) : id{id} {}
+    void lock()   { SDL_LockAudioDevice(id); }
+    void unlock() { SDL_UnlockAudioDevice(id); }
+};
+
+struct Session {
+    virtual ~Session() = default;
+    virtual bool is_rendering() const = 0;
+    virtual void render(std::span<u8> stream) = 0;
+};
+
+class Engine {
+    SDL_AudioDeviceID dev_id = 0;
+    SDL_AudioSpec spec;
+    mutable SDLMutex device_mutex;
+    // only touched with the lock held
+    std::vector<Session *> sessions;
+    prefetch::Prefetcher prefetch;
+
+    void callback(std::span<u8> stream);
+
+public:
+    Engine();
+    ~Engine();
+    Engine(const Engine &) = delete;
+    Engine &operator=(const Engine &) = delete;
+
+    void attach(Session *session);
+    void detach(Session *session);
+    void update_device();
+    SDLMutex mutex() const                    { return device_mutex; }
+    SDL_AudioFormat sample_format() const     { return spec.format; }
+    prefetch::Prefetcher &prefetcher()        { return prefetch; }
+};
+
+} // namespace gmplayer
@@ -0,0 +1,50 @@
+/*
+ * A bounded, lock-free queue for a single producer thread and a single
+ * consumer thread, used to hand events from the audio thread to the
+ * frontend's thread. Pushing never allocates nor waits, so it's safe to call
+ * from the audio callback.
+ *
+ * @push: adds @value at the back. Returns false if the queue is full, in which
+ *        case nothing is added. Only the producer may call this;
+ * @pop: removes and returns the value at the front, or nullopt if the queue is
+ *       empty. Only the consumer may call this;
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <optional>
+
+template <typename T, std::size_t N>
+class EventQueue {
+    static_assert(std::has_single_bit(N), "size must be a power of two");
+
+    std::array<T, N> slots = {};
+    // kept on separate cache lines, as each one is written by one thread only
+    alignas(64) std::atomic<std::size_t> head = 0;
+    alignas(64) std::atomic<std::size_t> tail = 0;
+
+public:
+    bool push(T value)
+    {
+        auto t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N)
+            return false;
+        slots[t % N] = std::move(value);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    std::optional<T> pop()
+    {
+        auto h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return std::nullopt;
+        auto value = std::move(slots[h % N]);
+        head.store(h + 1, std::memory_order_release);
+        return value;
+    }
+};
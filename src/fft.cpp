@@ -0,0 +1,141 @@
+#include "fft.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <numbers>
+
+namespace fft {
+
+namespace {
+
+// the halves never overlap; telling the compiler so lets it vectorize
+void butterflies(f32 *__restrict ar, f32 *__restrict ai, f32 *__restrict br, f32 *__restrict bi,
+                 const f32 *__restrict wr, const f32 *__restrict wi, std::size_t count)
+{
+    for (std::size_t j = 0; j < count; j++) {
+        auto xr = br[j] * wr[j] - bi[j] * wi[j];
+        auto xi = br[j] * wi[j] + bi[j] * wr[j];
+        br[j] = ar[j] - xr;
+        bi[j] = ai[j] - xi;
+        ar[j] = ar[j] + xr;
+        ai[j] = ai[j] + xi;
+    }
+}
+
+} // namespace
+
+Plan::Plan(std::size_t size)
+    : n{std::max<std::size_t>(std::bit_ceil(size), 8)}
+{
+    auto m = n / 2;
+    const auto pi = std::numbers::pi;
+
+    window.resize(n);
+    for (std::size_t i = 0; i < n; i++)
+        window[i] = 0.5 - 0.5 * std::cos(2.0 * pi * i / n);
+
+    // twiddles of the stage of length `len` are at [len/2, len)
+    twiddle_re.resize(m);
+    twiddle_im.resize(m);
+    for (std::size_t len = 2; len <= m; len *= 2)
+        for (std::size_t j = 0; j < len/2; j++) {
+            twiddle_re[len/2 + j] = std::cos(-2.0 * pi * j / len);
+            twiddle_im[len/2 + j] = std::sin(-2.0 * pi * j / len);
+        }
+
+    split_re.resize(m + 1);
+    split_im.resize(m + 1);
+    for (std::size_t k = 0; k <= m; k++) {
+        split_re[k] = std::cos(-2.0 * pi * k / n);
+        split_im[k] = std::sin(-2.0 * pi * k / n);
+    }
+
+    auto bits = std::countr_zero(m);
+    bitrev.resize(m);
+    for (u32 i = 0; i < m; i++) {
+        u32 r = 0;
+        for (int b = 0; b < bits; b++)
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        bitrev[i] = r;
+    }
+
+    re.resize(m);
+    im.resize(m);
+}
+
+void Plan::magnitudes(std::span<const f32> input, std::span<f32> out)
+{
+    auto m = n / 2;
+
+    // pack even samples as real parts and odd ones as imaginary parts
+    for (std::size_t i = 0; i < m; i++) {
+        re[bitrev[i]] = input[2*i+0] * window[2*i+0];
+        im[bitrev[i]] = input[2*i+1] * window[2*i+1];
+    }
+
+    // the first two stages only have trivial twiddles (1 and -i), so they're
+    // done together; this is also where most of the loop overhead would be
+    for (std::size_t i = 0; i < m; i += 4) {
+        f32 *r = re.data() + i, *c = im.data() + i;
+        auto a0r = r[0] + r[1], a0i = c[0] + c[1];
+        auto a1r = r[0] - r[1], a1i = c[0] - c[1];
+        auto a2r = r[2] + r[3], a2i = c[2] + c[3];
+        auto a3r = r[2] - r[3], a3i = c[2] - c[3];
+        r[0] = a0r + a2r; c[0] = a0i + a2i;
+        r[2] = a0r - a2r; c[2] = a0i - a2i;
+        r[1] = a1r + a3i; c[1] = a1i - a3r;
+        r[3] = a1r - a3i; c[3] = a1i + a3r;
+    }
+
+    for (std::size_t len = 8; len <= m; len *= 2) {
+        auto half = len / 2;
+        const f32 *wr = twiddle_re.data() + half;
+        const f32 *wi = twiddle_im.data() + half;
+        for (std::size_t i = 0; i < m; i += len)
+            butterflies(re.data() + i, im.data() + i, re.data() + i + half, im.data() + i + half, wr, wi, half);
+    }
+
+    // X[k] = E[k] + W^k O[k], where E and O are the FFTs of the even and odd
+    // samples: E[k] = (Z[k] + conj(Z[m-k])) / 2, O[k] = -i (Z[k] - conj(Z[m-k])) / 2
+    // Z[0] pairs with itself and stands for Z[m] too, so that X[0] = E[0] + O[0]
+    // and X[m] = E[0] - O[0], both of them real
+    auto scale = 4.f / n;
+    auto count = std::min(out.size(), m + 1);
+    if (count > 0) out[0] = std::abs(re[0] + im[0]) * scale;
+    if (count > m) out[m] = std::abs(re[0] - im[0]) * scale;
+    for (std::size_t k = 1; k < std::min(count, m); k++) {
+        auto a = k, b = m - k;
+        auto er = (re[a] + re[b]) * 0.5f, ei = (im[a] - im[b]) * 0.5f;
+        auto or_ = (im[a] + im[b]) * 0.5f, oi = (re[b] - re[a]) * 0.5f;
+        auto xr = er + or_ * split_re[k] - oi * split_im[k];
+        auto xi = ei + or_ * split_im[k] + oi * split_re[k];
+        out[k] = std::sqrt(xr*xr + xi*xi) * scale;
+    }
+}
+
+void log_bands(std::span<const f32> magnitudes, int sample_rate, std::span<f32> bands,
+               f32 min_freq, f32 range_db)
+{
+    if (magnitudes.size() < 2 || bands.empty())
+        return;
+    auto num_bins  = magnitudes.size();
+    auto nyquist   = sample_rate / 2.f;
+    auto bin_width = nyquist / (num_bins - 1);
+    auto ratio     = std::log(nyquist / min_freq);
+    auto edge = [&](std::size_t i) {
+        return min_freq * std::exp(ratio * i / bands.size()) / bin_width;
+    };
+
+    for (std::size_t i = 0; i < bands.size(); i++) {
+        auto lo = std::min<std::size_t>(edge(i),            num_bins - 1);
+        auto hi = std::min<std::size_t>(std::ceil(edge(i+1)), num_bins);
+        // narrow bands at low frequencies may fall between two bins
+        auto peak = lo < hi ? *std::max_element(magnitudes.begin() + lo, magnitudes.begin() + hi)
+                            : magnitudes[lo];
+        auto db = 20.f * std::log10(std::max(peak, 1e-9f));
+        bands[i] = std::clamp(1.f + db / range_db, 0.f, 1.f);
+    }
+}
+
+} // namespace fft
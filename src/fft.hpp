@@ -0,0 +1,48 @@
+/*
+ * A small FFT library, only meant for spectrum analysis of audio (i.e. it
+ * only computes magnitudes of real signals).
+ *
+ * A real FFT of size n is computed as a complex FFT of size n/2 over the
+ * even/odd samples, followed by a split step. The complex FFT is an
+ * iterative radix-2 one working on separate arrays of real and imaginary
+ * parts, with per-stage twiddle tables, so that every inner loop runs over
+ * contiguous memory and gets vectorized by the compiler.
+ */
+
+#pragma once
+
+#include <span>
+#include <vector>
+#include "common.hpp"
+
+namespace fft {
+
+/*
+ * A precomputed real FFT of a fixed power-of-two size, with a Hann window.
+ * Magnitudes are normalized so that a full-scale sine has a magnitude of 1.
+ * A Plan is not thread-safe, as it owns its scratch buffers.
+ *
+ * @magnitudes: windows @input (which must have size() samples) and writes the
+ *              magnitude of bins [0, size()/2] into @out;
+ */
+class Plan {
+    std::size_t n;
+    std::vector<f32> window;
+    std::vector<f32> twiddle_re, twiddle_im; // complex FFT, one table per stage
+    std::vector<f32> split_re, split_im;     // real split step
+    std::vector<u32> bitrev;
+    std::vector<f32> re, im;
+
+public:
+    explicit Plan(std::size_t size);
+    std::size_t size() const { return n; }
+    void magnitudes(std::span<const f32> input, std::span<f32> out);
+};
+
+// Groups FFT bins into bands spaced logarithmically from @min_freq to the
+// Nyquist frequency, keeping the biggest magnitude of each band, and converts
+// them to a [0, 1] range over the last @range_db decibels.
+void log_bands(std::span<const f32> magnitudes, int sample_rate, std::span<f32> bands,
+               f32 min_freq = 30.f, f32 range_db = 72.f);
+
+} // namespace fft
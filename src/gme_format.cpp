@@ -6,6 +6,7 @@
 #include "fs.hpp"
 #include "gme/gme.h"
 #include "io.hpp"
+#include "archive.hpp"
 
 namespace gmplayer {
 
@@ -24,14 +25,14 @@ namespace {
         auto data = Metadata {
             .length = get_length(info, default_length),
             .info = {
-                info->system,
-                info->game,
-                info->song[0] ? std::string(info->song)
-                              : fmt::format("Track {}", which + 1),
-                info->author,
-                info->copyright,
-                info->comment,
-                info->dumper,
+                intern::String(info->system),
+                intern::String(info->game),
+                info->song[0] ? intern::String(info->song)
+                              : intern::String(fmt::format("Track {}", which + 1)),
+                intern::String(info->author),
+                intern::String(info->copyright),
+                intern::String(info->comment),
+                intern::String(info->dumper),
             }
         };
         gme_free_info(info);
@@ -60,10 +61,13 @@ auto GME::make(const io::MappedFile &file, int frequency, int default_length)
     if (auto err = gme_load_data(emu, data.data(), data.size()); err)
         return tl::unexpected(err);
     // load m3u file automatically. we don't care if it's found or not.
-    if (auto err = gme_load_m3u(emu, file.path().replace_extension("m3u").string().c_str()); err) {
+    // it's read the same way as the file, which may be inside an archive.
+    if (auto m3u = archive::open(file.path().replace_extension("m3u")); m3u) {
+        if (auto err = gme_load_m3u_data(emu, m3u.value().data(), m3u.value().size()); err) {
 #ifdef DEBUG
-        printf("GME: %s\n", err);
+            printf("GME: %s\n", err);
 #endif
+        }
     }
     return std::make_unique<GME>(emu, default_length, file.path());
 }
@@ -76,7 +80,7 @@ Error GME::start_track(int which)
                 : Error { .code = Error::Type::LoadTrack,
                           .details = err,
                           .file_path = file_path,
-                          .track_name = metadata.info[Metadata::Song], };
+                          .track_name = metadata.info[Metadata::Song].str(), };
 }
 
 Error GME::play(std::span<i16> out)
@@ -92,7 +96,7 @@ Error GME::play(std::span<i16> out)
         .code = Error::Type::Play,
         .details = err,
         .file_path = file_path,
-        .track_name = metadata.info[Metadata::Song]
+        .track_name = metadata.info[Metadata::Song].str()
     };
 }
 
@@ -103,7 +107,7 @@ Error GME::seek(int n)
         return Error { .code = Error::Type::Seek,
                        .details = err,
                        .file_path = file_path,
-                       .track_name = metadata.info[Metadata::Song] };
+                       .track_name = metadata.info[Metadata::Song].str() };
     // fade disappears on seek for some reason
     if (fade_len != 0)
         gme_set_fade_msecs(emu, metadata.length, fade_len);
@@ -5,6 +5,7 @@
 #include <fmt/core.h>
 #include "gsf.h"
 #include "io.hpp"
+#include "archive.hpp"
 #include "tl/expected.hpp"
 #include "audio.hpp"
 #include "fs.hpp"
@@ -32,7 +33,7 @@ auto GSF::make(fs::path path, std::vector<io::MappedFile> &cache,
                     .err  = { .code = 0, .from = 0 }
                 };
             }
-            auto f = io::MappedFile::open(path, io::Access::Read);
+            auto f = archive::open(path);
             if (!f)
                 return {
                     .buf  = nullptr,
@@ -118,13 +119,13 @@ Metadata GSF::track_metadata() const
     Metadata metadata = {
         .length = static_cast<int>(gsf_length(emu) + len),
         .info = {
-            "Game Boy Advance",
-            tags->game,
-            tags->title,
-            tags->artist,
-            tags->copyright,
-            "",
-            tags->gsfby,
+            intern::String("Game Boy Advance"),
+            intern::String(tags->game),
+            intern::String(tags->title),
+            intern::String(tags->artist),
+            intern::String(tags->copyright),
+            intern::String(),
+            intern::String(tags->gsfby),
         }
     };
     gsf_free_tags(tags);
@@ -16,19 +16,25 @@
 #include <QHBoxLayout>
 #include <QKeySequence>
 #include <QLabel>
+#include <QListView>
 #include <QListWidget>
 #include <QTreeWidget>
 #include <QMenu>
 #include <QMessageBox>
 #include <QMimeData>
 #include <QPushButton>
+#include <QPainter>
+#include <QProgressDialog>
 #include <QSettings>
 #include <QSizePolicy>
 #include <QString>
 #include <QStringLiteral>
 #include <QShortcut>
+#include <QScreen>
 #include <QShowEvent>
 #include <QSlider>
+#include <QStyleOptionSlider>
+#include <QTimer>
 #include <QToolButton>
 #include <QVBoxLayout>
 #include <QList>
@@ -41,6 +47,7 @@
 #include "math.hpp"
 #include "visualizer.hpp"
 #include "config.hpp"
+#include "playlist_file.hpp"
 
 namespace fs = std::filesystem;
 using namespace gmplayer::literals;
@@ -50,7 +57,7 @@ namespace gui {
 namespace {
 
 constexpr auto MUSIC_FILE_FILTER =
-    "All supported formats (*.spc *.nsf *.nsfe *.gbs *.gym *.ay *.kss *.hes *.vgm *.sap *.gsf *.minigsf);;"
+    "All supported formats (*.spc *.nsf *.nsfe *.gbs *.gym *.ay *.kss *.hes *.vgm *.vgz *.sap *.gsf *.minigsf *.zip);;"
     "All files (*.*)"
     "SPC - SNES SPC700 Files (*.spc);;"
     "NSF - Nintendo Sound Format (*.nsf);;"
@@ -60,12 +67,13 @@ constexpr auto MUSIC_FILE_FILTER =
     "AY - AY-3-8910 (*.ay);;"
     "KSS - Konami Sound System (*.kss);;"
     "HES - NEC Home Entertainment System (*.hes);;"
-    "VGM - Video Game Music (*.vgm);;"
+    "VGM - Video Game Music (*.vgm *.vgz);;"
     "SAP - Slight Atari Player (*.sap);;"
-    "GSF - Gameboy Sound File (*.gsf *.minigsf)";
+    "GSF - Gameboy Sound File (*.gsf *.minigsf);;"
+    "ZIP - Archives (*.zip)";
 
 constexpr auto PLAYLIST_FILTER =
-    "Playlist files (*.playlist);;"
+    "Playlist files (*.playlist *.m3u *.m3u8);;"
     "Text files (*.txt);;"
     "All files (*.*)";
 
@@ -134,7 +142,7 @@ QString format_position(int ms, int max)
         .arg(max / 1000 % 60, 2, 10, QChar('0'));
 };
 
-std::vector<fs::path> load_recent(const std::string &key)
+std::vector<fs::path> load_recent(ConfigKey<conf::ValueList> key)
 {
     return conf::convert_list_no_errors<fs::path, std::string>(config.get<conf::ValueList>(key));
 }
@@ -158,23 +166,6 @@ void handle_error(const gmplayer::Error &err)
         msgbox(format_error(err), QString::fromStdString(err.details.data()));
 }
 
-std::vector<QString> get_names(gmplayer::Player *player, gmplayer::Playlist::Type type)
-{
-    std::vector<QString> names;
-    if (type == gmplayer::Playlist::Track) {
-        auto fmt = config.get<std::string>("track_format_string");
-        player->loop_tracks([&](int id, const gmplayer::Metadata &m) {
-            names.push_back(QString::fromStdString(gmplayer::format_metadata(fmt, id, m, player->track_count())));
-        });
-    } else {
-        auto fmt = config.get<std::string>("file_format_string");
-        player->loop_files([&](int id, const io::MappedFile &f) {
-            names.push_back(QString::fromStdString(gmplayer::format_file(fmt, id, f, player->file_count())));
-        });
-    }
-    return names;
-}
-
 } // namespace
 
 
@@ -211,12 +202,13 @@ void RecentList::add(fs::path path)
 SettingsWindow::SettingsWindow(gmplayer::Player *player, QWidget *parent)
     : QDialog(parent)
 {
-    auto *fade_secs         = make_spinbox(std::numeric_limits<int>::max(), config.get<int>("fade") / 1000);
-    auto *fade_in_secs      = make_spinbox(std::numeric_limits<int>::max(), config.get<int>("fade_in") / 1000);
-    auto *default_duration  = make_spinbox(10_min / 1000, config.get<int>("default_duration") / 1000);
-    auto *status_format     = new QLineEdit(QString::fromStdString(config.get<std::string>("status_format_string")));
-    auto *file_format       = new QLineEdit(QString::fromStdString(config.get<std::string>("file_format_string")));
-    auto *track_format      = new QLineEdit(QString::fromStdString(config.get<std::string>("track_format_string")));
+    auto *fade_secs         = make_spinbox(std::numeric_limits<int>::max(), config.get(cfg::fade) / 1000);
+    auto *fade_in_secs      = make_spinbox(std::numeric_limits<int>::max(), config.get(cfg::fade_in) / 1000);
+    auto *default_duration  = make_spinbox(10_min / 1000, config.get(cfg::default_duration) / 1000);
+    auto *status_format     = new QLineEdit(QString::fromStdString(config.get(cfg::status_format_string)));
+    auto *file_format       = new QLineEdit(QString::fromStdString(config.get(cfg::file_format_string)));
+    auto *track_format      = new QLineEdit(QString::fromStdString(config.get(cfg::track_format_string)));
+    auto *skip_duplicates   = make_checkbox(tr("Don't add files already in the list"), config.get(cfg::skip_duplicates));
 
     auto *button_box = new QDialogButtonBox(QDialogButtonBox::Ok
                                           | QDialogButtonBox::Cancel);
@@ -225,12 +217,13 @@ SettingsWindow::SettingsWindow(gmplayer::Player *player, QWidget *parent)
 
     connect(this, &QDialog::finished, this, [=, this] (int r) {
         if (r == QDialog::Accepted) {
-            config.set<int>("fade", fade_secs->value() * 1000);
-            config.set<int>("fade_in", fade_in_secs->value() * 1000);
-            config.set<int>("default_duration", default_duration->value() * 1000);
-            config.set<std::string>("status_format_string", status_format->text().toStdString());
-            config.set<std::string>("file_format_string",   file_format  ->text().toStdString());
-            config.set<std::string>("track_format_string",  track_format ->text().toStdString());
+            config.set(cfg::fade, fade_secs->value() * 1000);
+            config.set(cfg::fade_in, fade_in_secs->value() * 1000);
+            config.set(cfg::default_duration, default_duration->value() * 1000);
+            config.set(cfg::status_format_string, status_format->text().toStdString());
+            config.set(cfg::file_format_string, file_format  ->text().toStdString());
+            config.set(cfg::track_format_string, track_format ->text().toStdString());
+            config.set(cfg::skip_duplicates, skip_duplicates->isChecked());
         }
     });
 
@@ -259,7 +252,8 @@ SettingsWindow::SettingsWindow(gmplayer::Player *player, QWidget *parent)
                 std::tuple { make_tool_btn(this, QStyle::SP_MessageBoxInformation, get_help_fn(FORMAT_STRING_HELP_HEADER.arg("files"), FILE_FORMAT_STRING_HELP, "</ul>")), 4, 2 },
                 std::tuple { new QLabel("Track playlist item format string: "), 5, 0 },
                 std::tuple { track_format, 5, 1 },
-                std::tuple { make_tool_btn(this, QStyle::SP_MessageBoxInformation, status_help), 5, 2 }
+                std::tuple { make_tool_btn(this, QStyle::SP_MessageBoxInformation, status_help), 5, 2 },
+                std::tuple { skip_duplicates, 6, 1 }
             ),
             button_box
         )
@@ -327,36 +321,195 @@ AboutDialog::AboutDialog(QWidget *parent)
 
 
 
+PlaylistModel::PlaylistModel(gmplayer::Playlist::Type type, gmplayer::Player *player, QObject *parent)
+    : QAbstractListModel(parent), player{player}, type{type}
+{ }
+
+int PlaylistModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : count;
+}
+
+QVariant PlaylistModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= count || role != Qt::DisplayRole)
+        return QVariant();
+    auto row = index.row();
+    if (!cache[row]) {
+        // rows tend to be requested in bulk when scrolling, so format the
+        // whole page at once
+        auto first = row - row % PAGE_SIZE;
+        format_page(first, std::min(PAGE_SIZE, count - first));
+    }
+    return cache[row].value_or(QString());
+}
+
+void PlaylistModel::format_page(int first, int size) const
+{
+    auto row = first;
+    auto add = [&](const gmplayer::FormatContext &ctx) {
+        if (!cache[row]) {
+            buffer.clear();
+            format.render(buffer, ctx);
+            cache[row] = QString::fromStdString(buffer);
+        }
+        row++;
+    };
+    if (type == gmplayer::Playlist::Track) {
+        auto total = player->track_count();
+        player->loop_tracks([&](int id, const gmplayer::Metadata &m) {
+            add({ .track_id = id, .track_count = total, .metadata = m });
+        }, first, size);
+    } else {
+        auto total = player->file_count();
+        // files are numbered by their position, which is the row
+        player->loop_files([&](int, const gmplayer::FileRecord &f) {
+            add({ .file_id = row, .file_count = total, .file = f });
+        }, first, size);
+    }
+}
+
+void PlaylistModel::reset()
+{
+    beginResetModel();
+    format = gmplayer::FormatString(config.get(
+        type == gmplayer::Playlist::Track ? cfg::track_format_string : cfg::file_format_string));
+    count = player->count_of(type);
+    cache.assign(count, std::nullopt);
+    endResetModel();
+}
+
+void PlaylistModel::apply_changes(std::span<const gmplayer::Playlist::Change> changes)
+{
+    using enum gmplayer::Playlist::Change::Kind;
+    auto old_count = count;
+    // rows past the first change may have moved
+    auto moved_from = count;
+    for (auto c : changes) {
+        moved_from = std::min(moved_from, c.kind == Move ? std::min(c.first, c.to) : c.first);
+        switch (c.kind) {
+        case Insert:
+            beginInsertRows(QModelIndex(), c.first, c.first + c.count - 1);
+            cache.insert(cache.begin() + c.first, c.count, std::nullopt);
+            count += c.count;
+            endInsertRows();
+            break;
+        case Remove:
+            beginRemoveRows(QModelIndex(), c.first, c.first + c.count - 1);
+            cache.erase(cache.begin() + c.first, cache.begin() + c.first + c.count);
+            count -= c.count;
+            endRemoveRows();
+            break;
+        case Move: {
+            // Qt wants the destination in terms of the list before the move
+            auto dest = c.to > c.first ? c.to + c.count : c.to;
+            beginMoveRows(QModelIndex(), c.first, c.first + c.count - 1, QModelIndex(), dest);
+            auto b = cache.begin();
+            if (c.to < c.first)
+                std::rotate(b + c.to, b + c.first, b + c.first + c.count);
+            else
+                std::rotate(b + c.first, b + c.first + c.count, b + c.to + c.count);
+            endMoveRows();
+            break;
+        }
+        }
+    }
+    // rows showing the count or their number went stale along the way
+    auto is_track = type == gmplayer::Playlist::Track;
+    auto stale_from = count != old_count && format.uses(is_track ? 'm' : 'b') ? 0
+                    : !is_track && format.uses('v')                           ? moved_from
+                    : count;
+    if (stale_from >= count)
+        return;
+    std::fill(cache.begin() + stale_from, cache.end(), std::nullopt);
+    emit dataChanged(index(stale_from), index(count - 1), { Qt::DisplayRole });
+}
+
+void PlaylistModel::invalidate(int row)
+{
+    if (row < 0 || row >= count)
+        return;
+    cache[row].reset();
+    emit dataChanged(index(row), index(row), { Qt::DisplayRole });
+}
+
+
+
 Playlist::Playlist(gmplayer::Playlist::Type type, gmplayer::Player *player, QWidget *parent)
     : QWidget(parent)
-    , list{new QListWidget}
-    , shuffle{make_button("Shuffle", this, [=, this] { player->shuffle(type); })}
-    , up     {make_button("Up",      this, [=, this] { list->setCurrentRow(player->move(type, list->currentRow(), -1)); })}
-    , down   {make_button("Down",    this, [=, this] { list->setCurrentRow(player->move(type, list->currentRow(), +1)); })}
+    , list{new QListView}
+    , model{new PlaylistModel(type, player, this)}
+    , filter{new QLineEdit}
+    , shuffle{make_button("Shuffle", this, [=, this] {
+        if (player->is_shuffled(type))
+            player->unshuffle(type);
+        else
+            player->shuffle(type);
+    })}
+    , up     {make_button("Up",      this, [=, this] { set_current(player->move(type, current(), -1)); })}
+    , down   {make_button("Down",    this, [=, this] { set_current(player->move(type, current(), +1)); })}
+    , sort   {new QPushButton("Sort")}
     , type{type}
     , player{player}
 {
-    connect(list, &QListWidget::itemActivated, this, [=, this] {
+    list->setModel(model);
+    list->setUniformItemSizes(true);
+    connect(list, &QListView::activated, this, [=, this] (const QModelIndex &index) {
         if (type == gmplayer::Playlist::Track)
-            player->load_track(list->currentRow());
+            player->load_track(index.row());
         else
-            player->load_pair(list->currentRow(), 0);
+            player->load_pair(index.row(), 0);
     });
+    using enum gmplayer::SortKey;
+    auto *sort_menu = new QMenu(this);
+    auto add_sort = [&](const QString &name, std::initializer_list<gmplayer::SortKey> keys) {
+        sort_menu->addAction(name, this, [=, this, keys = std::vector(keys)] { player->sort(type, keys); });
+    };
+    add_sort(tr("By &game"),   { Game, Path });
+    add_sort(tr("By &author"), { Author, Game, Path });
+    add_sort(tr("By &system"), { System, Game, Path });
+    add_sort(tr("By &title"),  { Title, Path });
+    add_sort(tr("By &length"), { Length, Path });
+    add_sort(tr("By &path"),   { Path });
+    sort->setMenu(sort_menu);
+    list->setSelectionMode(QAbstractItemView::ExtendedSelection);
+    filter->setPlaceholderText(tr("Search..."));
+    filter->setClearButtonEnabled(true);
+    connect(filter, &QLineEdit::textChanged, this, [=, this] { apply_filter(); });
     shuffle->setEnabled(false);
     up     ->setEnabled(false);
     down   ->setEnabled(false);
+    sort   ->setEnabled(false);
     player->on_playlist_changed([=, this] (auto type) { if (type == this->type) this->refresh_list(); });
+    player->on_playlist_edited([=, this] (auto type, auto changes) { if (type == this->type) this->apply_changes(changes); });
+    // a file's metadata is only known after it's loaded
+    if (type == gmplayer::Playlist::File) {
+        player->on_file_changed([=, this] (int id) { model->invalidate(id); });
+        player->on_files_updated([=, this] (std::span<const int> ids) {
+            for (auto id : ids)
+                model->invalidate(id);
+        });
+    }
     setLayout(
         make_layout<QVBoxLayout>(
             new QLabel(QString("%1 playlist").arg(type == gmplayer::Playlist::Type::Track ? "Track" : "File")),
+            filter,
             list,
-            make_layout<QHBoxLayout>(shuffle, up, down)
+            make_layout<QHBoxLayout>(shuffle, up, down, sort)
         )
     );
 }
 
-void Playlist::set_current(int n) { list->setCurrentRow(n); }
-int Playlist::current() const { return list->currentRow(); }
+void Playlist::set_current(int n) { list->setCurrentIndex(model->index(n)); }
+int Playlist::current() const { return list->currentIndex().row(); }
+
+std::vector<int> Playlist::selected() const
+{
+    std::vector<int> rows;
+    for (const auto &index : list->selectionModel()->selectedIndexes())
+        rows.push_back(index.row());
+    return rows;
+}
 
 void Playlist::setup_context_menu(auto &&fn)
 {
@@ -365,13 +518,56 @@ void Playlist::setup_context_menu(auto &&fn)
 }
 
 void Playlist::refresh_list() {
-    list->clear();
-    auto names = get_names(player, type);
-    for (auto &name : names)
-        new QListWidgetItem(name, list);
-    shuffle->setEnabled(names.size() != 0);
-    up     ->setEnabled(names.size() != 0);
-    down   ->setEnabled(names.size() != 0);
+    model->reset();
+    update_buttons();
+    apply_filter();
+}
+
+void Playlist::apply_changes(std::span<const gmplayer::Playlist::Change> changes)
+{
+    model->apply_changes(changes);
+    update_buttons();
+    apply_filter();
+}
+
+void Playlist::update_buttons()
+{
+    bool empty = model->rowCount() == 0;
+    shuffle->setEnabled(!empty);
+    shuffle->setText(player->is_shuffled(type) ? tr("Unshuffle") : tr("Shuffle"));
+    up     ->setEnabled(!empty);
+    down   ->setEnabled(!empty);
+    sort   ->setEnabled(!empty);
+}
+
+// Hides every other row, until the list or the filter changes.
+void Playlist::show_only(std::span<const int> rows)
+{
+    auto count = model->rowCount();
+    std::vector<bool> shown(count);
+    for (auto r : rows)
+        if (r >= 0 && r < count)
+            shown[r] = true;
+    for (int i = 0; i < count; i++)
+        list->setRowHidden(i, !shown[i]);
+    filtered = true;
+}
+
+void Playlist::apply_filter()
+{
+    auto query = filter->text().toStdString();
+    // nothing to show again if nothing was hidden
+    if (query.empty() && !filtered)
+        return;
+    auto rows = model->rowCount();
+    std::vector<bool> shown(rows, query.empty());
+    if (!query.empty())
+        for (auto i : player->search(type, query))
+            if (i < rows)
+                shown[i] = true;
+    for (int i = 0; i < rows; i++)
+        list->setRowHidden(i, !shown[i]);
+    filtered = !query.empty();
 }
 
 
@@ -381,9 +577,9 @@ PlaylistTab::PlaylistTab(gmplayer::Player *player, QWidget *parent)
 {
     tracklist = new Playlist(gmplayer::Playlist::Track, player);
     filelist  = new Playlist(gmplayer::Playlist::File,  player);
-    auto *autoplay     = make_checkbox("Autoplay",     config.get<bool>("autoplay"),     this, [=, this] (int state) { config.set<bool>("autoplay", state); });
-    auto *repeat_track = make_checkbox("Repeat track", config.get<bool>("repeat_track"), this, [=, this] (int state) { config.set<bool>("repeat_track", state); });
-    auto *repeat_file  = make_checkbox("Repeat file",  config.get<bool>("repeat_file"),  this, [=, this] (int state) { config.set<bool>("repeat_file", state); });
+    auto *autoplay     = make_checkbox("Autoplay",     config.get(cfg::autoplay),     this, [=, this] (int state) { config.set(cfg::autoplay, state); });
+    auto *repeat_track = make_checkbox("Repeat track", config.get(cfg::repeat_track), this, [=, this] (int state) { config.set(cfg::repeat_track, state); });
+    auto *repeat_file  = make_checkbox("Repeat file",  config.get(cfg::repeat_file),  this, [=, this] (int state) { config.set(cfg::repeat_file, state); });
 
     player->on_track_changed([=, this](int trackno, const gmplayer::Metadata &metadata) {
         tracklist->set_current(trackno);
@@ -391,8 +587,8 @@ PlaylistTab::PlaylistTab(gmplayer::Player *player, QWidget *parent)
 
     player->on_file_changed([=, this] (int fileno) { filelist->set_current(fileno); });
 
-    config.when_set("file_format_string",  [=, this] (const auto &_) { filelist->refresh_list(); });
-    config.when_set("track_format_string", [=, this] (const auto &_) { tracklist->refresh_list(); });
+    config.when_set(cfg::file_format_string,  [=, this] (const auto &_) { filelist->refresh_list(); });
+    config.when_set(cfg::track_format_string, [=, this] (const auto &_) { tracklist->refresh_list(); });
 
     setLayout(
         make_layout<QVBoxLayout>(
@@ -409,10 +605,35 @@ PlaylistTab::PlaylistTab(gmplayer::Player *player, QWidget *parent)
 
 
 
+LevelMeter::LevelMeter(QWidget *parent)
+    : QWidget(parent)
+{
+    setMinimumSize(32, 8);
+    setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Fixed);
+}
+
+void LevelMeter::set_level(gmplayer::Level l, bool clip)
+{
+    level = l;
+    clipping = clip;
+    update();
+}
+
+void LevelMeter::paintEvent(QPaintEvent *)
+{
+    auto w = width(), h = height();
+    auto to_width = [&](f32 x) { return std::clamp(int(x * w), 0, w); };
+    QPainter painter{this};
+    painter.fillRect(0, 0, w,                      h, Qt::black);
+    painter.fillRect(0, 0, to_width(level.peak),   h, clipping ? QColor(0xff, 0x60, 0x60) : QColor(0x60, 0xc0, 0x60));
+    painter.fillRect(0, 0, to_width(level.rms),    h, clipping ? QColor(0xd0, 0x20, 0x20) : QColor(0x20, 0x90, 0x20));
+}
+
 ChannelWidget::ChannelWidget(int index, gmplayer::Player *player, QWidget *parent)
     : QWidget(parent), index{index}
 {
     label = new QLabel;
+    meter = new LevelMeter;
     auto *checkbox = make_checkbox("Mute", false, this, [=, this] (int state) {
         player->mute_channel(index, bool(state));
     });
@@ -433,14 +654,14 @@ ChannelWidget::ChannelWidget(int index, gmplayer::Player *player, QWidget *paren
 
     setLayout(
         make_layout<QVBoxLayout>(
-            label, checkbox,
+            label, meter, checkbox,
             make_layout<QHBoxLayout>(new QLabel("Volume:"), volume)
         )
     );
 }
 
 void ChannelWidget::set_name(const QString &name) { setEnabled(true);  label->setText(name);                             }
-void ChannelWidget::reset()                       { setEnabled(false); label->setText(QString("Channel %1").arg(index)); }
+void ChannelWidget::reset()                       { setEnabled(false); label->setText(QString("Channel %1").arg(index)); meter->set_level({}); }
 void ChannelWidget::enable_volume(bool enable)    { volume->setEnabled(enable); }
 
 
@@ -448,8 +669,12 @@ void ChannelWidget::enable_volume(bool enable)    { volume->setEnabled(enable);
 
 VoicesTab::VoicesTab(gmplayer::Player *player, QWidget *parent)
     : QWidget(parent)
+    , player{player}
+    , master{new LevelMeter}
+    , timer{new QTimer(this)}
 {
-    std::array<ChannelWidget *, 8> channels;
+    timer->setTimerType(Qt::PreciseTimer);
+    connect(timer, &QTimer::timeout, this, [=, this] { update_meters(); });
     for (int i = 0; i < 8; i++) {
         channels[i] = new ChannelWidget(i, player);
         channels[i]->reset();
@@ -467,22 +692,129 @@ VoicesTab::VoicesTab(gmplayer::Player *player, QWidget *parent)
     });
 
     setLayout(
-        make_layout<QGridLayout>(
-            std::make_tuple(channels[0], 0, 0), std::make_tuple(channels[1], 0, 1),
-            std::make_tuple(channels[2], 1, 0), std::make_tuple(channels[3], 1, 1),
-            std::make_tuple(channels[4], 2, 0), std::make_tuple(channels[5], 2, 1),
-            std::make_tuple(channels[6], 3, 0), std::make_tuple(channels[7], 3, 1)
+        make_layout<QVBoxLayout>(
+            make_layout<QHBoxLayout>(new QLabel(tr("Master:")), master),
+            make_layout<QGridLayout>(
+                std::make_tuple(channels[0], 0, 0), std::make_tuple(channels[1], 0, 1),
+                std::make_tuple(channels[2], 1, 0), std::make_tuple(channels[3], 1, 1),
+                std::make_tuple(channels[4], 2, 0), std::make_tuple(channels[5], 2, 1),
+                std::make_tuple(channels[6], 3, 0), std::make_tuple(channels[7], 3, 1)
+            )
         )
     );
 }
 
+void VoicesTab::showEvent(QShowEvent *ev)
+{
+    auto rate = screen() ? screen()->refreshRate() : 60.0;
+    timer->start(std::max(1, int(1000.0 / rate)));
+    QWidget::showEvent(ev);
+}
+
+void VoicesTab::hideEvent(QHideEvent *ev)
+{
+    timer->stop();
+    QWidget::hideEvent(ev);
+}
+
+void VoicesTab::update_meters()
+{
+    auto levels = player->levels();
+    // keep the clip indicator on for about a second
+    if (levels.clips != last_clips)
+        clip_hold = timer->interval() > 0 ? 1000 / timer->interval() : 60;
+    last_clips = levels.clips;
+    master->set_level(levels.master, clip_hold > 0);
+    clip_hold = std::max(clip_hold - 1, 0);
+    for (auto i = 0u; i < channels.size(); i++)
+        if (channels[i]->isEnabled())
+            channels[i]->set_level(levels.voices[i]);
+}
+
+
+
+WaveformSlider::WaveformSlider(QWidget *parent)
+    : QSlider(Qt::Horizontal, parent)
+    , generator{[this] (u64 serial, std::shared_ptr<const waveform::Pyramid> pyramid) {
+        // called from the generator's thread
+        QMetaObject::invokeMethod(this, [this, serial, pyramid] {
+            if (serial != latest)
+                return;
+            overview = pyramid;
+            update_columns();
+            update();
+        }, Qt::QueuedConnection);
+    }}
+{
+    setMinimumHeight(32);
+}
+
+void WaveformSlider::request(waveform::Source source)
+{
+    clear();
+    latest = generator.request(std::move(source));
+}
+
+void WaveformSlider::clear()
+{
+    overview.reset();
+    columns.clear();
+    update();
+}
+
+void WaveformSlider::update_columns()
+{
+    if (!overview || overview->empty()) {
+        columns.clear();
+        return;
+    }
+    QStyleOptionSlider opt;
+    initStyleOption(&opt);
+    auto groove = style()->subControlRect(QStyle::CC_Slider, &opt, QStyle::SC_SliderGroove, this);
+    columns.resize(std::max(groove.width(), 1));
+    overview->columns(columns);
+}
+
+void WaveformSlider::resizeEvent(QResizeEvent *ev)
+{
+    QSlider::resizeEvent(ev);
+    update_columns();
+}
+
+void WaveformSlider::paintEvent(QPaintEvent *ev)
+{
+    QStyleOptionSlider opt;
+    initStyleOption(&opt);
+    if (columns.empty()) {
+        QSlider::paintEvent(ev);
+        return;
+    }
+    QPainter painter{this};
+    auto groove = style()->subControlRect(QStyle::CC_Slider, &opt, QStyle::SC_SliderGroove, this);
+    auto mid = height() / 2;
+    auto scale = float(height() / 2 - 1) / 32768.f;
+    auto played = maximum() > minimum()
+                ? int(i64(value() - minimum()) * columns.size() / (maximum() - minimum()))
+                : 0;
+    auto played_color = palette().color(QPalette::Highlight);
+    auto rest_color   = palette().color(QPalette::Mid);
+    for (auto x = 0u; x < columns.size(); x++) {
+        painter.setPen(int(x) < played ? played_color : rest_color);
+        painter.drawLine(groove.left() + x, mid - int(columns[x].max * scale),
+                         groove.left() + x, mid - int(columns[x].min * scale));
+    }
+    // the handle is the only part of the slider drawn over the waveform
+    opt.subControls = QStyle::SC_SliderHandle;
+    style()->drawComplexControl(QStyle::CC_Slider, &opt, &painter, this);
+}
+
 
 
 Controls::Controls(gmplayer::Player *player, QWidget *parent)
     : QWidget(parent)
 {
     // duration slider
-    auto *duration_slider = new QSlider(Qt::Horizontal);
+    auto *duration_slider = new WaveformSlider;
     auto *duration_label = new QLabel("00:00 / 00:00");
     duration_slider->setEnabled(false);
 
@@ -510,7 +842,7 @@ Controls::Controls(gmplayer::Player *player, QWidget *parent)
     prev_track->setEnabled(false);
 
     // tempo slider
-    auto tempo = config.get<int>("tempo");
+    auto tempo = config.get(cfg::tempo);
     auto *tempo_slider = new QSlider(Qt::Horizontal);
     auto *tempo_label = new QLabel(QString("%1x").arg(gmplayer::int_to_tempo(tempo), 4, 'f', 2));
     tempo_slider->setMinimum(0);
@@ -526,19 +858,21 @@ Controls::Controls(gmplayer::Player *player, QWidget *parent)
 
     connect(tempo_slider, &QSlider::valueChanged, this, [=, this] (int value) {
         if (tempo_slider->hasTracking())
-            config.set<int>("tempo", get_tempo_value(value));
+            config.set(cfg::tempo, get_tempo_value(value));
     });
 
     connect(tempo_slider, &QSlider::sliderMoved, this, [=, this] { get_tempo_value(tempo_slider->value()); });
 
     // volume slider and button
-    auto *volume = new VolumeWidget(config.get<int>("volume"), 0, MAX_VOLUME_VALUE);
-    connect(volume, &VolumeWidget::volume_changed, this, [=, this] (auto value) { config.set<int>("volume", value); });
+    auto *volume = new VolumeWidget(config.get(cfg::volume), 0, MAX_VOLUME_VALUE);
+    connect(volume, &VolumeWidget::volume_changed, this, [=, this] (auto value) { config.set(cfg::volume, value); });
 
     // status message
     status = new QLabel;
-    config.when_set("status_format_string", [=, this](const conf::Value &v) {
-        status->setText(QString::fromStdString(gmplayer::format_status(v.as<std::string>(), *player)));
+    status_format = gmplayer::FormatString(config.get(cfg::status_format_string));
+    config.when_set(cfg::status_format_string, [=, this](const conf::Value &v) {
+        status_format = gmplayer::FormatString(v.as<std::string>());
+        status->setText(QString::fromStdString(gmplayer::format_status(status_format, *player)));
     });
 
     // player signals
@@ -555,25 +889,39 @@ Controls::Controls(gmplayer::Player *player, QWidget *parent)
         duration_slider->setValue(ms);
     });
 
-    config.when_set("fade",   [=, this](const conf::Value &value) {
-        duration_slider->setRange(0, player->length());
+    auto request_overview = [=, this] {
+        auto track = player->current_track();
+        if (track == -1)
+            return;
+        duration_slider->request({
+            .path           = player->loaded_path(),
+            .track          = player->track_number(track),
+            .length         = player->length(),
+            .fade           = config.get(cfg::fade),
+            .default_length = config.get(cfg::default_duration),
+        });
+    };
 
+    config.when_set(cfg::fade,   [=, this](const conf::Value &value) {
+        duration_slider->setRange(0, player->length());
+        request_overview();
     });
-    config.when_set("tempo",  [=, this](const conf::Value &value) { tempo_slider->setValue(value.as<int>()); });
-    config.when_set("volume", [=, this](const conf::Value &value) { volume->set_value(value.as<int>()); });
+    config.when_set(cfg::tempo,  [=, this](const conf::Value &value) { tempo_slider->setValue(value.as<int>()); });
+    config.when_set(cfg::volume, [=, this](const conf::Value &value) { volume->set_value(value.as<int>()); });
 
     auto enable_next_buttons = [=, this] {
         next_track->setEnabled(player->has_next());
         prev_track->setEnabled(player->has_prev());
     };
 
-    config.when_set("repeat_file",  [=, this] (const conf::Value &_) { enable_next_buttons(); });
-    config.when_set("repeat_track", [=, this] (const conf::Value &_) { enable_next_buttons(); });
+    config.when_set(cfg::repeat_file,  [=, this] (const conf::Value &_) { enable_next_buttons(); });
+    config.when_set(cfg::repeat_track, [=, this] (const conf::Value &_) { enable_next_buttons(); });
 
     player->on_cleared([=, this] {
         duration_slider->setEnabled(false);
         duration_slider->setRange(0, 0);
         duration_slider->setValue(0);
+        duration_slider->clear();
         play_btn->setEnabled(false);
     });
 
@@ -581,13 +929,13 @@ Controls::Controls(gmplayer::Player *player, QWidget *parent)
         play_btn->setEnabled(true);
         duration_slider->setEnabled(true);
         duration_slider->setRange(0, player->length());
+        request_overview();
         enable_next_buttons();
-        auto fmt = config.get<std::string>("status_format_string");
-        status->setText(QString::fromStdString(gmplayer::format_status(fmt, *player)));
+        status->setText(QString::fromStdString(gmplayer::format_status(status_format, *player)));
     });
     player->on_track_ended([=, this] {
         play_btn->setIcon(style()->standardIcon(QStyle::SP_MediaPlay));
-        if (config.get<bool>("autoplay")) {
+        if (config.get(cfg::autoplay)) {
             player->next();
         }
     });
@@ -602,6 +950,7 @@ Controls::Controls(gmplayer::Player *player, QWidget *parent)
             play_btn->setIcon(style()->standardIcon(QStyle::SP_MediaPlay));
             duration_slider->setRange(0, 0);
             duration_slider->setValue(0);
+            duration_slider->clear();
             duration_slider->setEnabled(false);
         }
     });
@@ -662,7 +1011,7 @@ DetailsWindow::DetailsWindow(const gmplayer::Metadata &metadata, QWidget *parent
     std::array<QLabel *, 7> labels;
     for (int i = 0; i < labels.size(); i++) {
         labels[i] = new QLabel;
-        labels[i]->setText(QString::fromStdString(metadata.info[i]));
+        labels[i]->setText(QString::fromStdString(metadata.info[i].str()));
     }
     setLayout(make_layout<QFormLayout>(
         std::make_tuple(new QLabel(QObject::tr("Title:")),   labels[gmplayer::Metadata::Song]),
@@ -680,14 +1029,14 @@ DetailsWindow::DetailsWindow(std::span<const gmplayer::Metadata> metadata, QWidg
     std::array<QLabel *, 7> labels;
     for (int i = 0; i < labels.size(); i++) {
         labels[i] = new QLabel;
-        labels[i]->setText(QString::fromStdString(ms[0].info[i]));
+        labels[i]->setText(QString::fromStdString(ms[0].info[i].str()));
     }
     auto *list = new QListWidget;
     for (const auto &m : ms)
-        new QListWidgetItem(QString::fromStdString(m.info[gmplayer::Metadata::Song]), list);
+        new QListWidgetItem(QString::fromStdString(m.info[gmplayer::Metadata::Song].str()), list);
     connect(list, &QListWidget::itemActivated, this, [=, this] {
         for (int i = 0; i < labels.size(); i++)
-            labels[i]->setText(QString::fromStdString(ms[list->currentRow()].info[i]));
+            labels[i]->setText(QString::fromStdString(ms[list->currentRow()].info[i].str()));
     });
     setLayout(
         make_layout<QHBoxLayout>(
@@ -713,15 +1062,30 @@ MainWindow::MainWindow(gmplayer::Player *player, QWidget *parent)
     setWindowIcon(QIcon(":/icons/gmplayer64.png"));
     setAcceptDrops(true);
 
+    // signals raised by the audio thread are delivered from here
+    auto *events = new QTimer(this);
+    connect(events, &QTimer::timeout, this, [=, this] { player->dispatch_events(); });
+    events->start(16);
+
     // menus
     auto *file_menu = create_menu(this, "&File",
         std::make_tuple(tr("Open &files"),    [this] {
             if (auto files = multiple_file_dialog(tr("Open files"), tr(MUSIC_FILE_FILTER)); !files.empty())
                 open_files(files, { OpenFilesFlags::AddToRecent, OpenFilesFlags::ClearAndPlay });
         }),
+        std::make_tuple(tr("Open f&older"),   [this] {
+            if (auto dir = dir_dialog(tr("Open folder")); dir) {
+                auto paths = std::array{dir.value()};
+                open_files(paths, { OpenFilesFlags::AddToRecent, OpenFilesFlags::ClearAndPlay });
+            }
+        }),
         std::make_tuple(tr("Open &playlist"), [this] {
             if (auto f = file_dialog(tr("Open playlist"), tr(PLAYLIST_FILTER)); f)
                 open_playlist(f.value());
+        }),
+        std::make_tuple(tr("&Watch folder"),  [this] {
+            if (auto dir = dir_dialog(tr("Watch folder")); dir)
+                watch_dir(dir.value());
         })
     );
 
@@ -745,24 +1109,28 @@ MainWindow::MainWindow(gmplayer::Player *player, QWidget *parent)
     );
 
     // recent files, shortcuts, open dialog position
-    recent_files     = new RecentList(file_menu->addMenu(tr("&Recent files")),     load_recent("recent_files"));
-    recent_playlists = new RecentList(file_menu->addMenu(tr("R&ecent playlists")), load_recent("recent_playlists"));
+    recent_files     = new RecentList(file_menu->addMenu(tr("&Recent files")),     load_recent(cfg::recent_files));
+    recent_playlists = new RecentList(file_menu->addMenu(tr("R&ecent playlists")), load_recent(cfg::recent_playlists));
     connect(recent_files,     &RecentList::clicked, this, &MainWindow::open_file);
     connect(recent_playlists, &RecentList::clicked, this, &MainWindow::open_playlist);
     load_shortcuts();
-    last_file = QString::fromStdString(config.get<std::string>("last_visited"));
+    last_file = QString::fromStdString(config.get(cfg::last_visited));
+
+    // watched folders: whatever happens in them is applied to the file list
+    watcher = watch::make_watcher();
+    for (auto &dir : load_recent(cfg::watched_dirs))
+        watcher->add(dir);
+    auto *watch_timer = new QTimer(this);
+    connect(watch_timer, &QTimer::timeout, this, [=, this] {
+        if (auto changes = watcher->take(); !changes.empty())
+            player->update_library(changes);
+    });
+    watch_timer->start(1000);
 
     player->on_track_changed([=, this](int trackno, const gmplayer::Metadata &metadata) {
         player->start_or_resume();
     });
 
-    player->on_shuffled([=, this] (gmplayer::Playlist::Type l) {
-        if (l == gmplayer::Playlist::Track)
-            player->load_track(0);
-        else
-            player->load_pair(0, 0);
-    });
-
     player->on_error([=, this] (gmplayer::Error error) { handle_error(error); });
 
     // tabs
@@ -782,12 +1150,18 @@ MainWindow::MainWindow(gmplayer::Player *player, QWidget *parent)
             if (auto files = multiple_file_dialog(tr("Add files"), tr(MUSIC_FILE_FILTER)); !files.empty())
                 open_files(files);
         });
-        menu.addAction(tr("&Remove file"), [=, this] {
-            if (auto cur = playlist_tab->current_file(); cur != -1)
-                player->remove_file(cur);
+        menu.addAction(tr("&Remove files"), [=, this] {
+            if (auto selected = playlist_tab->selected_files(); !selected.empty())
+                player->remove_files(selected);
             else
                 msgbox(tr("A file must be selected first."));
         });
+        menu.addAction(tr("Show d&uplicates"), [=, this] {
+            if (auto dups = player->duplicates(); !dups.empty())
+                playlist_tab->show_only_files(dups);
+            else
+                msgbox(tr("No file is listed twice."));
+        });
         menu.addAction(tr("&Save playlist"), [=, this] {
             if (auto filename = save_dialog(tr("Save playlist"), tr("Playlist files (*.playlist)")); !filename.isEmpty()) {
                 auto file_path = fs::path(filename.toStdString());
@@ -798,7 +1172,7 @@ MainWindow::MainWindow(gmplayer::Player *player, QWidget *parent)
                         .arg(QString::fromStdString(savefile.error().message())));
                     return;
                 }
-                player->loop_files([&](int, const io::MappedFile &f) {
+                player->loop_files([&](int, const gmplayer::FileRecord &f) {
                     fmt::print(savefile.value().data(), "{}\n", f.path().string());
                 });
             }
@@ -859,8 +1233,8 @@ void MainWindow::load_shortcuts()
     add_shortcut("stop",            "Stop",           [=, this] { player->stop();                  });
     add_shortcut("seek_forward",    "Seek forward",   [=, this] { player->seek_relative(1_sec);    });
     add_shortcut("seek_backward",   "Seek backwards", [=, this] { player->seek_relative(-1_sec);   });
-    add_shortcut("volume_up",       "Volume up",      [=, this] { config.set<int>("volume", config.get<int>("volume") + 2); });
-    add_shortcut("volume_down",     "Volume down",    [=, this] { config.set<int>("volume", config.get<int>("volume") - 2);});
+    add_shortcut("volume_up",       "Volume up",      [=, this] { config.set(cfg::volume, config.get(cfg::volume) + 2); });
+    add_shortcut("volume_down",     "Volume down",    [=, this] { config.set(cfg::volume, config.get(cfg::volume) - 2);});
 }
 
 std::optional<fs::path> MainWindow::file_dialog(const QString &window_name, const QString &filter)
@@ -872,6 +1246,15 @@ std::optional<fs::path> MainWindow::file_dialog(const QString &window_name, cons
     return fs::path{filename.toUtf8().constData()};
 }
 
+std::optional<fs::path> MainWindow::dir_dialog(const QString &window_name)
+{
+    auto dir = QFileDialog::getExistingDirectory(this, window_name, last_file);
+    if (dir.isEmpty())
+        return std::nullopt;
+    last_file = dir;
+    return fs::path{dir.toUtf8().constData()};
+}
+
 std::vector<fs::path> MainWindow::multiple_file_dialog(const QString &window_name, const QString &filter)
 {
     auto files = QFileDialog::getOpenFileNames(this, window_name, last_file, filter);
@@ -891,22 +1274,13 @@ QString MainWindow::save_dialog(const QString &window_name, const QString &filte
 void MainWindow::open_playlist(fs::path file_path)
 {
     recent_playlists->add(file_path);
-    auto file = io::File::open(file_path, io::Access::Read);
-    if (!file) {
+    auto paths = gmplayer::open_playlist(file_path);
+    if (!paths) {
         msgbox(tr("Couldn't open playlist %1 (%2).").arg(QString::fromStdString(file_path.string())),
-               QString::fromStdString(file.error().message()));
+               QString::fromStdString(paths.error().message()));
         return;
     }
-
-    std::vector<fs::path> paths;
-    for (std::string line; file.value().get_line(line); ) {
-        auto p = fs::path(line);
-        if (p.is_relative())
-            p = file_path.parent_path() / p;
-        paths.push_back(p);
-    }
-
-    open_files(paths, { OpenFilesFlags::ClearAndPlay });
+    open_files(paths.value(), { OpenFilesFlags::ClearAndPlay });
 }
 
 void MainWindow::open_file(fs::path filename)
@@ -920,19 +1294,82 @@ void MainWindow::open_files(std::span<fs::path> paths, Flags<OpenFilesFlags> fla
     if (flags.contains(OpenFilesFlags::AddToRecent))
         for (auto &p : paths)
             recent_files->add(p);
-    if (flags.contains(OpenFilesFlags::ClearAndPlay))
+    if (flags.contains(OpenFilesFlags::ClearAndPlay)) {
+        // files still being found belong to the old list
+        dir_scan.reset();
+        dir_scan_id++;
         player->clear();
-    auto errors = player->add_files(paths);
-    if (errors.size() > 0) {
-        QString text;
-        for (auto &e : errors)
-            text += QString("%1: %2\n")
-                        .arg(QString::fromStdString(e.first.string()))
-                        .arg(QString::fromStdString(e.second.message()));
-        msgbox(tr("Errors were found while opening files."), text);
     }
-    if (flags.contains(OpenFilesFlags::ClearAndPlay))
-        player->load_pair(0, 0);
+    // everything is looked at and hashed in the background, so that opening
+    // many files at once doesn't hold up the window
+    scan_paths(paths, flags.contains(OpenFilesFlags::ClearAndPlay));
+}
+
+// Files found are added every so often, as they come. If @play is set, the
+// first ones found start playing. What's opened while a scan is running is
+// queued onto it, under the same progress dialog.
+void MainWindow::scan_paths(std::span<const fs::path> paths, bool play)
+{
+    if (dir_scan) {
+        dir_scan->add(paths);
+        return;
+    }
+    dir_scan = std::make_unique<scan::DirectoryScan>(paths);
+    auto id = ++dir_scan_id;
+    auto errors = std::make_shared<QString>();
+    auto *progress = new QProgressDialog(tr("Looking for files..."), tr("Cancel"), 0, 0, this);
+    progress->setWindowModality(Qt::NonModal);
+    progress->setMinimumDuration(500);
+    connect(progress, &QProgressDialog::canceled, this, [=, this] {
+        if (dir_scan && dir_scan_id == id)
+            dir_scan->cancel();
+    });
+    auto *timer = new QTimer(progress);
+    connect(timer, &QTimer::timeout, this, [=, this] {
+        // replaced by a newer scan
+        if (dir_scan_id != id) {
+            timer->stop();
+            progress->deleteLater();
+            return;
+        }
+        auto done = dir_scan->done();
+        if (auto found = dir_scan->take(); !found.empty()) {
+            auto was_empty = player->file_count() == 0;
+            for (auto &e : player->add_files(found.paths, found.hashes))
+                *errors += QString("%1: %2\n")
+                               .arg(QString::fromStdString(e.first.string()))
+                               .arg(QString::fromStdString(e.second.message()));
+            if (play && was_empty)
+                player->load_pair(0, 0);
+        }
+        auto p = dir_scan->progress();
+        progress->setLabelText(tr("Looking for files... %1 found in %2 folders").arg(p.found).arg(p.dirs));
+        if (done) {
+            dir_scan.reset();
+            timer->stop();
+            progress->deleteLater();
+            if (!errors->isEmpty())
+                msgbox(tr("Errors were found while opening files."), *errors);
+        }
+    });
+    timer->start(100);
+}
+
+// Imports @dir, then keeps following it from now on.
+void MainWindow::watch_dir(const fs::path &dir)
+{
+    auto dirs = load_recent(cfg::watched_dirs);
+    if (std::find(dirs.begin(), dirs.end(), dir) != dirs.end())
+        return;
+    if (!watcher->is_supported())
+        msgbox(tr("Folders can't be watched on this system: changes to %1 won't show up.")
+                   .arg(QString::fromStdString(dir.string())));
+    auto list = config.get(cfg::watched_dirs);
+    list.push_back(conf::Value(dir.string()));
+    config.set(cfg::watched_dirs, list);
+    watcher->add(dir);
+    auto paths = std::array{dir};
+    open_files(paths);
 }
 
 void MainWindow::open_url(const QUrl &url)
@@ -958,9 +1395,9 @@ void MainWindow::closeEvent(QCloseEvent *event)
             v.push_back(conf::Value(p.string()));
         return v;
     };
-    config.set("recent_files",     f(recent_files->get_paths()));
-    config.set("recent_playlists", f(recent_playlists->get_paths()));
-    config.set("last_visited", last_file.toStdString());
+    config.set(cfg::recent_files, f(recent_files->get_paths()));
+    config.set(cfg::recent_playlists, f(recent_playlists->get_paths()));
+    config.set(cfg::last_visited, last_file.toStdString());
     for (auto &s : shortcuts)
         config.set(s.key, s.shortcut->key().toString().toStdString());
     event->accept();
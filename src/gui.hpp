@@ -12,20 +12,26 @@
 #include <QPushButton>
 #include <QStringList>
 #include <QGraphicsView>
+#include <QAbstractListModel>
+#include <QSlider>
 #include "common.hpp"
 #include "audio.hpp"
 #include "const.hpp"
 #include "player.hpp"
 #include "flags.hpp"
 #include "keyrecorder.hpp"
+#include "scan.hpp"
+#include "watch.hpp"
+#include "waveform.hpp"
 
 
 class QShortcut;
 class QMenu;
 class QToolButton;
-class QSlider;
 class QLabel;
-class QListWidget;
+class QListView;
+class QLineEdit;
+class QTimer;
 class QGraphicsScene;
 class QGraphicsView;
 
@@ -80,19 +86,56 @@ public:
     explicit AboutDialog(QWidget *parent = nullptr);
 };
 
+/*
+ * A model over one of the player's playlists. Rows are formatted only when a
+ * view asks for them (i.e. when they're scrolled into view), a page at a time,
+ * and then cached until the playlist changes. Edits to the playlist are
+ * applied as row insertions, removals and moves, which keeps the view's
+ * selection and scroll position intact.
+ */
+class PlaylistModel : public QAbstractListModel {
+    Q_OBJECT
+    static constexpr int PAGE_SIZE = 64;
+
+    gmplayer::Player *player;
+    gmplayer::Playlist::Type type;
+    int count = 0;
+    gmplayer::FormatString format;
+    mutable std::vector<std::optional<QString>> cache;
+    mutable std::string buffer;
+
+    void format_page(int first, int size) const;
+
+public:
+    PlaylistModel(gmplayer::Playlist::Type type, gmplayer::Player *player, QObject *parent = nullptr);
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+    void reset();
+    void apply_changes(std::span<const gmplayer::Playlist::Change> changes);
+    void invalidate(int row);
+};
+
 class Playlist : public QWidget {
     Q_OBJECT
-    QListWidget *list;
-    QPushButton *shuffle, *up, *down;
+    QListView *list;
+    PlaylistModel *model;
+    QLineEdit *filter;
+    QPushButton *shuffle, *up, *down, *sort;
     gmplayer::Playlist::Type type;
     gmplayer::Player *player;
+    bool filtered = false;
 public:
     explicit Playlist(gmplayer::Playlist::Type type, gmplayer::Player *player, QWidget *parent = nullptr);
-    QListWidget *get_list() { return list; }
+    QListView *get_list() { return list; }
     void set_current(int n);
     int current() const;
+    std::vector<int> selected() const;
     void setup_context_menu(auto &&fn);
     void refresh_list();
+    void apply_changes(std::span<const gmplayer::Playlist::Change> changes);
+    void update_buttons();
+    void apply_filter();
+    void show_only(std::span<const int> rows);
 signals:
     void context_menu(const QPoint &p);
 };
@@ -104,6 +147,8 @@ public:
     PlaylistTab(gmplayer::Player *player, QWidget *parent = nullptr);
     int current_file()  const { return filelist->current(); }
     int current_track() const { return tracklist->current(); }
+    std::vector<int> selected_files() const { return filelist->selected(); }
+    void show_only_files(std::span<const int> rows) { filelist->show_only(rows); }
 
     void setup_context_menu(gmplayer::Playlist::Type which, auto &&fn)
     {
@@ -122,24 +167,67 @@ signals:
     void volume_changed(int value);
 };
 
+// a horizontal bar showing the RMS level, with the peak level drawn lighter.
+class LevelMeter : public QWidget {
+    Q_OBJECT
+    gmplayer::Level level;
+    bool clipping = false;
+    void paintEvent(QPaintEvent *ev) override;
+public:
+    explicit LevelMeter(QWidget *parent = nullptr);
+    void set_level(gmplayer::Level level, bool clipping = false);
+};
+
 class ChannelWidget : public QWidget {
     Q_OBJECT
     int index;
     QLabel *label;
     QSlider *volume;
+    LevelMeter *meter;
 public:
     ChannelWidget(int index, gmplayer::Player *player, QWidget *parent = nullptr);
     void set_name(const QString &name);
     void reset();
     void enable_volume(bool enable);
+    void set_level(gmplayer::Level level) { meter->set_level(level); }
 };
 
+// Meters are polled once per display refresh, and only while the tab is shown.
 class VoicesTab : public QWidget {
     Q_OBJECT
+    gmplayer::Player *player;
+    std::array<ChannelWidget *, 8> channels;
+    LevelMeter *master;
+    QTimer *timer;
+    u64 last_clips = 0;
+    int clip_hold = 0;
+
+    void showEvent(QShowEvent *ev) override;
+    void hideEvent(QHideEvent *ev) override;
+    void update_meters();
 public:
     VoicesTab(gmplayer::Player *player, QWidget *parent = nullptr);
 };
 
+// A seek bar with the waveform of the current track drawn behind it. The
+// overview is built in the background; resizing and repainting only read the
+// pyramid, the columns for the current width being kept around.
+class WaveformSlider : public QSlider {
+    Q_OBJECT
+    std::shared_ptr<const waveform::Pyramid> overview;
+    std::vector<waveform::Peak> columns;
+    u64 latest = 0;
+    waveform::Generator generator;
+
+    void update_columns();
+    void paintEvent(QPaintEvent *ev) override;
+    void resizeEvent(QResizeEvent *ev) override;
+public:
+    explicit WaveformSlider(QWidget *parent = nullptr);
+    void request(waveform::Source source);
+    void clear();
+};
+
 class Controls : public QWidget {
     Q_OBJECT
     enum class SliderHistory {
@@ -149,6 +237,7 @@ class Controls : public QWidget {
     } history = SliderHistory::DontKnow;
     std::string status_format_string;
     QLabel *status;
+    gmplayer::FormatString status_format;
 
 public:
     Controls(gmplayer::Player *player, QWidget *parent = nullptr);
@@ -177,12 +266,19 @@ class MainWindow : public QMainWindow {
     RecentList *recent_files              = nullptr,
                *recent_playlists          = nullptr;
     Controls *controls = nullptr;
+    // the directory scan adding files, if one is running
+    std::unique_ptr<scan::DirectoryScan> dir_scan;
+    u64 dir_scan_id = 0;
+    std::unique_ptr<watch::Watcher> watcher;
 
     std::optional<std::filesystem::path> file_dialog(const QString &window_name, const QString &filter);
+    std::optional<std::filesystem::path> dir_dialog(const QString &window_name);
     std::vector<std::filesystem::path> multiple_file_dialog(const QString &window_name, const QString &filter);
     QString save_dialog(const QString &window_name, const QString &filter);
     void load_shortcuts();
     void open_file(std::filesystem::path filename);
+    void scan_paths(std::span<const std::filesystem::path> paths, bool play);
+    void watch_dir(const std::filesystem::path &dir);
     void closeEvent(QCloseEvent *event);
     void dragEnterEvent(QDragEnterEvent *event);
     void dropEvent(QDropEvent *event);
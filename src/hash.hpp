@@ -0,0 +1,78 @@
+/*
+ * Hashing file contents, to tell when two files are the same.
+ *
+ * The hash is XXH64: not cryptographic, but well distributed, and fast
+ * enough for whole files to be hashed while they're imported. The input is
+ * consumed 32 bytes at a time by four independent lanes, which the compiler
+ * can run side by side (and vectorize, where 64-bit multiplies allow it).
+ *
+ * @bytes: hashes a buffer. Never returns 0, which is free to mean "unknown";
+ * @file: hashes a file's contents, as read by archive::open() (i.e. members
+ *        of archives and gzip'd files are hashed as what they decompress to).
+ *        Returns 0 if the file can't be read;
+ */
+
+#pragma once
+
+#include <bit>
+#include <cstring>
+#include <filesystem>
+#include <span>
+#include "common.hpp"
+#include "archive.hpp"
+
+namespace hash {
+
+namespace detail {
+    inline constexpr u64 P1 = 11400714785074694791ull;
+    inline constexpr u64 P2 = 14029467366897019727ull;
+    inline constexpr u64 P3 =  1609587929392839161ull;
+    inline constexpr u64 P4 =  9650029242287828579ull;
+    inline constexpr u64 P5 =  2870177450012600261ull;
+
+    inline u64 read64(const u8 *p) { u64 v; std::memcpy(&v, p, sizeof(v)); return v; }
+    inline u32 read32(const u8 *p) { u32 v; std::memcpy(&v, p, sizeof(v)); return v; }
+
+    inline u64 round(u64 acc, u64 input) { return std::rotl(acc + input * P2, 31) * P1; }
+    inline u64 merge(u64 acc, u64 lane) { return (acc ^ round(0, lane)) * P1 + P4; }
+} // namespace detail
+
+// assumes a little endian machine, as everything else here does
+inline u64 bytes(std::span<const u8> data)
+{
+    using namespace detail;
+    const auto *p   = data.data();
+    const auto *end = p + data.size();
+    u64 h;
+    if (data.size() >= 32) {
+        u64 v[4] = { P1 + P2, P2, 0, 0 - P1 };
+        for (; end - p >= 32; p += 32)
+            for (int i = 0; i < 4; i++)
+                v[i] = round(v[i], read64(p + i * 8));
+        h = std::rotl(v[0], 1) + std::rotl(v[1], 7) + std::rotl(v[2], 12) + std::rotl(v[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = merge(h, v[i]);
+    } else
+        h = P5;
+    h += data.size();
+    for (; end - p >= 8; p += 8)
+        h = std::rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+    if (end - p >= 4) {
+        h = std::rotl(h ^ (u64(read32(p)) * P1), 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        h = std::rotl(h ^ (*p * P5), 11) * P1;
+    h ^= h >> 33; h *= P2;
+    h ^= h >> 29; h *= P3;
+    h ^= h >> 32;
+    return h == 0 ? 1 : h;
+}
+
+inline u64 file(const std::filesystem::path &path)
+{
+    auto f = archive::open(path);
+    return f ? bytes(f.value().bytes()) : 0;
+}
+
+} // namespace hash
@@ -0,0 +1,192 @@
+#include "intern.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace fs = std::filesystem;
+
+namespace intern {
+
+namespace {
+
+/*
+ * Strings are stored inside fixed-size blocks as a 4 byte length followed by
+ * the characters and a terminator. A handle is the position of a string
+ * inside the arena: the upper bits select the block, the lower bits the
+ * offset into the block. Handle 0 is always the empty string. A string that
+ * doesn't fit in a block gets a bigger block of its own. Once every block is
+ * taken, interning a new string throws std::length_error.
+ */
+constexpr u32 STRING_BLOCK_SHIFT = 20;
+constexpr u32 STRING_BLOCK_SIZE  = 1u << STRING_BLOCK_SHIFT;
+constexpr u32 STRING_MAX_BLOCKS  = 1u << (32 - STRING_BLOCK_SHIFT);
+constexpr u32 STRING_HEADER_SIZE = sizeof(u32);
+
+struct StringArena {
+    std::array<std::atomic<char *>, STRING_MAX_BLOCKS> blocks = {};
+    std::unordered_map<std::string_view, u32> ids;
+    std::mutex lock;
+    u32 block = 0, offset = 0;
+
+    StringArena()
+    {
+        blocks[0].store(new char[STRING_BLOCK_SIZE], std::memory_order_release);
+        push("");
+    }
+
+    ~StringArena()
+    {
+        for (auto &b : blocks)
+            delete[] b.load(std::memory_order_relaxed);
+    }
+
+    u32 push(std::string_view s)
+    {
+        if (s.size() > std::numeric_limits<u32>::max() - STRING_HEADER_SIZE - 1)
+            throw std::length_error("intern: string too long");
+        auto len = u32(s.size());
+        auto needed = STRING_HEADER_SIZE + len + 1;
+        if (offset + needed > STRING_BLOCK_SIZE) {
+            if (block + 1 == STRING_MAX_BLOCKS)
+                throw std::length_error("intern: string arena is full");
+            block++;
+            offset = 0;
+            blocks[block].store(new char[std::max(needed, STRING_BLOCK_SIZE)], std::memory_order_release);
+        }
+        char *p = blocks[block].load(std::memory_order_relaxed) + offset;
+        std::memcpy(p, &len, STRING_HEADER_SIZE);
+        std::memcpy(p + STRING_HEADER_SIZE, s.data(), len);
+        p[STRING_HEADER_SIZE + len] = '\0';
+        auto id = block << STRING_BLOCK_SHIFT | offset;
+        // nothing else goes into a block of its own
+        offset = std::min(offset + needed, STRING_BLOCK_SIZE);
+        ids.emplace(std::string_view(p + STRING_HEADER_SIZE, len), id);
+        return id;
+    }
+
+    u32 intern(std::string_view s)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (auto it = ids.find(s); it != ids.end())
+            return it->second;
+        return push(s);
+    }
+
+    std::string_view get(u32 id) const
+    {
+        const char *p = blocks[id >> STRING_BLOCK_SHIFT].load(std::memory_order_acquire)
+                      + (id & (STRING_BLOCK_SIZE - 1));
+        u32 len;
+        std::memcpy(&len, p, STRING_HEADER_SIZE);
+        return { p + STRING_HEADER_SIZE, len };
+    }
+};
+
+StringArena &strings()
+{
+    static StringArena arena;
+    return arena;
+}
+
+/*
+ * Directories are nodes of a tree, stored inside fixed-size blocks of nodes.
+ * Node 0 is the root of the tree and corresponds to an empty path. Each node
+ * also holds its full path, interned when the node is created, so that it
+ * doesn't have to be rebuilt from the ancestors every time it's asked for.
+ * Once every block is taken, interning a new directory throws
+ * std::length_error.
+ */
+constexpr u32 DIR_BLOCK_SHIFT = 14;
+constexpr u32 DIR_BLOCK_SIZE  = 1u << DIR_BLOCK_SHIFT;
+constexpr u32 DIR_MAX_BLOCKS  = 1u << 12;
+
+struct Node {
+    u32 parent;
+    String name;
+    String path;
+};
+
+struct DirTree {
+    std::array<std::atomic<Node *>, DIR_MAX_BLOCKS> blocks = {};
+    std::unordered_map<u64, u32> children;
+    std::mutex lock;
+    u32 count = 0;
+
+    DirTree() { push(0, String{}, String{}); }
+
+    ~DirTree()
+    {
+        for (auto &b : blocks)
+            delete[] b.load(std::memory_order_relaxed);
+    }
+
+    u32 push(u32 parent, String name, String path)
+    {
+        if (count == DIR_BLOCK_SIZE * DIR_MAX_BLOCKS)
+            throw std::length_error("intern: directory tree is full");
+        auto block = count >> DIR_BLOCK_SHIFT;
+        if ((count & (DIR_BLOCK_SIZE - 1)) == 0)
+            blocks[block].store(new Node[DIR_BLOCK_SIZE], std::memory_order_release);
+        blocks[block].load(std::memory_order_relaxed)[count & (DIR_BLOCK_SIZE - 1)] = { parent, name, path };
+        return count++;
+    }
+
+    u32 child(u32 parent, String name)
+    {
+        auto key = u64(parent) << 32 | name.handle();
+        if (auto it = children.find(key); it != children.end())
+            return it->second;
+        auto path = String((fs::path(get(parent).path.view()) / name.view()).string());
+        auto id = push(parent, name, path);
+        children.emplace(key, id);
+        return id;
+    }
+
+    u32 intern(const fs::path &path)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        u32 id = 0;
+        for (const auto &component : path)
+            if (auto s = component.string(); !s.empty())
+                id = child(id, String(s));
+        return id;
+    }
+
+    const Node &get(u32 id) const
+    {
+        return blocks[id >> DIR_BLOCK_SHIFT].load(std::memory_order_acquire)[id & (DIR_BLOCK_SIZE - 1)];
+    }
+};
+
+DirTree &dirs()
+{
+    static DirTree tree;
+    return tree;
+}
+
+} // namespace
+
+namespace detail {
+    std::string_view lookup_string(u32 id)     { return strings().get(id); }
+    u32 intern_string(std::string_view s)      { return strings().intern(s); }
+} // namespace detail
+
+Dir::Dir(const fs::path &path) : id{dirs().intern(path)} {}
+
+fs::path Dir::path() const { return fs::path(dirs().get(id).path.view()); }
+
+Dir Dir::parent() const
+{
+    Dir p;
+    p.id = dirs().get(id).parent;
+    return p;
+}
+
+String Dir::name() const { return dirs().get(id).name; }
+
+} // namespace intern
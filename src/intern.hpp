@@ -0,0 +1,98 @@
+/*
+ * This is a small library for interning strings and paths. Its purpose is to
+ * store the same strings (game names, authors, systems, directories...) only
+ * once, no matter how many times they are found, and to refer to them
+ * through 32-bit handles.
+ *
+ * Two kinds of handles are provided: a String, which refers to a string
+ * stored in a global arena, and a Dir, which refers to a node inside a
+ * global prefix tree of directories. A full path is then simply a Dir plus a
+ * String for the file name.
+ *
+ * The storage behind both handles is append-only: nothing is ever moved or
+ * freed, which means views returned by a handle stay valid for the entire
+ * duration of the program and can be read from any thread without locks.
+ * Interning new values is thread-safe too (a mutex is taken). Handles are
+ * 32 bits, so the storage is bounded (4 GiB of strings, 64M directories):
+ * interning past that throws std::length_error.
+ *
+ * More specific documentation can be found below.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include "common.hpp"
+
+namespace intern {
+
+namespace detail {
+    std::string_view lookup_string(u32 id);
+    u32 intern_string(std::string_view s);
+} // namespace detail
+
+/*
+ * A handle to an interned string. A default-constructed String is always the
+ * empty string. Two Strings compare equal iff they have the same contents.
+ * Note that comparisons are on handles and NOT lexicographical.
+ *
+ * @view: returns the contents. The view is valid forever;
+ * @str: same as above, but copies into an std::string;
+ * @handle: returns the underlying handle;
+ */
+class String {
+    u32 id = 0;
+
+public:
+    String() = default;
+    explicit String(std::string_view s) : id{detail::intern_string(s)} {}
+    explicit String(const char *s)      : String(std::string_view(s ? s : "")) {}
+
+    std::string_view view()   const { return detail::lookup_string(id); }
+    std::string      str()    const { return std::string(view()); }
+    u32              handle() const { return id; }
+    bool             empty()  const { return id == 0; }
+    operator std::string_view() const { return view(); }
+
+    friend bool operator==(String a, String b) { return a.id == b.id; }
+};
+
+/*
+ * A handle to an interned directory. Directories are stored as a tree, where
+ * each node only contains its parent and its name, so that the common prefix
+ * of thousands of paths is only stored once.
+ *
+ * @path: returns the full path of the directory, which is stored along with
+ *        the node when it's interned;
+ * @parent, @name: return the node's parent and the last component of the path;
+ */
+class Dir {
+    u32 id = 0;
+
+public:
+    Dir() = default;
+    explicit Dir(const std::filesystem::path &path);
+
+    std::filesystem::path path() const;
+    Dir                   parent() const;
+    String                name() const;
+    u32                   handle() const { return id; }
+
+    friend bool operator==(Dir a, Dir b) { return a.id == b.id; }
+};
+
+} // namespace intern
+
+template <>
+struct std::hash<intern::String> {
+    std::size_t operator()(intern::String s) const noexcept { return s.handle(); }
+};
+
+template <>
+struct std::hash<intern::Dir> {
+    std::size_t operator()(intern::Dir d) const noexcept { return d.handle(); }
+};
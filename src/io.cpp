@@ -93,6 +93,9 @@ Result<std::pair<u8 *, std::size_t>> open_mapped_file(std::filesystem::path path
     if (ptr == MAP_FAILED)
         return tl::unexpected(make_error());
     close(fd);
+    // the whole file is usually read right away
+    if (access == Access::Read)
+        madvise(ptr, statbuf.st_size, MADV_WILLNEED);
     return std::make_pair(ptr, static_cast<std::size_t>(statbuf.st_size));
 }
 
@@ -149,6 +152,19 @@ std::filesystem::path data()
 #endif
 }
 
+std::filesystem::path cache()
+{
+#ifdef PLATFORM_WINDOWS
+    return data();
+#elif defined(PLATFORM_MACOS)
+    return home() / "Library/Caches";
+#else
+    if (auto *env = getenv("XDG_CACHE_HOME"))
+        return fs::path(env);
+    return home() / fs::path(".cache");
+#endif
+}
+
 std::filesystem::path applications()
 {
 #ifdef PLATFORM_WINDOWS
@@ -18,10 +18,12 @@
 #include <cstdlib>
 #include <cerrno>
 #include <filesystem>
+#include <memory>
 #include <optional>
 #include <span>
 #include <string>
 #include <string_view>
+#include <vector>
 #include <tl/expected.hpp>
 #include "common.hpp"
 
@@ -137,6 +139,9 @@ public:
  * will be described.
  *
  * @open: a static method for opening MappedFiles, same as File::open;
+ * @from_memory: makes a read-only MappedFile out of data that is already in
+ *               memory (e.g. decompressed), which is kept alive for as long
+ *               as the MappedFile is;
  * @slice: returns a slice, i.e. a part of the file's contents;
  * @filename and @file_path: return, respectively, the file's name and file's
  *                           path, just like in File;
@@ -145,13 +150,15 @@ class MappedFile {
     u8 *ptr = nullptr;
     std::size_t len = 0;
     std::filesystem::path filepath;
+    // set when the data isn't mapped, but owned by someone else
+    std::shared_ptr<const std::vector<u8>> owner;
 
     MappedFile(u8 *p, std::size_t s, std::filesystem::path pa)
         : ptr{p}, len{s}, filepath{pa}
     { }
 
 public:
-    ~MappedFile() { detail::close_mapped_file(ptr, len); }
+    ~MappedFile() { if (!owner) detail::close_mapped_file(ptr, len); }
 
     MappedFile(const MappedFile &) = delete;
     MappedFile & operator=(const MappedFile &) = delete;
@@ -161,6 +168,7 @@ public:
         std::swap(ptr, m.ptr);
         std::swap(len, m.len);
         std::swap(filepath, m.filepath);
+        std::swap(owner, m.owner);
         return *this;
     }
 
@@ -172,7 +180,21 @@ public:
         return MappedFile(v.value().first, v.value().second, path);
     }
 
-    int close() { auto r = detail::close_mapped_file(ptr, len); ptr = nullptr; len = 0; return r; }
+    static MappedFile from_memory(std::shared_ptr<const std::vector<u8>> data, std::filesystem::path path)
+    {
+        auto f = MappedFile(const_cast<u8 *>(data->data()), data->size(), std::move(path));
+        f.owner = std::move(data);
+        return f;
+    }
+
+    int close()
+    {
+        auto r = owner ? 0 : detail::close_mapped_file(ptr, len);
+        ptr = nullptr;
+        len = 0;
+        owner.reset();
+        return r;
+    }
 
     using value_type      = u8;
     using size_type       = std::size_t;
@@ -226,6 +248,7 @@ namespace directory {
 std::filesystem::path home();
 std::filesystem::path config();
 std::filesystem::path data();
+std::filesystem::path cache();
 std::filesystem::path applications();
 
 } // namespace directory
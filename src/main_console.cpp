@@ -1,13 +1,18 @@
 #include <SDL.h>
 #include <fmt/core.h>
+#include <optional>
 #include <system_error>
 #include "player.hpp"
+#include "playlist_file.hpp"
 #include "mpris_server.hpp"
 #include "config.hpp"
 #include "audio.hpp"
 #include "io.hpp"
+#include "archive.hpp"
 #include "terminal.hpp"
 #include "math.hpp"
+#include "scan.hpp"
+#include "watch.hpp"
 
 #include "gsf.h"
 
@@ -23,6 +28,11 @@ struct Status {
     bool repeat_track;
     int position;
     int length;
+    std::optional<std::string> query = std::nullopt;
+    int matches = 0;
+    gmplayer::Level level = {};
+    bool clipping = false;
+    std::optional<scan::Progress> scan = std::nullopt;
 };
 
 const int FILE_INFO_HEIGHT = 10;
@@ -55,16 +65,24 @@ std::string make_slider(int pos, int length, int term_width)
     return s;
 }
 
+// peak as a light bar, rms as a solid one
+std::string make_meter(gmplayer::Level level, int width)
+{
+    auto to_width = [&](f32 x) { return std::clamp(int(x * width), 0, width); };
+    auto peak = to_width(level.peak), rms = std::min(to_width(level.rms), peak);
+    return std::string(rms, '#') + std::string(peak - rms, '=') + std::string(width - peak, ' ');
+}
+
 std::string make_space(int newlines) { return std::string(newlines, '\n'); }
 
-void print_file_info(const io::MappedFile &f, int num_tracks)
+void print_file_info(const gmplayer::FileRecord &f, int num_tracks)
 {
     fmt::print("\r\e[{}A"
                "\e[KFile: {}\n"
                "\e[KNumber of tracks: {}\n"
                "{}",
                FILE_INFO_HEIGHT,
-               f.name(), num_tracks,
+               f.name.view(), num_tracks,
                make_space(TRACK_INFO_HEIGHT));
     std::fflush(stdout);
 }
@@ -81,17 +99,27 @@ void print_metadata(const gmplayer::Metadata &m)
                "\e[KDumper: {}\n"
                "{}",
                TRACK_INFO_HEIGHT,
-               m.info[Song], m.info[Author], m.info[Game],
-               m.info[System], m.info[Comment], m.info[Dumper],
+               m.info[Song].view(), m.info[Author].view(), m.info[Game].view(),
+               m.info[System].view(), m.info[Comment].view(), m.info[Dumper].view(),
                make_space(STATUS_HEIGHT));
     std::fflush(stdout);
 }
 
+std::string make_search_line(const std::string &query, int matches)
+{
+    return fmt::format("/{} ({} matches)", query, matches);
+}
+
+std::string make_scan_line(scan::Progress progress)
+{
+    return fmt::format("Looking for files... {} found in {} folders (x to cancel)", progress.found, progress.dirs);
+}
+
 void update_status(const Status &status) {
     auto [width, _] = get_terminal_size();
     fmt::print("\r\e[{}A"
-               "\e[K{}{} Tempo: {:.03}x Volume: {}\% [{}] Autoplay [{}] Repeat file [{}] Repeat track\n"
-               "\e[K[{}]\n",
+               "\e[K{}{} Tempo: {:.03}x Volume: {}\% [{}] Autoplay [{}] Repeat file [{}] Repeat track [{}]{}\n"
+               "\e[K{}\n",
                STATUS_HEIGHT,
                status.paused ? "(Paused) " : "",
                format_position(status.position, status.length),
@@ -100,7 +128,11 @@ void update_status(const Status &status) {
                status.autoplay     ? "X" : " ",
                status.repeat_file  ? "X" : " ",
                status.repeat_track ? "X" : " ",
-               make_slider(status.position, status.length, width - 2));
+               make_meter(status.level, 10),
+               status.clipping ? " CLIP" : "",
+               status.query ? make_search_line(status.query.value(), status.matches)
+             : status.scan  ? make_scan_line(status.scan.value())
+                            : fmt::format("[{}]", make_slider(status.position, status.length, width - 2)));
     std::fflush(stdout);
 }
 
@@ -133,7 +165,8 @@ int main(int argc, char *argv[])
             fmt::print("{}\n", e.message());
     }
 
-    gmplayer::Player player;
+    gmplayer::Engine engine;
+    gmplayer::Player player(engine);
     player.mpris_server().set_desktop_entry(io::directory::applications() / "gmplayer.desktop");
     player.mpris_server().set_identity("gmplayer");
     player.mpris_server().set_supported_uri_schemes({"file"});
@@ -150,41 +183,41 @@ int main(int argc, char *argv[])
     bool running = true;
     Status status = {
         .paused       = true,
-        .tempo        = config.get<int>("tempo"),
-        .volume       = config.get<int>("volume"),
-        .autoplay     = config.get<bool>("autoplay"),
-        .repeat_file  = config.get<bool>("repeat_file"),
-        .repeat_track = config.get<bool>("repeat_track"),
+        .tempo        = config.get(cfg::tempo),
+        .volume       = config.get(cfg::volume),
+        .autoplay     = config.get(cfg::autoplay),
+        .repeat_file  = config.get(cfg::repeat_file),
+        .repeat_track = config.get(cfg::repeat_track),
         .position     = 0,
         .length       = 0,
     };
     Terminal term;
 
-    config.when_set("volume", [&] (const conf::Value &value) {
+    config.when_set(cfg::volume, [&] (const conf::Value &value) {
         status.volume = value.as<int>();
         if (player.is_playing())
             update_status(status);
     });
 
-    config.when_set("tempo", [&] (const conf::Value &value) {
+    config.when_set(cfg::tempo, [&] (const conf::Value &value) {
         status.tempo = value.as<int>();
         if (player.is_playing())
             update_status(status);
     });
 
-    config.when_set("autoplay", [&] (const conf::Value &value) {
+    config.when_set(cfg::autoplay, [&] (const conf::Value &value) {
         status.autoplay = value.as<bool>();
         if (player.is_playing())
             update_status(status);
     });
 
-    config.when_set("repeat_file", [&] (const conf::Value &value) {
+    config.when_set(cfg::repeat_file, [&] (const conf::Value &value) {
         status.repeat_file = value.as<bool>();
         if (player.is_playing())
             update_status(status);
     });
 
-    config.when_set("repeat_track", [&] (const conf::Value &value) {
+    config.when_set(cfg::repeat_track, [&] (const conf::Value &value) {
         status.repeat_track = value.as<bool>();
         if (player.is_playing())
             update_status(status);
@@ -195,23 +228,28 @@ int main(int argc, char *argv[])
         running = false;
     });
 
-    player.on_playlist_changed([&] (gmplayer::Playlist::Type type) {
-        if (type == gmplayer::Playlist::Type::File && player.file_count() > 0) {
+    player.on_playlist_edited([&] (gmplayer::Playlist::Type type, std::span<const gmplayer::Playlist::Change> changes) {
+        // only the first files added start playing, as directories are added
+        // a bit at a time
+        if (type == gmplayer::Playlist::Type::File && changes[0].kind == gmplayer::Playlist::Change::Insert
+         && changes[0].first == 0) {
             player.load_pair(0, 0);
             player.start_or_resume();
         }
     });
 
-    player.on_shuffled([&] (gmplayer::Playlist::Type type) {
-        if (player.is_playing())
-            if (type == gmplayer::Playlist::Track)
-                player.load_track(0);
-            else
-                player.load_pair(0, 0);
-    });
-
+    u64 last_clips = 0;
+    int clip_hold = 0;
     player.on_position_changed([&] (int pos) {
         status.position = pos;
+        // keep the clip indicator on for about a second
+        auto levels = player.levels();
+        if (levels.clips != last_clips)
+            clip_hold = 20;
+        last_clips = levels.clips;
+        status.level = levels.master;
+        status.clipping = clip_hold > 0;
+        clip_hold = std::max(clip_hold - 1, 0);
         if (player.is_playing())
             update_status(status);
     });
@@ -228,7 +266,7 @@ int main(int argc, char *argv[])
     });
 
     player.on_track_ended([&] {
-        if (config.get<bool>("autoplay")) {
+        if (config.get(cfg::autoplay)) {
             player.next();
         }
     });
@@ -249,12 +287,27 @@ int main(int argc, char *argv[])
     });
 
     fmt::print("Listening...\n");
+    std::unique_ptr<scan::DirectoryScan> dir_scan;
     if (argc > 1) {
-        auto files = get_files(argc, argv);
+        // directories (and archives) are scanned in the background, files
+        // are added right away
+        std::vector<fs::path> files, dirs;
+        for (auto &p : get_files(argc, argv)) {
+            std::error_code ec;
+            (fs::is_directory(p, ec) || archive::is_archive(p) ? dirs : files).push_back(p);
+        }
         if (auto file_errors = player.add_files(files); !file_errors.empty())
             for (auto &e : file_errors)
                 fmt::print("error: {}: {}\n", e.first.string(), e.second.message());
-    }
+        if (!dirs.empty())
+            dir_scan = std::make_unique<scan::DirectoryScan>(dirs);
+    } else if (auto session = gmplayer::read_session(gmplayer::session_path()); session)
+        player.restore(session.value());
+
+    // folders watched from the gui are followed here too
+    auto watcher = watch::make_watcher();
+    for (auto &dir : conf::convert_list_no_errors<fs::path, std::string>(config.get(cfg::watched_dirs)))
+        watcher->add(dir);
 
     while (running) {
         for (SDL_Event ev; SDL_PollEvent(&ev); ) {
@@ -265,7 +318,26 @@ int main(int argc, char *argv[])
             }
         }
 
-        if (auto [has_input, c] = term.get_input(); has_input) {
+        if (auto [has_input, c] = term.get_input(); has_input && status.query) {
+            // search mode: type a query, enter plays the first matching file
+            auto &query = status.query.value();
+            if (c == '\n') {
+                auto found = player.search(gmplayer::Playlist::File, query);
+                status.query.reset();
+                if (!found.empty())
+                    player.load_pair(found[0], 0);
+            } else if (c == '\e') {
+                status.query.reset();
+            } else {
+                if (c == 127 || c == '\b') {
+                    if (!query.empty())
+                        query.pop_back();
+                } else
+                    query += c;
+                status.matches = player.search(gmplayer::Playlist::File, query).size();
+            }
+            update_status(status);
+        } else if (has_input) {
             switch (c) {
             case 'h':
                 player.seek_relative(-1_sec);
@@ -280,13 +352,13 @@ int main(int argc, char *argv[])
                 player.prev();
                 break;
             case 'a':
-                config.set<bool>("autoplay", !config.get<bool>("autoplay"));
+                config.set(cfg::autoplay, !config.get(cfg::autoplay));
                 break;
             case 'r':
-                config.set<bool>("repeat_file", !config.get<bool>("repeat_file"));
+                config.set(cfg::repeat_file, !config.get(cfg::repeat_file));
                 break;
             case 't':
-                config.set<bool>("repeat_track", !config.get<bool>("repeat_track"));
+                config.set(cfg::repeat_track, !config.get(cfg::repeat_track));
                 break;
             case 's':
                 player.shuffle(gmplayer::Playlist::File);
@@ -295,37 +367,65 @@ int main(int argc, char *argv[])
                 player.shuffle(gmplayer::Playlist::Track);
                 break;
             case '7': {
-                if (auto tempo = config.get<int>("tempo") - 1; tempo >= 0)
-                    config.set<int>("tempo", tempo);
+                if (auto tempo = config.get(cfg::tempo) - 1; tempo >= 0)
+                    config.set(cfg::tempo, tempo);
                 break;
             }
             case '8':{
-                if (auto tempo = config.get<int>("tempo") + 1; tempo <= MAX_TEMPO_VALUE)
-                    config.set<int>("tempo", tempo);
+                if (auto tempo = config.get(cfg::tempo) + 1; tempo <= MAX_TEMPO_VALUE)
+                    config.set(cfg::tempo, tempo);
                 break;
             }
             case '9': {
-                if (auto volume = config.get<int>("volume") - 1; volume >= 0)
-                    config.set<int>("volume", volume);
+                if (auto volume = config.get(cfg::volume) - 1; volume >= 0)
+                    config.set(cfg::volume, volume);
                 break;
             }
             case '0': {
-                if (auto volume = config.get<int>("volume") + 1; volume <= MAX_VOLUME_VALUE)
-                    config.set<int>("volume", volume);
+                if (auto volume = config.get(cfg::volume) + 1; volume <= MAX_VOLUME_VALUE)
+                    config.set(cfg::volume, volume);
                 break;
             }
             case ' ':
                 player.play_pause();
                 break;
+            case '/':
+                status.query = "";
+                status.matches = player.file_count();
+                update_status(status);
+                break;
+            case 'x':
+                if (dir_scan)
+                    dir_scan->cancel();
+                break;
             case 'q':
                 running = false;
                 break;
             }
         }
 
+        if (dir_scan) {
+            auto done = dir_scan->done();
+            if (auto found = dir_scan->take(); !found.empty())
+                player.add_files(found.paths, found.hashes);
+            auto progress = dir_scan->progress();
+            if (done)
+                dir_scan.reset();
+            if (auto scan = done ? std::nullopt : std::optional{progress}; scan != status.scan) {
+                status.scan = scan;
+                update_status(status);
+            }
+        }
+
+        if (auto changes = watcher->take(); !changes.empty())
+            player.update_library(changes);
+
+        player.dispatch_events();
         SDL_Delay(16);
     }
 
+    if (auto err = gmplayer::write_session(gmplayer::session_path(), player.session()); err)
+        fmt::print(stderr, "error: couldn't save session: {}\n", err.message());
     config.save();
     SDL_Quit();
     return 0;
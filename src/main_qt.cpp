@@ -8,6 +8,7 @@
 #include <QSettings>
 #include <QUrl>
 #include "player.hpp"
+#include "playlist_file.hpp"
 #include "mpris_server.hpp"
 #include "config.hpp"
 #include "audio.hpp"
@@ -45,7 +46,8 @@ int main(int argc, char *argv[])
         msgbox("Errors were found while parsing the configuration file.", QString::fromStdString(errors_str));
     }
 
-    gmplayer::Player player;
+    gmplayer::Engine engine;
+    gmplayer::Player player(engine);
     player.mpris_server().set_desktop_entry(QStandardPaths::locate(QStandardPaths::ApplicationsLocation, "gmplayer.desktop").toStdString());
     player.mpris_server().set_identity("gmplayer");
     player.mpris_server().set_supported_uri_schemes({"file"});
@@ -82,12 +84,15 @@ int main(int argc, char *argv[])
             main_window.open_files(files, { gui::OpenFilesFlags::AddToRecent,
                                             gui::OpenFilesFlags::ClearAndPlay });
         }
-    }
+    } else if (auto session = gmplayer::read_session(gmplayer::session_path()); session)
+        player.restore(session.value());
 
     a.exec();
 
     sdl_running = false;
     sdl_thread.join();
+    if (auto err = gmplayer::write_session(gmplayer::session_path(), player.session()); err)
+        fmt::print(stderr, "error: couldn't save session: {}\n", err.message());
     config.save();
     SDL_Quit();
     return 0;
@@ -1,6 +1,10 @@
 #include "mpris_server.hpp"
 
 #ifndef MPRIS_SERVER_NO_IMPL
+    #include <chrono>
+    #include <condition_variable>
+    #include <mutex>
+    #include <thread>
     #include <sdbus-c++/sdbus-c++.h>
 #endif
 
@@ -9,6 +13,21 @@ namespace mpris {
 #ifndef MPRIS_SERVER_NO_IMPL
 
 struct SDBusServer : public Server {
+    // how long changes are collected before being sent
+    static constexpr auto TICK = std::chrono::milliseconds(50);
+
+    using Properties = std::map<std::string, sdbus::Variant>;
+    std::mutex pending_mutex;
+    std::condition_variable_any pending_cond;
+    std::map<std::string, Properties> pending;
+    std::vector<std::function<void(void)>> pending_signals;
+    std::jthread flusher;
+
+    static std::vector<sdbus::ObjectPath> to_paths(const StringList &ids)
+    {
+        return std::vector<sdbus::ObjectPath>(ids.begin(), ids.end());
+    }
+
     explicit SDBusServer(std::string_view name) : Server(name)
     {
         connection = sdbus::createSessionBusConnection();
@@ -33,7 +52,7 @@ struct SDBusServer : public Server {
                                                                          .withSetter(M(set_fullscreen_external));
         object->registerProperty("CanSetFullscreen")    .onInterface(MP2).withGetter([&] { return bool(fullscreen_changed_fn); });
         object->registerProperty("CanRaise")            .onInterface(MP2).withGetter([&] { return bool(raise_fn); });
-        object->registerProperty("HasTrackList")        .onInterface(MP2).withGetter([&] { return false; });
+        object->registerProperty("HasTrackList")        .onInterface(MP2).withGetter([&] { return has_track_list(); });
         object->registerProperty("Identity")            .onInterface(MP2).withGetter([&] { return identity; });
         object->registerProperty("DesktopEntry")        .onInterface(MP2).withGetter([&] { return desktop_entry; });
         object->registerProperty("SupportedUriSchemes") .onInterface(MP2).withGetter([&] { return supported_uri_schemes; });
@@ -49,7 +68,7 @@ struct SDBusServer : public Server {
         object->registerProperty("Metadata")      .onInterface(MP2P).withGetter([&] { return metadata; });
         object->registerProperty("Volume")        .onInterface(MP2P).withGetter([&] { return volume; })
                                                                     .withSetter(M(set_volume_external));
-        object->registerProperty("Position")      .onInterface(MP2P).withGetter([&] { return position; });
+        object->registerProperty("Position")      .onInterface(MP2P).withGetter([&] { return get_position(); });
         object->registerProperty("MinimumRate")   .onInterface(MP2P).withGetter([&] { return minimum_rate; });
         object->registerProperty("MaximumRate")   .onInterface(MP2P).withGetter([&] { return maximum_rate; });
         object->registerProperty("CanGoNext")     .onInterface(MP2P).withGetter([&] { return can_go_next(); });
@@ -58,18 +77,108 @@ struct SDBusServer : public Server {
         object->registerProperty("CanPause")      .onInterface(MP2P).withGetter([&] { return can_pause(); });
         object->registerProperty("CanSeek")       .onInterface(MP2P).withGetter([&] { return can_seek(); });
         object->registerProperty("CanControl")    .onInterface(MP2P).withGetter([&] { return can_control(); });
+
+        object->registerMethod("GetTracksMetadata").onInterface(MP2T).implementedAs(M(get_tracks_metadata)).withInputParamNames("TrackIds")
+                                                                                                      .withOutputParamNames("Metadata");
+        object->registerMethod("AddTrack")         .onInterface(MP2T).implementedAs([&] (const std::string &, sdbus::ObjectPath, bool) {
+            throw sdbus::Error(service_name + ".Error", "Cannot add tracks (CanEditTracks is false).");
+        }).withInputParamNames("Uri", "AfterTrack", "SetAsCurrent");
+        object->registerMethod("RemoveTrack")      .onInterface(MP2T).implementedAs([&] (sdbus::ObjectPath) {
+            throw sdbus::Error(service_name + ".Error", "Cannot remove tracks (CanEditTracks is false).");
+        }).withInputParamNames("TrackId");
+        object->registerMethod("GoTo")             .onInterface(MP2T).implementedAs([&] (sdbus::ObjectPath id) {
+            if (go_to_fn)
+                go_to_fn(id);
+        }).withInputParamNames("TrackId");
+        object->registerProperty("Tracks")         .onInterface(MP2T).withGetter([&] { return to_paths(tracks_fn ? tracks_fn() : StringList{}); });
+        object->registerProperty("CanEditTracks")  .onInterface(MP2T).withGetter([&] { return false; });
 #undef M
 
         object->registerSignal("Seeked").onInterface(MP2P).withParameters<int64_t>("Position");
+        object->registerSignal("TrackListReplaced")   .onInterface(MP2T).withParameters<std::vector<sdbus::ObjectPath>, sdbus::ObjectPath>("Tracks", "CurrentTrack");
+        object->registerSignal("TrackAdded")          .onInterface(MP2T).withParameters<Metadata, sdbus::ObjectPath>("Metadata", "AfterTrack");
+        object->registerSignal("TrackRemoved")        .onInterface(MP2T).withParameters<sdbus::ObjectPath>("TrackId");
+        object->registerSignal("TrackMetadataChanged").onInterface(MP2T).withParameters<sdbus::ObjectPath, Metadata>("TrackId", "Metadata");
 
         object->finishRegistration();
+
+        flusher = std::jthread([this] (std::stop_token stop) { flush_loop(stop); });
+    }
+
+    // Sends one PropertiesChanged per interface for everything changed
+    // during a tick, on a thread of its own so that callers never wait on
+    // the bus.
+    void flush_loop(std::stop_token stop)
+    {
+        for (;;) {
+            std::map<std::string, Properties> batch;
+            std::vector<std::function<void(void)>> signals;
+            {
+                std::unique_lock lock(pending_mutex);
+                if (!pending_cond.wait(lock, stop, [&] { return !pending.empty() || !pending_signals.empty(); }))
+                    return;
+                pending_cond.wait_for(lock, stop, TICK, [] { return false; });
+                if (stop.stop_requested())
+                    return;
+                batch.swap(pending);
+                signals.swap(pending_signals);
+            }
+            for (auto &emit : signals)
+                emit();
+            for (auto &[interface, props] : batch)
+                object->emitSignal("PropertiesChanged").onInterface(PROPS).withArguments(interface, props, std::vector<std::string>{});
+        }
     }
 
     void prop_changed(const std::string &interface, const std::string &name, sdbus::Variant value)
     {
-        std::map<std::string, sdbus::Variant> d;
-        d[name] = value;
-        object->emitSignal("PropertiesChanged").onInterface("org.freedesktop.DBus.Properties").withArguments(interface, d, std::vector<std::string>{});
+        {
+            std::lock_guard lock(pending_mutex);
+            pending[interface][name] = std::move(value);
+        }
+        pending_cond.notify_one();
+    }
+
+    void queue_signal(std::function<void(void)> emit)
+    {
+        {
+            std::lock_guard lock(pending_mutex);
+            pending_signals.push_back(std::move(emit));
+        }
+        pending_cond.notify_one();
+    }
+
+    void track_list_replaced(const StringList &tracks, const std::string &current)
+    {
+        queue_signal([this, tracks = to_paths(tracks), current = sdbus::ObjectPath(current)] {
+            object->emitSignal("TrackListReplaced").onInterface(MP2T).withArguments(tracks, current);
+        });
+    }
+
+    void track_added(const Metadata &metadata, const std::string &after)
+    {
+        queue_signal([this, metadata, after = sdbus::ObjectPath(after)] {
+            object->emitSignal("TrackAdded").onInterface(MP2T).withArguments(metadata, after);
+        });
+    }
+
+    void track_removed(const std::string &track)
+    {
+        queue_signal([this, track = sdbus::ObjectPath(track)] {
+            object->emitSignal("TrackRemoved").onInterface(MP2T).withArguments(track);
+        });
+    }
+
+    void track_metadata_changed(const std::string &track, const Metadata &metadata)
+    {
+        queue_signal([this, track = sdbus::ObjectPath(track), metadata] {
+            object->emitSignal("TrackMetadataChanged").onInterface(MP2T).withArguments(track, metadata);
+        });
+    }
+
+    std::vector<Metadata> get_tracks_metadata(const std::vector<sdbus::ObjectPath> &ids)
+    {
+        return tracks_metadata_fn ? tracks_metadata_fn(StringList(ids.begin(), ids.end())) : std::vector<Metadata>{};
     }
 
     void control_props_changed(std::initializer_list<std::string_view> args)
@@ -82,13 +191,9 @@ struct SDBusServer : public Server {
             if (name == "CanSeek")       return can_seek();
             return false;
         };
-        std::map<std::string, sdbus::Variant> d;
         for (auto s : args)
             if (f(s))
-                d[std::string(s)] = true;
-        // auto g = [&] (const std::string &v) { if (f(v)) d[v] = true; };
-        // (g(args), ...);
-        object->emitSignal("PropertiesChanged").onInterface("org.freedesktop.DBus.Properties").withArguments(MP2P, d, std::vector<std::string>{});
+                prop_changed(MP2P, std::string(s), true);
     }
 
     void set_fullscreen_external(bool value)
@@ -143,7 +248,7 @@ struct SDBusServer : public Server {
         if (!can_seek())
             return;
         auto tid = metadata.find(detail::field_to_string(Field::TrackId));
-        if (tid == metadata.end() || tid->second.get<std::string>() != id)
+        if (tid == metadata.end() || tid->second.get<sdbus::ObjectPath>() != id)
             return;
         set_position_fn(pos);
     }
@@ -179,6 +284,10 @@ struct EmptyServer : public Server {
     void start_loop() { }
     void start_loop_async() { }
     void send_seeked_signal(int64_t position) { }
+    void track_list_replaced(const StringList &tracks, const std::string &current) { }
+    void track_added(const Metadata &metadata, const std::string &after) { }
+    void track_removed(const std::string &track) { }
+    void track_metadata_changed(const std::string &track, const Metadata &metadata) { }
 };
 
 std::unique_ptr<Server> make_server(std::string_view name, bool create_empty)
@@ -32,7 +32,10 @@ struct Variant {
     Variant(const T &) { }
 };
 
-struct ObjectPath { };
+struct ObjectPath {
+    ObjectPath() = default;
+    ObjectPath(std::string) { }
+};
 struct IConnection { };
 struct IObject { };
 
@@ -51,6 +54,8 @@ static const auto PREFIX      = "org.mpris.MediaPlayer2."s;
 static const auto OBJECT_PATH = "/org/mpris/MediaPlayer2"s;
 static const auto MP2         = "org.mpris.MediaPlayer2"s;
 static const auto MP2P        = "org.mpris.MediaPlayer2.Player"s;
+static const auto MP2T        = "org.mpris.MediaPlayer2.TrackList"s;
+static const auto NO_TRACK    = "/org/mpris/MediaPlayer2/TrackList/NoTrack"s;
 static const auto PROPS       = "org.freedesktop.DBus.Properties"s;
 
 enum class PlaybackStatus { Playing, Paused, Stopped };
@@ -116,6 +121,10 @@ protected:
     std::function<void(double)>             rate_changed_fn;
     std::function<void(bool)>               shuffle_changed_fn;
     std::function<void(double)>             volume_changed_fn;
+    std::function<int64_t(void)>            position_fn;
+    std::function<StringList(void)>         tracks_fn;
+    std::function<std::vector<Metadata>(const StringList &)> tracks_metadata_fn;
+    std::function<void(std::string_view)>   go_to_fn;
 
     bool fullscreen                  = false;
     std::string identity             = "";
@@ -132,6 +141,8 @@ protected:
     double maximum_rate              = 1.0;
     double minimum_rate              = 1.0;
 
+    // changes are batched: implementations may send them some time later,
+    // together with the other changes made in the meantime
     virtual void prop_changed(const std::string &interface, const std::string &name, sdbus::Variant value) = 0;
     virtual void control_props_changed(std::initializer_list<std::string_view> args) = 0;
     virtual void set_fullscreen_external(bool value) = 0;
@@ -159,6 +170,7 @@ public:
     bool can_play()        const { return can_control() && bool(play_fn)      && bool(play_pause_fn);   }
     bool can_pause()       const { return can_control() && bool(pause_fn)     && bool(play_pause_fn);   }
     bool can_seek()        const { return can_control() && bool(seek_fn)      && bool(set_position_fn); }
+    bool has_track_list()  const { return bool(tracks_fn) && bool(tracks_metadata_fn);                  }
 
     void on_quit                ( auto &&fn) { quit_fn                = fn; prop_changed(MP2, "CanQuit", true);                                                    }
     void on_raise               ( auto &&fn) { raise_fn               = fn; prop_changed(MP2, "CanQuit", true);                                                    }
@@ -177,6 +189,13 @@ public:
     void on_shuffle_changed     ( auto &&fn) { shuffle_changed_fn     = fn; control_props_changed({"CanGoNext", "CanGoPrevious", "CanPause", "CanPlay", "CanSeek"}); }
     void on_volume_changed      ( auto &&fn) { volume_changed_fn      = fn; control_props_changed({"CanGoNext", "CanGoPrevious", "CanPause", "CanPlay", "CanSeek"}); }
 
+    // The track list is never stored here: ids are asked for when a client
+    // wants them, and so is their metadata. Both should be bounded, as they
+    // go out in a single message.
+    void on_tracks_requested         (auto &&fn) { tracks_fn          = fn; prop_changed(MP2, "HasTrackList", has_track_list());                          }
+    void on_tracks_metadata_requested(auto &&fn) { tracks_metadata_fn = fn; prop_changed(MP2, "HasTrackList", has_track_list());                          }
+    void on_go_to                    (auto &&fn) { go_to_fn           = fn;                                                                               }
+
     void set_fullscreen(bool value)                         { fullscreen            = value; prop_changed(MP2,  "Fullscreen"          , fullscreen);                                         }
     void set_identity(std::string_view value)               { identity              = value; prop_changed(MP2,  "Identity"            , identity);                                           }
     void set_desktop_entry(std::filesystem::path value)     { desktop_entry         = value.string(); prop_changed(MP2, "DesktopEntry", desktop_entry);                                      }
@@ -187,6 +206,10 @@ public:
     void set_shuffle(bool value)                            { shuffle               = value; prop_changed(MP2P, "Shuffle"             , shuffle);                                            }
     void set_volume(double value)                           { volume                = value; prop_changed(MP2P, "Volume"              , volume);                                             }
     void set_position(int64_t value)                        { position              = value;                                                                                                 }
+    // position is never pushed, as it changes continuously: if a source is
+    // set, it's asked for the position whenever a client reads it
+    void set_position_source(auto &&fn)                     { position_fn           = fn;                                                                                                    }
+    int64_t get_position() const                            { return position_fn ? position_fn() : position;                                                                                 }
 
     void set_rate(double value)
     {
@@ -202,11 +225,17 @@ public:
         prop_changed(MP2P, "Rate", rate);
     }
 
-    void set_metadata(const std::map<Field, sdbus::Variant> &value)
+    static Metadata make_metadata(const std::map<Field, sdbus::Variant> &value)
     {
-        metadata.clear();
+        Metadata m;
         for (auto [k, v] : value)
-            metadata[detail::field_to_string(k)] = v;
+            m[detail::field_to_string(k)] = v;
+        return m;
+    }
+
+    void set_metadata(const std::map<Field, sdbus::Variant> &value)
+    {
+        metadata = make_metadata(value);
         prop_changed(MP2P, "Metadata", metadata);
     }
 
@@ -230,7 +259,12 @@ public:
         prop_changed(MP2P, "MaximumRate"         , maximum_rate);
     }
 
-    void send_seeked_signal(int64_t position);
+    virtual void send_seeked_signal(int64_t position) = 0;
+    // track list signals; like property changes, these may be sent later
+    virtual void track_list_replaced(const StringList &tracks, const std::string &current) = 0;
+    virtual void track_added(const Metadata &metadata, const std::string &after) = 0;
+    virtual void track_removed(const std::string &track) = 0;
+    virtual void track_metadata_changed(const std::string &track, const Metadata &metadata) = 0;
 };
 
 std::unique_ptr<Server> make_server(std::string_view name, bool create_empty = true);
@@ -0,0 +1,88 @@
+/*
+ * Small helpers for running standard algorithms over multiple threads.
+ *
+ * These are meant for one-shot, big operations (sorting an entire playlist,
+ * etc.), where the cost of spawning threads is negligible.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+namespace parallel {
+
+inline unsigned num_threads() { return std::max(1u, std::thread::hardware_concurrency()); }
+
+/*
+ * A stable sort that uses up to @threads threads. The range is split into
+ * chunks of at least @min_chunk elements; chunks are sorted concurrently with
+ * std::stable_sort and then merged pairwise, again concurrently. Small
+ * ranges are sorted on the calling thread.
+ */
+template <std::random_access_iterator It, typename Compare>
+void stable_sort(It first, It last, Compare cmp, unsigned threads = num_threads(),
+                 std::size_t min_chunk = 1 << 14)
+{
+    auto size = std::size_t(last - first);
+    auto chunks = std::min<std::size_t>(threads, size / min_chunk);
+    if (chunks <= 1) {
+        std::stable_sort(first, last, cmp);
+        return;
+    }
+
+    std::vector<It> bounds;
+    for (std::size_t i = 0; i <= chunks; i++)
+        bounds.push_back(first + size * i / chunks);
+
+    {
+        std::vector<std::jthread> workers;
+        for (std::size_t i = 0; i < chunks; i++)
+            workers.emplace_back([=] { std::stable_sort(bounds[i], bounds[i+1], cmp); });
+    }
+
+    while (bounds.size() > 2) {
+        auto count = bounds.size() - 1;
+        std::vector<It> next;
+        {
+            std::vector<std::jthread> workers;
+            std::size_t i = 0;
+            for (; i + 2 <= count; i += 2) {
+                workers.emplace_back([=] { std::inplace_merge(bounds[i], bounds[i+1], bounds[i+2], cmp); });
+                next.push_back(bounds[i]);
+            }
+            // an odd chunk is carried to the next round as is
+            if (i < count)
+                next.push_back(bounds[i]);
+            next.push_back(bounds[count]);
+        }
+        bounds = std::move(next);
+    }
+}
+
+/*
+ * Calls @fn(i) for every i in [0, @size), using up to @threads threads, each
+ * of which gets a contiguous chunk of at least @min_chunk indexes. Small
+ * sizes are run on the calling thread.
+ */
+template <typename Fn>
+void for_each_index(std::size_t size, Fn fn, unsigned threads = num_threads(),
+                    std::size_t min_chunk = 1 << 14)
+{
+    auto chunks = std::min<std::size_t>(threads, size / min_chunk);
+    if (chunks <= 1) {
+        for (std::size_t i = 0; i < size; i++)
+            fn(i);
+        return;
+    }
+    std::vector<std::jthread> workers;
+    for (std::size_t c = 0; c < chunks; c++)
+        workers.emplace_back([=] {
+            for (auto i = size * c / chunks; i < size * (c+1) / chunks; i++)
+                fn(i);
+        });
+}
+
+} // namespace parallel
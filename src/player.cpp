@@ -1,10 +1,18 @@
 #include "player.hpp"
 
 #include <algorithm>
+#include <charconv>
+#include <cmath>
 #include <cstring>
+#include <limits>
 #include <mutex>
 #include <span>
+#include <unordered_map>
+#include <unordered_set>
 #include <SDL.h>
+#include "archive.hpp"
+#include "hash.hpp"
+#include "parallel.hpp"
 #include "random.hpp"
 #include "io.hpp"
 #include "mpris_server.hpp"
@@ -15,71 +23,373 @@ namespace fs = std::filesystem;
 
 namespace gmplayer {
 
-void Playlist::regen()         { std::iota(order.begin(), order.end(), 0); }
-void Playlist::regen(int size) { order.resize(size); regen(); }
-void Playlist::shuffle()       { std::shuffle(order.begin(), order.end(), rng::rng); }
+namespace {
 
-Player::Player()
+// Maps a file and reads it. The mappings the interface depends on, including
+// the file itself, are stored into `mapped`.
+auto open_file(const fs::path &path, std::vector<io::MappedFile> &mapped)
+    -> tl::expected<std::unique_ptr<FormatInterface>, Error>
 {
-    audio.spec.freq     = 44100;
-    audio.spec.format   = AUDIO_F32;//*/ AUDIO_S16SYS;
-    audio.spec.channels = NUM_CHANNELS;
-    audio.spec.samples  = NUM_FRAMES;
-    audio.spec.userdata = this;
-    audio.spec.callback = [] (void *userdata, u8 *stream, int length) {
-        ((Player *) userdata)->audio_callback({stream, std::size_t(length)});
-    };
-    audio.dev_id = SDL_OpenAudioDevice(nullptr, 0, &audio.spec, &audio.spec, 0);
-    audio.mutex  = SDLMutex(audio.dev_id);
+    auto file = archive::open(path);
+    if (!file)
+        return tl::unexpected(Error {
+            .code = Error::Type::LoadFile,
+            .details = file.error().message(),
+            .file_path = path,
+            .track_name = "",
+        });
+    auto res = read_file(file.value(), mapped, 44100, config.get(cfg::default_duration));
+    mapped.push_back(std::move(file.value()));
+    return res;
+}
+
+// MPRIS ids of the file list's entries are made from the index of their
+// record, which doesn't change while they're listed.
+const auto MPRIS_TRACK_PREFIX = std::string_view("/org/gmplayer/file/");
+
+// At most this many entries of the file list are shown through MPRIS, around
+// the current one, so that big playlists don't make for big messages.
+constexpr int MPRIS_TRACKLIST_WINDOW = 512;
+
+// How many emulators are kept aside, and how far in a track has to be for
+// its emulator to be worth keeping rather than seeking again (in ms).
+constexpr std::size_t MAX_PARKED = 4;
+constexpr int PARK_MIN_POSITION = 10000;
+
+// How many of the next files are read ahead, and how much of them at most.
+constexpr int PREFETCH_FILES = 3;
+constexpr u64 PREFETCH_BUDGET = 64 * 1024 * 1024;
+
+// How many files that aren't listed anymore have their metadata remembered.
+constexpr std::size_t MAX_UNLISTED_METADATA = 4096;
+
+std::string mpris_track_id(int file_id) { return fmt::format("{}{}", MPRIS_TRACK_PREFIX, file_id); }
+
+std::optional<int> parse_mpris_track_id(std::string_view id)
+{
+    if (!id.starts_with(MPRIS_TRACK_PREFIX))
+        return std::nullopt;
+    id.remove_prefix(MPRIS_TRACK_PREFIX.size());
+    int n;
+    auto [ptr, ec] = std::from_chars(id.data(), id.data() + id.size(), n);
+    if (ec != std::errc{} || ptr != id.data() + id.size())
+        return std::nullopt;
+    return n;
+}
+
+mpris::Metadata mpris_file_metadata(int id, const FileRecord &file, const Metadata &m)
+{
+    auto title = m.info[Metadata::Song].str();
+    return mpris::Server::make_metadata({
+        { mpris::Field::TrackId, sdbus::ObjectPath(mpris_track_id(id))                         },
+        { mpris::Field::Length,  int64_t(m.length) * 1000                                      },
+        { mpris::Field::Title,   title.empty() ? std::string(file.name.view()) : title         },
+        { mpris::Field::Album,   m.info[Metadata::Game].str()                                  },
+        { mpris::Field::Artist,  m.info[Metadata::Author].str()                                },
+        { mpris::Field::Url,     "file://" + file.path().string()                              },
+    });
+}
+
+// One entry per sort key, each one being a value or a collation rank.
+struct SortEntry {
+    std::array<u64, 6> key;
+    int id;
+};
+
+std::string collation_key(std::string_view s)
+{
+    std::string r;
+    std::transform(s.begin(), s.end(), std::back_inserter(r), [](char c) {
+        return c >= 'A' && c <= 'Z' ? char(c - 'A' + 'a') : c;
+    });
+    return r;
+}
+
+// Maps every distinct value to its position in collation order, so that
+// comparing two strings becomes comparing two integers. Values which collate
+// the same (differing only in case) get the same rank, leaving the order
+// between them to the next keys. Empty strings are always sorted last.
+template <typename T>
+std::unordered_map<T, u32> collation_ranks(std::span<const T> values, auto &&to_string)
+{
+    std::unordered_set<T> distinct(values.begin(), values.end());
+    std::vector<std::pair<std::string, T>> keyed;
+    for (auto v : distinct)
+        keyed.emplace_back(collation_key(to_string(v)), v);
+    std::sort(keyed.begin(), keyed.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+    std::unordered_map<T, u32> ranks;
+    u32 rank = 0;
+    for (u32 i = 0; i < keyed.size(); i++) {
+        if (i > 0 && keyed[i].first != keyed[i-1].first)
+            rank++;
+        ranks[keyed[i].second] = keyed[i].first.empty() ? std::numeric_limits<u32>::max() : rank;
+    }
+    return ranks;
+}
+
+// The metadata of the first track of each file, read in parallel.
+std::vector<std::optional<Metadata>> read_first_metadata(std::span<const std::pair<int, FileRecord>> files)
+{
+    std::vector<std::optional<Metadata>> read(files.size());
+    parallel::for_each_index(files.size(), [&](std::size_t i) {
+        std::vector<io::MappedFile> mapped;
+        if (auto format = open_file(files[i].second.path(), mapped); format && format.value()->track_count() > 0)
+            read[i] = format.value()->track_metadata(0);
+    }, parallel::num_threads(), 8);
+    return read;
+}
+
+} // namespace
+
+void Playlist::materialize()
+{
+    if (!perm && !custom.empty())
+        return;
+    std::vector<int> order(length);
+    for (int i = 0; i < length; i++)
+        order[i] = at(i);
+    custom = std::move(order);
+    perm.reset();
+}
+
+void Playlist::regen(int size)
+{
+    custom.clear();
+    length = size;
+    perm.reset();
+}
+
+void Playlist::assign(std::vector<int> order)
+{
+    custom = std::move(order);
+    length = custom.size();
+    perm.reset();
+}
+
+auto Playlist::insert(int pos, std::span<const int> ids) -> Change
+{
+    pos = std::clamp(pos, 0, length);
+    int count = ids.size();
+    // appending the next ids to an identity keeps it an identity
+    bool extends_identity = !perm && custom.empty() && pos == length
+        && (ids.empty() || ids[0] == length)
+        && std::adjacent_find(ids.begin(), ids.end(), [](int a, int b) { return b != a + 1; }) == ids.end();
+    if (!extends_identity) {
+        materialize();
+        custom.insert(custom.begin() + pos, ids.begin(), ids.end());
+    }
+    length += count;
+    if (current >= pos)
+        current += count;
+    return { Change::Insert, pos, count };
+}
 
+auto Playlist::remove(std::span<const int> positions) -> std::vector<Change>
+{
+    std::vector<int> sorted;
+    std::copy_if(positions.begin(), positions.end(), std::back_inserter(sorted),
+                 [&](int p) { return p >= 0 && p < length; });
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    if (sorted.empty())
+        return {};
+
+    std::vector<Change> changes;
+    for (auto i = sorted.size(); i > 0; ) {
+        auto last = sorted[--i], first = last;
+        while (i > 0 && sorted[i-1] == first - 1)
+            first = sorted[--i];
+        changes.push_back({ Change::Remove, first, last - first + 1 });
+    }
+
+    materialize();
+    auto next = sorted.begin();
+    auto out = custom.begin();
+    for (int p = 0; p < length; p++) {
+        if (next != sorted.end() && *next == p)
+            ++next;
+        else
+            *out++ = custom[p];
+    }
+    custom.erase(out, custom.end());
+    length = custom.size();
+
+    if (current != -1) {
+        auto it = std::lower_bound(sorted.begin(), sorted.end(), current);
+        current = it != sorted.end() && *it == current ? -1 : current - int(it - sorted.begin());
+    }
+    return changes;
+}
+
+auto Playlist::move(int first, int count, int to) -> std::optional<Change>
+{
+    if (count <= 0 || first < 0 || first + count > length || to < 0 || to + count > length || to == first)
+        return std::nullopt;
+    materialize();
+    auto b = custom.begin();
+    if (to < first)
+        std::rotate(b + to, b + first, b + first + count);
+    else
+        std::rotate(b + first, b + first + count, b + to + count);
+    if (current >= first && current < first + count)
+        current += to - first;
+    else if (to < first && current >= to && current < first)
+        current += count;
+    else if (to > first && current >= first + count && current < to + count)
+        current -= count;
+    return Change { Change::Move, first, count, to };
+}
+
+// the current item stays the same, only its position changes
+void Playlist::shuffle()
+{
+    bool valid = current >= 0 && current < length;
+    auto base = valid && perm ? int(perm->map(current)) : current;
+    perm = rng::Permutation(length, rng::rng);
+    if (valid)
+        current = perm->unmap(base);
+}
+
+void Playlist::unshuffle()
+{
+    if (!perm)
+        return;
+    if (current >= 0 && current < length)
+        current = perm->map(current);
+    perm.reset();
+}
+
+void Playlist::restore(std::vector<int> order, int size, std::optional<rng::Permutation> shuffle)
+{
+    custom = std::move(order);
+    length = size;
+    perm = std::move(shuffle);
+}
+
+Player::Player(Engine &engine)
+    : engine{engine}
+{
+    audio.mutex = engine.mutex();
     format = make_default_format();
 
     mpris = mpris::make_server("gmplayer");
     mpris->set_maximum_rate(4.0);
     mpris->set_minimum_rate(0.25);
-    mpris->set_rate(int_to_tempo(config.get<int>("tempo")));
-    mpris->set_volume(config.get<int>("volume"));
+    mpris->set_rate(int_to_tempo(config.get(cfg::tempo)));
+    mpris->set_volume(config.get(cfg::volume));
     mpris->on_pause(           [=, this]                   { pause();               });
     mpris->on_play(            [=, this]                   { start_or_resume();     });
     mpris->on_play_pause(      [=, this]                   { play_pause();          });
     mpris->on_stop(            [=, this]                   { stop();                });
     mpris->on_next(            [=, this]                   { next();                });
     mpris->on_previous(        [=, this]                   { prev();                });
-    mpris->on_seek(            [=, this] (int64_t offset)  { seek_relative(offset); });
-    mpris->on_rate_changed(    [=, this] (double rate)     { config.set<int>("tempo", int_to_tempo(rate)); });
-    mpris->on_set_position(    [=, this] (int64_t pos)     { seek(pos);             });
+    mpris->on_seek(            [=, this] (int64_t offset)  { seek_relative(offset / 1000); });
+    mpris->on_rate_changed(    [=, this] (double rate)     { config.set(cfg::tempo, tempo_to_int(rate)); });
+    mpris->on_set_position(    [=, this] (int64_t pos)     { seek(pos / 1000);      });
     mpris->on_shuffle_changed( [=, this] (bool do_shuffle) {
-        std::lock_guard<SDLMutex> lock(audio.mutex);
         if (do_shuffle)
-            files.shuffle();
+            shuffle(Playlist::File);
         else
-            files.regen();
-        playlist_changed(Playlist::Type::File);
-        shuffled(Playlist::Type::File);
+            unshuffle(Playlist::File);
     });
     mpris->on_volume_changed(  [=, this] (double vol) {
-        config.set<int>("volume", std::lerp(0.0, MAX_VOLUME_VALUE, vol));
+        config.set(cfg::volume, std::lerp(0.0, MAX_VOLUME_VALUE, vol));
     });
     mpris->on_loop_status_changed([=, this] (mpris::LoopStatus status) {
-        config.set<bool>("repeat_track", status == mpris::LoopStatus::Track);
-        config.set<bool>("repeat_file",  status == mpris::LoopStatus::Track);
+        config.set(cfg::repeat_track, status == mpris::LoopStatus::Track);
+        config.set(cfg::repeat_file, status == mpris::LoopStatus::Track);
         if (status == mpris::LoopStatus::Playlist)
             mpris->set_loop_status(mpris::LoopStatus::None);
     });
 
+    mpris->set_position_source([this] { return int64_t(position()) * 1000; });
+
+    // the track list is the file list, served in bounded pages; these run on
+    // the D-Bus thread, which only holds the lock to copy what it needs
+    mpris->on_tracks_requested([this] {
+        std::vector<int> window;
+        {
+            std::lock_guard<SDLMutex> lock(audio.mutex);
+            auto [first, last] = tracklist_window();
+            window.reserve(last - first);
+            for (auto p = first; p < last; p++)
+                window.push_back(files.at(p));
+        }
+        mpris::StringList ids;
+        ids.reserve(window.size());
+        for (auto id : window)
+            ids.push_back(mpris_track_id(id));
+        return ids;
+    });
+    mpris->on_tracks_metadata_requested([this] (const mpris::StringList &ids) {
+        std::vector<std::pair<int, FileRecord>> records, missing;
+        std::vector<std::optional<Metadata>> metadata;
+        {
+            std::lock_guard<SDLMutex> lock(audio.mutex);
+            for (auto i = 0u; i < ids.size() && i < MPRIS_TRACKLIST_WINDOW; i++) {
+                auto id = parse_mpris_track_id(ids[i]);
+                if (!id || *id < 0 || *id >= int(file_list.size()))
+                    continue;
+                records.emplace_back(*id, file_list[*id]);
+                if (auto it = file_metadata.find(*id); it != file_metadata.end())
+                    metadata.push_back(it->second);
+                else {
+                    metadata.push_back(std::nullopt);
+                    missing.emplace_back(*id, file_list[*id]);
+                }
+            }
+        }
+        // files never read are read here, so that clients get more than
+        // their name, and kept for next time
+        auto read = read_metadata(missing, false);
+        for (auto i = 0u, j = 0u; i < records.size(); i++)
+            if (!metadata[i])
+                metadata[i] = read[j++];
+        std::vector<mpris::Metadata> result;
+        result.reserve(records.size());
+        for (auto i = 0u; i < records.size(); i++)
+            result.push_back(mpris_file_metadata(records[i].first, records[i].second, metadata[i].value_or(Metadata{})));
+        return result;
+    });
+    mpris->on_go_to([this] (std::string_view track_id) {
+        auto id = parse_mpris_track_id(track_id);
+        if (!id)
+            return;
+        std::lock_guard<SDLMutex> lock(audio.mutex);
+        for (auto p = 0; p < int(files.size()); p++)
+            if (files.at(p) == *id) {
+                load_pair(p, 0);
+                return;
+            }
+    });
+    on_playlist_edited([this] (Playlist::Type type, std::span<const Playlist::Change> changes) {
+        if (type == Playlist::File)
+            update_tracklist(changes);
+    });
+    on_playlist_changed([this] (Playlist::Type type) {
+        if (type == Playlist::File)
+            update_tracklist({});
+    });
+    on_file_changed([this] (int) {
+        // the window follows the current file
+        if (files.size() > MPRIS_TRACKLIST_WINDOW)
+            update_tracklist({});
+    });
+
     mpris->start_loop_async();
 
-    config.when_set("fade", [&](const conf::Value &v) {
+    config.when_set(cfg::fade, [&](const conf::Value &v) {
         std::lock_guard<SDLMutex> lock(audio.mutex);
         if (tracks.current != -1) {
             format->set_fade_out(v.as<int>());
+            publish_state();
             // reset song to start position, due to the modified
             // fade applying to the song
             seek(0);
         }
     });
 
-    config.when_set("fade_in", [&](const conf::Value &v) {
+    config.when_set(cfg::fade_in, [&](const conf::Value &v) {
         std::lock_guard<SDLMutex> lock(audio.mutex);
         if (tracks.current != -1) {
             format->set_fade_in(v.as<int>());
@@ -87,77 +397,287 @@ Player::Player()
         }
     });
 
-    config.when_set("tempo", [&](const conf::Value &v) {
-        std::lock_guard<SDLMutex> lock(audio.mutex);
-        float tempo = int_to_tempo(v.as<int>());
-        format->set_tempo(tempo);
-        mpris->set_rate(tempo);
+    config.when_set(cfg::tempo, [&](const conf::Value &v) {
+        send({ .kind = Command::Tempo, .value = v.as<int>() });
+        mpris->set_rate(int_to_tempo(v.as<int>()));
     });
 
-    tracks.repeat = config.get<bool>("repeat_track");
-    config.when_set("repeat_track", [&](const conf::Value &v) {
+    tracks.repeat = config.get(cfg::repeat_track);
+    config.when_set(cfg::repeat_track, [&](const conf::Value &v) {
         std::lock_guard<SDLMutex> lock(audio.mutex);
         tracks.repeat = v.as<bool>();
+        publish_state();
         mpris->set_loop_status(tracks.repeat ? mpris::LoopStatus::Track : mpris::LoopStatus::None);
     });
 
-    files.repeat = config.get<bool>("repeat_track");
-    config.when_set("repeat_file", [&](const conf::Value &v) {
+    files.repeat = config.get(cfg::repeat_file);
+    config.when_set(cfg::repeat_file, [&](const conf::Value &v) {
         std::lock_guard<SDLMutex> lock(audio.mutex);
         files.repeat = v.as<bool>();
+        publish_state();
         mpris->set_loop_status(files.repeat ? mpris::LoopStatus::Track : mpris::LoopStatus::None);
     });
 
-    options.volume = config.get<int>("volume");
-    config.when_set("volume", [&](const conf::Value &v) {
-        std::lock_guard<SDLMutex> lock(audio.mutex);
-        options.volume = v.as<int>();
-        mpris->set_volume(double(options.volume) / double(MAX_VOLUME_VALUE));
+    options.volume = config.get(cfg::volume);
+    config.when_set(cfg::volume, [&](const conf::Value &v) {
+        send({ .kind = Command::Volume, .value = v.as<int>() });
+        mpris->set_volume(double(v.as<int>()) / double(MAX_VOLUME_VALUE));
     });
+
+    publish_state();
+    library.thread = std::jthread([this] (std::stop_token stop) { run_library_jobs(stop); });
+    engine.attach(this);
 }
 
 Player::~Player()
 {
-    std::lock_guard<SDLMutex> lock(audio.mutex);
-    SDL_CloseAudioDevice(audio.dev_id);
+    engine.detach(this);
 }
 
-void Player::audio_callback(std::span<u8> stream)
+bool Player::is_rendering() const { return state.playing; }
+
+// Called by the engine's device, with the lock held.
+void Player::render(std::span<u8> stream)
 {
+    // no signal is called from here: they're recorded and later delivered
+    // by dispatch_events() on the frontend's thread
+    apply_commands();
     auto pos = format->position();
-    mpris->set_position(pos * 1000);
-    position_changed(pos);
+    coalesced.position.store(pos, std::memory_order_relaxed);
+    state.position = pos;
+    published.store(state);
     if (format->track_ended()) {
-        pause();
-        track_ended();
+        pause_device();
+        audio_events.push({ AudioEvent::Paused });
+        audio_events.push({ AudioEvent::TrackEnded });
         return;
     }
-    std::fill(stream.begin(), stream.end(), 0); // fill stream with silence
-    std::array<i16,   NUM_FRAMES * NUM_CHANNELS * NUM_VOICES> separated = {};
+    // the buffer is written in place and then handed to readers as is
+    auto &buffer = buffers.write();
+    auto &separated = buffer.voices;
+    auto &samples   = buffer.mix;
     std::array<i16,   NUM_FRAMES * NUM_CHANNELS>              mixed     = {};
-    std::array<float, NUM_FRAMES * NUM_CHANNELS>              samples   = {};
+    separated.fill(0);
+    samples.fill(0);
     auto multi = format->is_multi_channel();
     auto err = multi ? format->play(separated) : format->play(mixed);
     if (err)
         fmt::print("got error while playing: {}\n", err.details);
     auto maxvol = 1.0f / float(MAX_VOLUME_VALUE);
+    // levels are gathered while mixing, so that the samples are read once
+    std::array<f32, NUM_VOICES> peak = {}, sum = {};
+    f32 master_peak = 0, master_sum = 0;
+    auto measure = [](f32 s, f32 &peak, f32 &sum) {
+        peak = std::max(peak, std::abs(s));
+        sum += s * s;
+    };
     if (multi) {
         for (auto f = 0u; f < NUM_FRAMES; f += 2) {
             for (auto t = 0u; t < NUM_VOICES; t++) {
                 for (auto i = 0u; i < NUM_CHANNELS*2; i++) {
                     auto vol = float(effects.volume[t]);
-                    samples[f*2 + i] += separated[f*FRAME_SIZE + t*NUM_CHANNELS*2 + i] / 32768.f * vol * maxvol;
+                    auto s = separated[f*FRAME_SIZE + t*NUM_CHANNELS*2 + i] / 32768.f * vol * maxvol;
+                    samples[f*2 + i] += s;
+                    measure(s, peak[t], sum[t]);
                 }
             }
+            for (auto i = 0u; i < NUM_CHANNELS*2; i++)
+                measure(samples[f*2 + i], master_peak, master_sum);
         }
     } else
-        for (auto i = 0u; i < samples.size(); i++)
+        for (auto i = 0u; i < samples.size(); i++) {
             samples[i] = mixed[i] / 32768.f;
+            measure(samples[i], master_peak, master_sum);
+        }
+    for (auto t = 0u; t < NUM_VOICES; t++) {
+        meters.peak[t].store(peak[t], std::memory_order_relaxed);
+        meters.rms[t].store(std::sqrt(sum[t] / samples.size()), std::memory_order_relaxed);
+    }
+    meters.master_peak.store(master_peak, std::memory_order_relaxed);
+    meters.master_rms.store(std::sqrt(master_sum / samples.size()), std::memory_order_relaxed);
+    if (master_peak > 1.f)
+        meters.clips.fetch_add(1, std::memory_order_relaxed);
     SDL_MixAudioFormat(
-        stream.data(), (const u8 *) samples.data(), audio.spec.format,
+        stream.data(), (const u8 *) samples.data(), engine.sample_format(),
         samples.size() * sizeof(f32), options.volume
     );
-    samples_played(separated, samples);
+    buffers.publish();
+    coalesced.samples.store(true, std::memory_order_release);
+}
+
+void Player::dispatch_events()
+{
+    if (auto pos = coalesced.position.exchange(-1, std::memory_order_relaxed); pos != -1)
+        position_changed(pos);
+    if (coalesced.samples.exchange(false, std::memory_order_acquire))
+        samples_played();
+    std::vector<LibraryJob> jobs;
+    {
+        std::lock_guard lock(library.mutex);
+        jobs.swap(library.done);
+    }
+    for (auto &job : jobs)
+        apply_library_job(job);
+    while (auto ev = audio_events.pop()) {
+        switch (ev->kind) {
+        case AudioEvent::Paused:
+            mpris->set_playback_status(mpris::PlaybackStatus::Paused);
+            paused();
+            break;
+        case AudioEvent::TrackEnded: track_ended(); break;
+        case AudioEvent::Seeked:
+            mpris->send_seeked_signal(int64_t(ev->value) * 1000);
+            seeked(ev->value);
+            position_changed(ev->value);
+            break;
+        case AudioEvent::SeekFailed: {
+            std::unique_lock<SDLMutex> lock(audio.mutex);
+            auto err = seek_error;
+            lock.unlock();
+            error(err);
+            break;
+        }
+        }
+    }
+}
+
+// Commands are applied by the callback, so that controlling the player never
+// makes it wait. While the device is paused there's no callback draining the
+// queue, but then there's no one to contend with either and commands are
+// applied right away. The fence pairs with the one in pause_device(): either
+// the sender sees the device paused, or the pause sees the command.
+void Player::send(Command cmd)
+{
+    auto queued = commands.push(cmd);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (queued && published.load().playing)
+        return;
+    std::lock_guard<SDLMutex> lock(audio.mutex);
+    apply_commands();
+    if (!queued)
+        apply(cmd);
+}
+
+void Player::apply_commands()
+{
+    while (auto cmd = commands.pop())
+        apply(cmd.value());
+}
+
+void Player::apply(Command cmd)
+{
+    switch (cmd.kind) {
+    case Command::Volume:        options.volume = cmd.value;                        break;
+    case Command::Mute:          format->mute_channel(cmd.index, cmd.value != 0);   break;
+    case Command::ChannelVolume: effects.volume[cmd.index] = cmd.value;             break;
+    case Command::Tempo:         format->set_tempo(int_to_tempo(cmd.value));        break;
+    case Command::Seek:
+    case Command::SeekRelative: {
+        auto ms = cmd.kind == Command::Seek ? cmd.value : format->position() + cmd.value;
+        if (auto err = format->seek(std::clamp(ms, 0, state.length)); err) {
+            seek_error = err;
+            pause_device();
+            audio_events.push({ AudioEvent::Paused });
+            audio_events.push({ AudioEvent::SeekFailed });
+        }
+        state.position = format->position();
+        published.store(state);
+        audio_events.push({ AudioEvent::Seeked, state.position });
+        break;
+    }
+    }
+}
+
+// Returns the range of the file list shown through MPRIS.
+std::pair<int, int> Player::tracklist_window() const
+{
+    auto size = int(files.size());
+    auto first = std::clamp(files.current - MPRIS_TRACKLIST_WINDOW / 2, 0, std::max(size - MPRIS_TRACKLIST_WINDOW, 0));
+    return { first, std::min(first + MPRIS_TRACKLIST_WINDOW, size) };
+}
+
+// Tells MPRIS clients about changes to the file list. A few insertions or
+// removals in a list that fits in the window are sent as they are; anything
+// else replaces the list.
+void Player::update_tracklist(std::span<const Playlist::Change> changes)
+{
+    constexpr int MAX_CHANGED = 64;
+    auto removed = std::exchange(removed_records, {});
+    auto changed = 0;
+    auto same_kind = !changes.empty() && std::all_of(changes.begin(), changes.end(), [&](const auto &c) {
+        changed += c.count;
+        return c.kind == changes[0].kind && c.kind != Playlist::Change::Move;
+    });
+    if (same_kind && changed <= MAX_CHANGED && files.size() + removed.size() <= MPRIS_TRACKLIST_WINDOW) {
+        if (changes[0].kind == Playlist::Change::Insert) {
+            for (const auto &c : changes)
+                for (auto p = c.first; p < c.first + c.count; p++)
+                    mpris->track_added(mpris_file_metadata(files.at(p), file_list[files.at(p)], metadata_of(files.at(p))),
+                                       p == 0 ? mpris::NO_TRACK : mpris_track_id(files.at(p - 1)));
+            return;
+        }
+        if (int(removed.size()) == changed) {
+            for (auto id : removed)
+                mpris->track_removed(mpris_track_id(id));
+            return;
+        }
+    }
+    auto [first, last] = tracklist_window();
+    mpris::StringList ids;
+    ids.reserve(last - first);
+    for (auto p = first; p < last; p++)
+        ids.push_back(mpris_track_id(files.at(p)));
+    auto has_current = files.current >= 0 && files.current < int(files.size());
+    mpris->track_list_replaced(ids, has_current ? mpris_track_id(files.at(files.current)) : mpris::NO_TRACK);
+}
+
+// Tells MPRIS clients about files whose metadata changed, as far as they're
+// shown in the track list.
+void Player::tracks_changed(std::span<const int> ids)
+{
+    if (ids.empty())
+        return;
+    auto [first, last] = tracklist_window();
+    std::unordered_set<int> shown;
+    for (auto p = first; p < last; p++)
+        shown.insert(files.at(p));
+    for (auto id : ids)
+        if (shown.contains(id))
+            mpris->track_metadata_changed(mpris_track_id(id), mpris_file_metadata(id, file_list[id], metadata_of(id)));
+}
+
+// Recomputes everything but the position, which is kept by the callback.
+// Must be called with the lock held, before the signals telling about the
+// change, so that their handlers read the new state.
+void Player::publish_state()
+{
+    auto track_valid = tracks.current >= 0 && tracks.current < int(tracks.size());
+    state.position        = format->position();
+    state.length          = track_valid ? track_cache[tracks.at(tracks.current)].length + config.get(cfg::fade) : 0;
+    state.track           = tracks.current;
+    state.file            = files.current;
+    state.track_count     = tracks.size();
+    state.file_count      = files.size();
+    state.has_next        = tracks.next() || neighbour_file(+1);
+    state.has_prev        = tracks.prev() || neighbour_file(-1);
+    state.multi_channel   = format->is_multi_channel();
+    state.tracks_shuffled = tracks.is_shuffled();
+    state.files_shuffled  = files.is_shuffled();
+    published.store(state);
+}
+
+std::optional<FileStamp> FileStamp::of(const fs::path &path)
+{
+    auto parts = archive::split(path);
+    const auto &file = parts ? parts->first : path;
+    std::error_code ec;
+    auto size = fs::file_size(file, ec);
+    if (ec)
+        return std::nullopt;
+    auto time = fs::last_write_time(file, ec);
+    if (ec)
+        return std::nullopt;
+    return FileStamp { .size = size, .mtime = i64(time.time_since_epoch().count()) };
 }
 
 std::vector<Player::AddFileError> Player::add_file(std::filesystem::path path)
@@ -166,21 +686,63 @@ std::vector<Player::AddFileError> Player::add_file(std::filesystem::path path)
     return add_files(paths);
 }
 
-std::vector<Player::AddFileError> Player::add_files(std::span<fs::path> paths)
+std::vector<Player::AddFileError> Player::add_files(std::span<fs::path> paths, std::span<const u64> hashes)
 {
+    // hashing reads every file whole, so it's done before taking the lock.
+    // Frontends adding many files get the hashes from a scan instead, so as
+    // not to hash on their own thread. Stamps come first: a file changing
+    // after being hashed then has a newer stamp than its hash
+    std::vector<u64> computed;
+    std::vector<std::optional<FileStamp>> stamps(paths.size());
+    auto compute = hashes.size() != paths.size();
+    if (compute)
+        computed.resize(paths.size());
+    parallel::for_each_index(paths.size(), [&](std::size_t i) {
+        stamps[i] = FileStamp::of(paths[i]);
+        if (compute)
+            computed[i] = hash::file(paths[i]);
+    }, parallel::num_threads(), 8);
+    if (compute)
+        hashes = computed;
+    auto skip_duplicates = config.get(cfg::skip_duplicates);
+
     std::lock_guard<SDLMutex> lock(audio.mutex);
     std::vector<Player::AddFileError> errors;
-    for (const auto& p : paths) {
-        auto file = io::MappedFile::open(p, io::Access::Read);
-        if (file) {
-            file_cache.push_back(std::move(file.value()));
-            files.order.push_back(file_cache.size() - 1);
-        } else {
-            errors.push_back(std::make_pair(p.filename(), file.error()));
+    std::vector<int> added;
+    for (auto i = 0u; i < paths.size(); i++) {
+        const auto &p = paths[i];
+        std::error_code ec;
+        auto status = fs::status(p, ec);
+        // members of an archive aren't on disk by themselves
+        if (ec && archive::split(p))
+            ec.clear();
+        else if (!ec && !fs::is_regular_file(status))
+            ec = std::make_error_code(fs::is_directory(status) ? std::errc::is_a_directory
+                                                                : std::errc::invalid_argument);
+        else if (skip_duplicates && hash_counts.contains(hashes[i]))
+            ec = std::make_error_code(std::errc::file_exists);
+        if (ec) {
+            errors.push_back(std::make_pair(p.filename(), ec));
+            continue;
         }
+        file_list.push_back({
+            .dir  = intern::Dir(p.parent_path()),
+            .name = intern::String(p.filename().string()),
+        });
+        file_hashes.push_back(hashes[i]);
+        file_stamps.push_back(stamps[i]);
+        auto id = int(file_list.size() - 1);
+        if (auto metadata = known_metadata.find(hashes[i]); metadata != known_metadata.end())
+            file_metadata[id] = metadata->second;
+        count_hash(hashes[i], +1);
+        added.push_back(id);
+        index_file(id);
+    }
+    if (!added.empty()) {
+        auto change = files.insert(files.size(), added);
+        publish_state();
+        playlist_edited(Playlist::File, std::span{&change, 1});
     }
-    if (files.size() > 0)
-        playlist_changed(Playlist::File);
     return errors;
 }
 
@@ -193,58 +755,347 @@ void Player::remove_file(int id)
 void Player::remove_files(std::span<int> ids)
 {
     std::lock_guard<SDLMutex> lock(audio.mutex);
-    for (auto id : ids)
-        files.remove(id);
+    std::vector<int> positions(ids.begin(), ids.end());
+    std::sort(positions.begin(), positions.end());
+    positions.erase(std::unique(positions.begin(), positions.end()), positions.end());
+    std::vector<int> records;
+    for (auto id : positions)
+        if (id >= 0 && id < files.size()) {
+            records.push_back(files.at(id));
+            file_index.remove(files.at(id));
+            count_hash(file_hashes[files.at(id)], -1);
+        }
+    auto before = [&](int pos) {
+        return int(std::lower_bound(positions.begin(), positions.end(), pos) - positions.begin());
+    };
+    auto current = files.current;
+    auto changes = files.remove(ids);
+    if (changes.empty())
+        return;
+    if (current != -1 && files.current == -1)
+        removed_at = current - before(current);
+    else if (removed_at != -1)
+        removed_at -= before(removed_at);
+    removed_records = std::move(records);
+    publish_state();
     files_removed(ids);
-    playlist_changed(Playlist::File);
+    playlist_edited(Playlist::File, changes);
 }
 
-void Player::load_file(int id)
+// Changes are sorted out under the lock, which is cheap, but the files to be
+// read again or added are handed to the library thread, and spliced back in
+// once they're read.
+void Player::update_library(std::span<const watch::Change> changes)
 {
-    std::lock_guard<SDLMutex> lock(audio.mutex);
-    auto res = read_file(file_cache[files.order[id]], file_cache, 44100, config.get<int>("default_duration"));
-    if (!res) {
-        error(res.error());
+    std::vector<fs::path> added;
+    std::unique_lock<SDLMutex> lock(audio.mutex);
+    LibraryJob job = { .generation = list_generation };
+    // listed files by directory, rebuilt after renames move them around
+    std::unordered_map<u32, std::vector<int>> by_dir;
+    std::vector<std::pair<intern::Dir, fs::path>> dir_paths;
+    auto stale = true;
+    std::vector<bool> removed(files.size()), to_reread(files.size()), unconfirmed(files.size());
+    std::vector<int> renamed;
+
+    auto find_file = [&](const fs::path &path) {
+        std::vector<int> found;
+        auto it = by_dir.find(intern::Dir(path.parent_path()).handle());
+        if (it == by_dir.end())
+            return found;
+        auto name = intern::String(path.filename().string());
+        for (auto p : it->second)
+            if (!removed[p] && file_list[files.at(p)].name == name)
+                found.push_back(p);
+        return found;
+    };
+
+    // @path is either a file or a directory, in which case every file under
+    // it is returned
+    auto find = [&](const fs::path &path) {
+        if (stale) {
+            by_dir.clear();
+            dir_paths.clear();
+            for (int p = 0; p < int(files.size()); p++)
+                by_dir[file_list[files.at(p)].dir.handle()].push_back(p);
+            for (auto &[dir, positions] : by_dir) {
+                auto d = file_list[files.at(positions[0])].dir;
+                dir_paths.emplace_back(d, d.path());
+            }
+            stale = false;
+        }
+        if (auto found = find_file(path); !found.empty())
+            return found;
+        std::vector<int> found;
+        for (auto &[dir, dir_path] : dir_paths)
+            if (watch::is_within(dir_path, path))
+                for (auto p : by_dir[dir.handle()])
+                    if (!removed[p])
+                        found.push_back(p);
+        return found;
+    };
+
+    auto rename = [&](fs::path &path, const fs::path &from, const fs::path &to) {
+        path = path == from ? to : to / path.lexically_relative(from);
+    };
+
+    for (const auto &c : changes) {
+        // a parked emulator still has the old file
+        if (c.kind != watch::Change::Added)
+            std::erase_if(parked, [&](const ParkedFormat &p) { return watch::is_within(p.path, c.path); });
+        switch (c.kind) {
+        case watch::Change::Added:
+            if (auto found = find(c.path); !found.empty()) {
+                // replaced while it was listed, or still there after a rescan
+                for (auto p : found) {
+                    to_reread[p]    = true;
+                    unconfirmed[p] = false;
+                }
+            } else if (std::find(added.begin(), added.end(), c.path) == added.end())
+                added.push_back(c.path);
+            break;
+        case watch::Change::Removed:
+            for (auto p : find(c.path))
+                removed[p] = true;
+            std::erase_if(added, [&](const fs::path &p) { return watch::is_within(p, c.path); });
+            break;
+        case watch::Change::Modified:
+            for (auto p : find(c.path))
+                to_reread[p] = true;
+            break;
+        case watch::Change::Renamed: {
+            auto found = find(c.path);
+            // saved by renaming over a listed file: the file being renamed
+            // isn't listed anymore, while the one it replaced is
+            if (auto target = find_file(c.to); !target.empty()) {
+                for (auto p : found)
+                    removed[p] = true;
+                for (auto p : target)
+                    to_reread[p] = true;
+                break;
+            }
+            for (auto p : found) {
+                auto &f = file_list[files.at(p)];
+                auto path = f.path();
+                rename(path, c.path, c.to);
+                f.dir  = intern::Dir(path.parent_path());
+                f.name = intern::String(path.filename().string());
+                index_file(files.at(p));
+            }
+            renamed.insert(renamed.end(), found.begin(), found.end());
+            stale = stale || !found.empty();
+            for (auto &p : added)
+                if (watch::is_within(p, c.path))
+                    rename(p, c.path, c.to);
+            break;
+        }
+        case watch::Change::Rescan:
+            // what's still there comes next as added: the rest is gone. Members
+            // of archives aren't walked into, so they're left alone
+            for (auto p : find(c.path))
+                if (!archive::split(file_list[files.at(p)].path()))
+                    unconfirmed[p] = true;
+            break;
+        }
+    }
+
+    for (int p = 0; p < int(files.size()); p++) {
+        removed[p] = removed[p] || unconfirmed[p];
+        if (to_reread[p] && !removed[p]) {
+            job.records.emplace_back(files.at(p), file_list[files.at(p)]);
+            job.hashes.push_back(file_hashes[files.at(p)]);
+            job.stamps.push_back(file_stamps[files.at(p)]);
+        }
+    }
+    // files read again are reported once they are
+    std::sort(renamed.begin(), renamed.end());
+    renamed.erase(std::unique(renamed.begin(), renamed.end()), renamed.end());
+    std::erase_if(renamed, [&](int p) { return removed[p] || to_reread[p]; });
+    if (!renamed.empty()) {
+        std::vector<int> records;
+        for (auto p : renamed)
+            records.push_back(files.at(p));
+        tracks_changed(records);
+        files_updated(renamed);
+    }
+    std::vector<int> to_remove;
+    for (int p = 0; p < int(removed.size()); p++)
+        if (removed[p])
+            to_remove.push_back(p);
+    if (!to_remove.empty())
+        remove_files(to_remove);
+    lock.unlock();
+
+    if (job.records.empty() && added.empty())
         return;
+    job.added = std::move(added);
+    queue_library_job(std::move(job));
+}
+
+void Player::queue_library_job(LibraryJob job)
+{
+    {
+        std::lock_guard lock(library.mutex);
+        library.queue.push_back(std::move(job));
     }
-    format = std::move(res.value());
-    if (files.current == -1)
+    library.cond.notify_one();
+}
+
+bool Player::worth_parking() const
+{
+    return format_track != -1 && loaded_record != -1
+        && !format->track_ended() && format->position() >= PARK_MIN_POSITION;
+}
+
+std::optional<Player::ParkedFormat> Player::unpark(const fs::path &path, int track)
+{
+    auto it = std::find_if(parked.begin(), parked.end(), [&](const ParkedFormat &p) {
+        return p.path == path && (track == -1 || p.track == track);
+    });
+    if (it == parked.end())
+        return std::nullopt;
+    auto p = std::move(*it);
+    parked.erase(it);
+    return p;
+}
+
+// Replaces the current emulator, which is parked if it's halfway through a
+// track. @track is the track @next is already playing, if any.
+void Player::switch_format(std::unique_ptr<FormatInterface> next, std::vector<io::MappedFile> mapped, int track)
+{
+    if (worth_parking()) {
+        parked.insert(parked.begin(), {
+            .path   = file_list[loaded_record].path(),
+            .track  = format_track,
+            .format = std::move(format),
+            .files  = std::move(loaded_files),
+        });
+        if (parked.size() > MAX_PARKED)
+            parked.pop_back();
+    }
+    format          = std::move(next);
+    loaded_files    = std::move(mapped);
+    format_track    = track;
+    format_unparked = track != -1;
+}
+
+// The files after the current one are read in the background, so that
+// loading them doesn't wait on the disk.
+void Player::prefetch_next()
+{
+    std::vector<fs::path> paths;
+    for (auto p = files.current + 1; p < int(files.size()) && p <= files.current + PREFETCH_FILES; p++)
+        paths.push_back(file_list[files.at(p)].path());
+    if (!paths.empty())
+        engine.prefetcher().fetch(this, std::move(paths), PREFETCH_BUDGET);
+}
+
+void Player::load_file(int id, int track)
+{
+    std::unique_lock<SDLMutex> lock(audio.mutex);
+    auto record = files.at(id);
+    // entering the file being left keeps its emulator: load_track() is what
+    // parks it, if another track of it is started
+    if (record != loaded_record) {
+        auto path = file_list[record].path();
+        if (auto p = unpark(path, track); p)
+            switch_format(std::move(p->format), std::move(p->files), p->track);
+        else {
+            lock.unlock();
+            std::vector<io::MappedFile> mapped;
+            auto res = open_file(path, mapped);
+            lock.lock();
+            if (!res) {
+                error(res.error());
+                return;
+            }
+            // the list changed while the file was read
+            if (id >= int(files.size()) || files.at(id) != record)
+                return;
+            switch_format(std::move(res.value()), std::move(mapped), -1);
+        }
+    }
+    if (loaded_record == -1)
         first_file_load();
     files.current = id;
+    loaded_record = files.at(id);
+    removed_at    = -1;
+    prefetch_next();
     track_cache.clear();
-    for (int i = 0; i < format->track_count(); i++)
+    track_index.clear();
+    for (int i = 0; i < format->track_count(); i++) {
         track_cache.push_back(format->track_metadata(i));
+        const auto &m = track_cache.back().info;
+        auto fields = std::array { m[Metadata::Song], m[Metadata::Game], m[Metadata::Author],
+                                   m[Metadata::System], m[Metadata::Comment] };
+        track_index.add(i, fields);
+    }
+    if (!track_cache.empty()) {
+        auto record = files.at(id);
+        file_metadata[record] = track_cache[0];
+        remember_metadata(file_hashes[record], track_cache[0]);
+        index_file(record);
+        tracks_changed(std::span{&record, 1});
+    }
     tracks.regen(track_cache.size());
+    publish_state();
     playlist_changed(Playlist::Track);
     file_changed(id);
 }
 
 void Player::load_track(int id)
 {
-    std::lock_guard<SDLMutex> lock(audio.mutex);
+    std::unique_lock<SDLMutex> lock(audio.mutex);
     tracks.current = id;
-    auto num = tracks.order[id];
-    if (auto err = format->start_track(num); err) {
-        error(err);
-        return;
+    auto num = tracks.at(id);
+    // leaving a track halfway for another one of the same file: the new one
+    // gets its own emulator, so that the old one can be parked
+    if (num != format_track && worth_parking()) {
+        auto record = loaded_record;
+        auto path = file_list[record].path();
+        if (auto p = unpark(path, num); p)
+            switch_format(std::move(p->format), std::move(p->files), p->track);
+        else {
+            lock.unlock();
+            std::vector<io::MappedFile> mapped;
+            auto res = open_file(path, mapped);
+            lock.lock();
+            // something else was loaded while the file was read
+            if (loaded_record != record || tracks.current != id)
+                return;
+            if (res)
+                switch_format(std::move(res.value()), std::move(mapped), -1);
+        }
+    }
+    auto resume = format_unparked && num == format_track;
+    format_unparked = false;
+    if (!resume) {
+        format_track = -1;
+        if (auto err = format->start_track(num); err) {
+            error(err);
+            return;
+        }
+        format_track = num;
+        format->set_fade_in(config.get(cfg::fade_in));
     }
     auto &metadata = track_cache[num];
-    format->set_fade_out(config.get<int>("fade"));
-    format->set_fade_in(config.get<int>("fade_in"));
-    format->set_tempo(int_to_tempo(config.get<int>("tempo")));
+    format->set_fade_out(config.get(cfg::fade));
+    format->set_tempo(int_to_tempo(config.get(cfg::tempo)));
     mpris->set_metadata({
-        { mpris::Field::TrackId, fmt::format("/{}{}", files.current, tracks.current)    },
-        { mpris::Field::Length,  metadata.length                                        },
-        { mpris::Field::Title,   std::string(metadata.info[Metadata::Song])             },
-        { mpris::Field::Album,   std::string(metadata.info[Metadata::Game])             },
-        { mpris::Field::Artist,  std::string(metadata.info[Metadata::Author])           }
+        { mpris::Field::TrackId, sdbus::ObjectPath(mpris_track_id(loaded_record))            },
+        { mpris::Field::Length,  int64_t(metadata.length) * 1000                        },
+        { mpris::Field::Title,   metadata.info[Metadata::Song].str()                    },
+        { mpris::Field::Album,   metadata.info[Metadata::Game].str()                    },
+        { mpris::Field::Artist,  metadata.info[Metadata::Author].str()                  }
     });
+    publish_state();
     track_changed(id, metadata);
 }
 
 void Player::load_pair(int file, int track)
 {
-    load_file(file);
+    // a newly loaded file's tracks are in order, so @track is also the
+    // number of the track to start
+    load_file(file, track);
     if (files.current == file)
         load_track(track);
 }
@@ -254,9 +1105,26 @@ void Player::clear()
     std::lock_guard<SDLMutex> lock(audio.mutex);
     pause();
     format = make_default_format();
-    track_cache.clear(); if (tracks.size() > 0) { tracks.clear(); playlist_changed(Playlist::Track); }
-    file_cache .clear(); if (files .size() > 0) {  files.clear(); playlist_changed(Playlist::File);  }
+    format_track = -1;
+    format_unparked = false;
+    loaded_record = -1;
+    removed_at = -1;
+    loaded_files.clear();
+    parked.clear();
+    auto had_tracks = tracks.size() > 0, had_files = files.size() > 0;
+    track_cache.clear(); tracks.clear();
+    file_list  .clear();  files.clear();
+    file_hashes.clear();
+    file_stamps.clear();
+    list_generation++;
+    file_metadata.clear();
+    track_index.clear();
+    file_index .clear();
+    hash_counts.clear();
     mpris->set_shuffle(false);
+    publish_state();
+    if (had_tracks) playlist_changed(Playlist::Track);
+    if (had_files)  playlist_changed(Playlist::File);
     cleared();
 }
 
@@ -264,16 +1132,31 @@ void Player::start_or_resume()
 {
     std::lock_guard<SDLMutex> lock(audio.mutex);
     if (!format->track_ended()) {
-        SDL_PauseAudioDevice(audio.dev_id, 0);
+        state.playing = true;
+        engine.update_device();
         mpris->set_playback_status(mpris::PlaybackStatus::Playing);
+        publish_state();
         played();
     }
 }
 
+// Once the device is paused nothing drains the command queue anymore, so
+// whatever was sent before the pause is applied here (see send()). This may
+// run on the audio thread, so MPRIS is left to the callers.
+void Player::pause_device()
+{
+    state.playing = false;
+    engine.update_device();
+    clear_meters();
+    published.store(state);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    apply_commands();
+}
+
 void Player::pause()
 {
     std::lock_guard<SDLMutex> lock(audio.mutex);
-    SDL_PauseAudioDevice(audio.dev_id, 1);
+    pause_device();
     mpris->set_playback_status(mpris::PlaybackStatus::Paused);
     paused();
 }
@@ -296,32 +1179,31 @@ void Player::stop()
     pause();
 }
 
-void Player::seek(int ms)
+void Player::seek(int ms)         { send({ .kind = Command::Seek,         .value = ms  }); }
+void Player::seek_relative(int off) { send({ .kind = Command::SeekRelative, .value = off }); }
+
+// The position of the file after (@off > 0) or before the current one. Once
+// the loaded file is removed from the list, that's around where it was.
+std::optional<int> Player::neighbour_file(int off) const
 {
-    std::lock_guard<SDLMutex> lock(audio.mutex);
-    if (auto err = format->seek(std::clamp(ms, 0, length())); err) {
-        pause();
-        error(err);
-    }
-    auto newpos = position();
-    seeked(newpos);
-    position_changed(newpos);
+    if (files.current != -1 || removed_at == -1)
+        return off > 0 ? files.next() : files.prev();
+    auto pos = off > 0 ? removed_at : removed_at - 1;
+    return pos >= 0 && pos < int(files.size()) ? std::optional{pos} : std::nullopt;
 }
 
-void Player::seek_relative(int off) { seek(position() + off); }
-
 void Player::next()
 {
     std::lock_guard<SDLMutex> lock(audio.mutex);
-         if (auto next = tracks.next(); next) load_track(next.value());
-    else if (auto next = files.next();  next) load_pair(next.value(), 0);
+         if (auto next = tracks.next();       next) load_track(next.value());
+    else if (auto next = neighbour_file(+1);  next) load_pair(next.value(), 0);
 }
 
 void Player::prev()
 {
     std::lock_guard<SDLMutex> lock(audio.mutex);
-         if (auto prev = tracks.prev(); prev) load_track(prev.value());
-    else if (auto prev = files.prev();  prev) load_pair(prev.value(), tracks.order.size() - 1);
+         if (auto prev = tracks.prev();       prev) load_track(prev.value());
+    else if (auto prev = neighbour_file(-1);  prev) load_pair(prev.value(), tracks.size() - 1);
 }
 
 void Player::shuffle(Playlist::Type which)
@@ -331,76 +1213,308 @@ void Player::shuffle(Playlist::Type which)
         tracks.shuffle();
     else {
         files.shuffle();
+        removed_at = -1;
         mpris->set_shuffle(true);
     }
+    publish_state();
     playlist_changed(which);
     shuffled(which);
 }
 
-int Player::move(Playlist::Type which, int n, int pos)
+void Player::unshuffle(Playlist::Type which)
 {
-    auto r = which == Playlist::Track ? tracks.move(n, pos) : files.move(n, pos);
+    std::lock_guard<SDLMutex> lock(audio.mutex);
+    if (which == Playlist::Track)
+        tracks.unshuffle();
+    else {
+        files.unshuffle();
+        removed_at = -1;
+        mpris->set_shuffle(false);
+    }
+    publish_state();
     playlist_changed(which);
-    return r;
 }
 
-bool Player::is_playing() const
+int Player::move(Playlist::Type which, int n, int pos)
 {
     std::lock_guard<SDLMutex> lock(audio.mutex);
-    return SDL_GetAudioDeviceStatus(audio.dev_id) == SDL_AUDIO_PLAYING;
+    auto change = (which == Playlist::Track ? tracks : files).move(n, 1, n + pos);
+    if (!change)
+        return n;
+    publish_state();
+    playlist_edited(which, std::span{&change.value(), 1});
+    return n + pos;
 }
 
-int Player::position() const
+void Player::move_range(Playlist::Type which, int first, int count, int to)
 {
     std::lock_guard<SDLMutex> lock(audio.mutex);
-    return format->position();
+    if (auto change = (which == Playlist::Track ? tracks : files).move(first, count, to); change) {
+        publish_state();
+        playlist_edited(which, std::span{&change.value(), 1});
+    }
 }
 
-int Player::length() const
+// Reads the metadata of files that were never read (by record id, along with
+// their record), in parallel and without the lock, which is only taken to
+// store what was read. MPRIS clients are told about the changes if @notify.
+// Returns the metadata in the same order, if it could be read.
+std::vector<std::optional<Metadata>> Player::read_metadata(std::span<const std::pair<int, FileRecord>> missing, bool notify)
 {
+    auto read = read_first_metadata(missing);
     std::lock_guard<SDLMutex> lock(audio.mutex);
-    return tracks.current == -1 ? 0 : track_info(current_track()).length
-                                    + config.get<int>("fade");
+    auto stored = store_metadata(missing, read);
+    if (notify)
+        tracks_changed(stored);
+    return read;
 }
 
-bool Player::is_multi_channel() const { return format->is_multi_channel(); }
+// Stores metadata read for @files without the lock, returning the records
+// it was stored for.
+std::vector<int> Player::store_metadata(std::span<const std::pair<int, FileRecord>> files,
+                                        std::span<const std::optional<Metadata>> read)
+{
+    std::vector<int> stored;
+    for (auto i = 0u; i < files.size(); i++) {
+        auto &[id, f] = files[i];
+        // the list may have been cleared and filled again meanwhile
+        if (!read[i] || id >= int(file_list.size()) || file_metadata.contains(id)
+         || file_list[id].dir != f.dir || file_list[id].name != f.name)
+            continue;
+        file_metadata[id] = read[i].value();
+        remember_metadata(file_hashes[id], read[i].value());
+        index_file(id);
+        stored.push_back(id);
+    }
+    return stored;
+}
 
-bool Player::has_next() const
+void Player::sort(Playlist::Type which, std::span<const SortKey> keys)
 {
     std::lock_guard<SDLMutex> lock(audio.mutex);
-    return tracks.next() || files.next();
+    sort_known(which, keys);
+    if (which != Playlist::File || std::all_of(keys.begin(), keys.end(), [](SortKey k) { return k == SortKey::Path; }))
+        return;
+    LibraryJob job = {
+        .generation      = list_generation,
+        .sort_keys       = std::vector(keys.begin(), keys.end()),
+        .sort_generation = ++sort_generation,
+    };
+    for (auto p = 0; p < int(files.size()); p++)
+        if (auto id = files.at(p); !file_metadata.contains(id))
+            job.unread.emplace_back(id, file_list[id]);
+    if (!job.unread.empty())
+        queue_library_job(std::move(job));
 }
 
-bool Player::has_prev() const
+// Sorts by what's known: files that were never read go by their name instead
+// of their metadata.
+void Player::sort_known(Playlist::Type which, std::span<const SortKey> keys)
 {
-    std::lock_guard<SDLMutex> lock(audio.mutex);
-    return tracks.prev() || files.prev();
+    auto &list = which == Playlist::Track ? tracks : files;
+    auto field_of = [&](int id, Metadata::Field field) {
+        if (which == Playlist::Track)
+            return track_cache[id].info[field];
+        auto it = file_metadata.find(id);
+        return it != file_metadata.end() ? it->second.info[field] : file_list[id].name;
+    };
+    auto length_of = [&](int id) {
+        return which == Playlist::Track ? track_cache[id].length : metadata_of(id).length;
+    };
+    auto num_keys = std::min(keys.size(), SortEntry{}.key.size());
+    std::vector<SortEntry> entries(list.size());
+    for (auto i = 0u; i < entries.size(); i++)
+        entries[i] = { .key = {}, .id = list.at(i) };
+
+    // precompute every key, so that sorting only compares integers
+    auto rank_by = [&](std::size_t k, auto &&get, auto &&to_string, int shift) {
+        using T = decltype(get(0));
+        std::vector<T> values;
+        values.reserve(entries.size());
+        for (auto &e : entries)
+            values.push_back(get(e.id));
+        auto ranks = collation_ranks<T>(values, to_string);
+        for (auto i = 0u; i < entries.size(); i++)
+            entries[i].key[k] |= u64(ranks[values[i]]) << shift;
+    };
+    auto rank_field = [&](std::size_t k, Metadata::Field field) {
+        rank_by(k, [&](int id) { return field_of(id, field); },
+                   [](intern::String s) { return s.view(); }, 0);
+    };
+
+    for (auto k = 0u; k < num_keys; k++) {
+        switch (keys[k]) {
+        case SortKey::Game:   rank_field(k, Metadata::Game);   break;
+        case SortKey::Author: rank_field(k, Metadata::Author); break;
+        case SortKey::System: rank_field(k, Metadata::System); break;
+        case SortKey::Title:  rank_field(k, Metadata::Song);   break;
+        case SortKey::Length:
+            for (auto &e : entries)
+                e.key[k] = u32(length_of(e.id));
+            break;
+        case SortKey::Path:
+            // tracks have no path of their own, use their number instead
+            if (which == Playlist::Track) {
+                for (auto &e : entries)
+                    e.key[k] = e.id;
+                break;
+            }
+            rank_by(k, [&](int id) { return file_list[id].dir;  }, [](intern::Dir d)    { return d.path().string(); }, 32);
+            rank_by(k, [&](int id) { return file_list[id].name; }, [](intern::String s) { return s.view(); },           0);
+            break;
+        }
+    }
+
+    parallel::stable_sort(entries.begin(), entries.end(), [=](const SortEntry &a, const SortEntry &b) {
+        return std::lexicographical_compare(a.key.begin(), a.key.begin() + num_keys,
+                                            b.key.begin(), b.key.begin() + num_keys);
+    });
+
+    auto current_id = list.current != -1 ? list.at(list.current) : -1;
+    std::vector<int> order(entries.size());
+    for (auto i = 0u; i < entries.size(); i++) {
+        order[i] = entries[i].id;
+        if (entries[i].id == current_id)
+            list.current = i;
+    }
+    list.assign(std::move(order));
+    if (which == Playlist::File)
+        removed_at = -1;
+    publish_state();
+    playlist_changed(which);
 }
 
-int Player::current_track() const { std::lock_guard<SDLMutex> lock(audio.mutex); return tracks.current; }
-int Player::current_file()  const { std::lock_guard<SDLMutex> lock(audio.mutex); return  files.current; }
+SavedSession Player::session() const
+{
+    std::lock_guard<SDLMutex> lock(audio.mutex);
+    SavedSession session;
+    // only the listed records are saved, renumbered in stored order: the
+    // saved file list is then in the same order as the playlist, which is
+    // saved as the identity (plus its shuffle, which still applies)
+    auto order = files.stored_order();
+    std::vector<int> listed;
+    listed.reserve(files.size());
+    for (auto i = 0u; i < files.size(); i++)
+        listed.push_back(order.empty() ? i : order[i]);
+    std::unordered_map<intern::Dir, u32> dir_ids;
+    session.file_dirs.reserve(listed.size());
+    for (auto id : listed) {
+        auto [it, inserted] = dir_ids.try_emplace(file_list[id].dir, dir_ids.size());
+        if (inserted)
+            session.add_string(file_list[id].dir.path().string());
+        session.file_dirs.push_back(it->second);
+    }
+    session.dir_count = dir_ids.size();
+    for (auto id : listed)
+        session.add_string(file_list[id].name.view());
+    session.hashes.reserve(listed.size());
+    for (auto id : listed)
+        session.hashes.push_back(file_hashes[id]);
+    auto save = [](const Playlist &p, bool identity) {
+        auto order = p.stored_order();
+        return SavedPlaylist {
+            .order   = identity ? std::vector<int>{} : std::vector<int>(order.begin(), order.end()),
+            .size    = int(p.size()),
+            .current = p.current,
+            .shuffle = p.permutation() ? std::optional{p.permutation()->get_keys()} : std::nullopt,
+        };
+    };
+    session.files    = save(files, true);
+    session.tracks   = save(tracks, false);
+    session.position = format->position();
+    return session;
+}
 
-int Player::current_of(Playlist::Type type) const
+void Player::restore(const SavedSession &session)
 {
     std::lock_guard<SDLMutex> lock(audio.mutex);
-    return (type == Playlist::Track ? tracks : files).current;
+    auto load = [](Playlist &p, const SavedPlaylist &saved) {
+        auto perm = saved.shuffle ? std::optional{rng::Permutation(saved.size, saved.shuffle.value())} : std::nullopt;
+        p.restore(saved.order, saved.size, perm);
+    };
+    clear();
+    std::vector<intern::Dir> dirs;
+    dirs.reserve(session.dir_count);
+    for (auto i = 0u; i < session.dir_count; i++)
+        dirs.emplace_back(fs::path(session.dir(i)));
+    file_list.reserve(session.file_count());
+    for (auto i = 0u; i < session.file_count(); i++) {
+        file_list.push_back({
+            .dir  = dirs[session.file_dirs[i]],
+            .name = intern::String(session.name(i)),
+        });
+        file_hashes.push_back(session.hashes[i]);
+        file_stamps.push_back(std::nullopt);
+        if (auto metadata = known_metadata.find(session.hashes[i]); metadata != known_metadata.end())
+            file_metadata[i] = metadata->second;
+        index_file(i);
+    }
+    load(files, session.files);
+    for (auto p = 0; p < int(files.size()); p++)
+        count_hash(file_hashes[files.at(p)], +1);
+    publish_state();
+    playlist_changed(Playlist::File);
+
+    if (session.files.current == -1)
+        return;
+    load_file(session.files.current);
+    // the file might have changed since
+    if (files.current != session.files.current || int(tracks.size()) != session.tracks.size)
+        return;
+    load(tracks, session.tracks);
+    publish_state();
+    playlist_changed(Playlist::Track);
+    if (session.tracks.current == -1)
+        return;
+    load_track(session.tracks.current);
+    if (session.position > 0)
+        seek(session.position);
 }
 
-int Player::track_count() const { std::lock_guard<SDLMutex> lock(audio.mutex); return tracks.order.size(); }
-int Player::file_count()  const { std::lock_guard<SDLMutex> lock(audio.mutex); return  files.order.size(); }
+bool Player::is_playing()       const { return published.load().playing; }
+int  Player::position()         const { return published.load().position; }
+int  Player::length()           const { return published.load().length; }
+bool Player::is_multi_channel() const { return published.load().multi_channel; }
+bool Player::has_next()         const { return published.load().has_next; }
+bool Player::has_prev()         const { return published.load().has_prev; }
+int  Player::current_track()    const { return published.load().track; }
+int  Player::current_file()     const { return published.load().file; }
+int  Player::track_count()      const { return published.load().track_count; }
+int  Player::file_count()       const { return published.load().file_count; }
+
+int Player::current_of(Playlist::Type type) const
+{
+    auto s = published.load();
+    return type == Playlist::Track ? s.track : s.file;
+}
 
 int Player::count_of(Playlist::Type type) const
 {
-    std::lock_guard<SDLMutex> lock(audio.mutex);
-    return (type == Playlist::Track ? tracks : files).order.size();
+    auto s = published.load();
+    return type == Playlist::Track ? s.track_count : s.file_count;
+}
+
+bool Player::is_shuffled(Playlist::Type type) const
+{
+    auto s = published.load();
+    return type == Playlist::Track ? s.tracks_shuffled : s.files_shuffled;
 }
 
-const Metadata &       Player::track_info(int id) const { std::lock_guard<SDLMutex> lock(audio.mutex); return track_cache[tracks.order[id]]; }
-const io::MappedFile & Player::file_info(int id)  const { std::lock_guard<SDLMutex> lock(audio.mutex); return  file_cache[ files.order[id]]; }
+int Player::track_number(int id) const { std::lock_guard<SDLMutex> lock(audio.mutex); return tracks.at(id); }
+
+const Metadata &       Player::track_info(int id) const { std::lock_guard<SDLMutex> lock(audio.mutex); return track_cache[tracks.at(id)]; }
+const FileRecord &     Player::file_info(int id)  const { std::lock_guard<SDLMutex> lock(audio.mutex); return  file_list[ files.at(id)]; }
+
+fs::path Player::loaded_path() const
+{
+    std::lock_guard<SDLMutex> lock(audio.mutex);
+    return loaded_record != -1 ? file_list[loaded_record].path() : fs::path{};
+}
 
 const std::vector<Metadata> Player::file_tracks(int i)
 {
-    auto format = gmplayer::read_file(file_cache[files.order[i]], file_cache, 44100, config.get<int>("default_duration"));
+    std::vector<io::MappedFile> mapped;
+    auto format = open_file(file_list[files.at(i)].path(), mapped);
     if (!format)
         return {};
     std::vector<Metadata> v;
@@ -409,16 +1523,236 @@ const std::vector<Metadata> Player::file_tracks(int i)
     return v;
 }
 
-void Player::loop_tracks(std::function<void(int, const Metadata &)> fn) const
+void Player::loop_tracks(std::function<void(int, const Metadata &)> fn, int first, int count) const
+{
+    std::lock_guard<SDLMutex> lock(audio.mutex);
+    int last = count < 0 ? tracks.size() : std::min<int>(first + count, tracks.size());
+    for (int p = std::max(first, 0); p < last; p++)
+        fn(tracks.at(p), track_cache[tracks.at(p)]);
+}
+
+void Player::loop_files(std::function<void(int, const FileRecord &)> fn, int first, int count) const
+{
+    std::lock_guard<SDLMutex> lock(audio.mutex);
+    int last = count < 0 ? files.size() : std::min<int>(first + count, files.size());
+    for (int p = std::max(first, 0); p < last; p++)
+        fn(files.at(p), file_list[files.at(p)]);
+}
+
+// Files that were never read have no metadata, which reads as empty.
+const Metadata &Player::metadata_of(int id) const
+{
+    static const Metadata none = {};
+    auto it = file_metadata.find(id);
+    return it != file_metadata.end() ? it->second : none;
+}
+
+// a file is found by its name and by the metadata of its first track, if
+// the file was already read once.
+void Player::index_file(int id)
+{
+    const auto &f = file_list[id];
+    const auto &m = metadata_of(id).info;
+    auto fields = std::array { f.name, m[Metadata::Song], m[Metadata::Game], m[Metadata::Author],
+                               m[Metadata::System], m[Metadata::Comment] };
+    file_index.add(id, fields);
+}
+
+// Reads what library jobs ask for: for the listed files, their stamp, then
+// their hash if the stamp changed, then their metadata if the hash changed;
+// added files are hashed, and unread ones read. Nothing here touches the
+// player's state.
+void Player::run_library_jobs(std::stop_token stop)
+{
+    while (!stop.stop_requested()) {
+        LibraryJob job;
+        {
+            std::unique_lock lock(library.mutex);
+            if (!library.cond.wait(lock, stop, [&] { return !library.queue.empty(); }))
+                return;
+            job = std::move(library.queue.front());
+            library.queue.erase(library.queue.begin());
+        }
+        auto n = job.records.size();
+        job.new_hashes.resize(n);
+        job.new_stamps.resize(n);
+        job.metadata.resize(n);
+        parallel::for_each_index(n, [&](std::size_t i) {
+            if (stop.stop_requested())
+                return;
+            auto path = job.records[i].second.path();
+            job.new_stamps[i] = FileStamp::of(path);
+            if (job.new_stamps[i] && job.new_stamps[i] == job.stamps[i]) {
+                job.new_hashes[i] = job.hashes[i];
+                return;
+            }
+            job.new_hashes[i] = hash::file(path);
+            if (job.new_hashes[i] == job.hashes[i])
+                return;
+            std::vector<io::MappedFile> mapped;
+            if (auto format = open_file(path, mapped); format && format.value()->track_count() > 0)
+                job.metadata[i] = format.value()->track_metadata(0);
+        }, parallel::num_threads(), 8);
+        job.unread_metadata = read_first_metadata(job.unread);
+        job.added_hashes.resize(job.added.size());
+        parallel::for_each_index(job.added.size(), [&](std::size_t i) {
+            if (!stop.stop_requested())
+                job.added_hashes[i] = hash::file(job.added[i]);
+        }, parallel::num_threads(), 8);
+        {
+            std::lock_guard lock(library.mutex);
+            library.done.push_back(std::move(job));
+        }
+    }
+}
+
+// Splices what a library job read back in. Records that were renamed or left
+// the list meanwhile are skipped, as are added files listed meanwhile.
+void Player::apply_library_job(LibraryJob &job)
+{
+    std::unique_lock<SDLMutex> lock(audio.mutex);
+    if (job.generation != list_generation)
+        return;
+    if (!job.unread.empty()) {
+        auto stored = store_metadata(job.unread, job.unread_metadata);
+        tracks_changed(stored);
+        if (!stored.empty() && job.sort_generation == sort_generation)
+            sort_known(Playlist::File, job.sort_keys);
+    }
+    std::vector<bool> listed(file_list.size());
+    std::unordered_set<u64> listed_paths;
+    for (auto p = 0; p < int(files.size()); p++) {
+        const auto &f = file_list[files.at(p)];
+        listed[files.at(p)] = true;
+        listed_paths.insert(u64(f.dir.handle()) << 32 | f.name.handle());
+    }
+    std::vector<int> changed;
+    for (auto i = 0u; i < job.records.size(); i++) {
+        auto &[id, old] = job.records[i];
+        if (id >= int(file_list.size()) || !listed[id]
+         || file_list[id].dir != old.dir || file_list[id].name != old.name)
+            continue;
+        file_stamps[id] = job.new_stamps[i];
+        if (job.new_hashes[i] == job.hashes[i])
+            continue;
+        count_hash(file_hashes[id], -1);
+        file_hashes[id] = job.new_hashes[i];
+        count_hash(file_hashes[id], +1);
+        if (job.metadata[i]) {
+            file_metadata[id] = job.metadata[i].value();
+            remember_metadata(file_hashes[id], job.metadata[i].value());
+        } else
+            file_metadata.erase(id);
+        index_file(id);
+        changed.push_back(id);
+    }
+    if (!changed.empty()) {
+        tracks_changed(changed);
+        std::vector<bool> is_changed(file_list.size());
+        for (auto id : changed)
+            is_changed[id] = true;
+        std::vector<int> positions;
+        for (auto p = 0; p < int(files.size()); p++)
+            if (is_changed[files.at(p)])
+                positions.push_back(p);
+        files_updated(positions);
+    }
+
+    std::vector<fs::path> added;
+    std::vector<u64> added_hashes;
+    for (auto i = 0u; i < job.added.size(); i++) {
+        auto dir  = intern::Dir(job.added[i].parent_path());
+        auto name = intern::String(job.added[i].filename().string());
+        if (!listed_paths.contains(u64(dir.handle()) << 32 | name.handle())) {
+            added.push_back(std::move(job.added[i]));
+            added_hashes.push_back(job.added_hashes[i]);
+        }
+    }
+    lock.unlock();
+    if (!added.empty())
+        add_files(added, added_hashes);
+}
+
+// Only listed files are counted. Files that couldn't be read (hash 0) have
+// nothing in common.
+void Player::count_hash(u64 hash, int delta)
+{
+    if (hash == 0)
+        return;
+    if (auto &count = hash_counts[hash]; (count += delta) <= 0)
+        hash_counts.erase(hash);
+}
+
+// Once too many files that aren't listed are remembered, they're all
+// forgotten: this only happens every MAX_UNLISTED_METADATA files or so.
+void Player::remember_metadata(u64 hash, const Metadata &metadata)
+{
+    if (hash == 0)
+        return;
+    known_metadata[hash] = metadata;
+    if (known_metadata.size() > hash_counts.size() + MAX_UNLISTED_METADATA)
+        std::erase_if(known_metadata, [&](const auto &p) { return !hash_counts.contains(p.first); });
+}
+
+std::vector<int> Player::duplicates() const
+{
+    std::lock_guard<SDLMutex> lock(audio.mutex);
+    std::vector<int> result;
+    for (auto p = 0; p < int(files.size()); p++)
+        if (auto it = hash_counts.find(file_hashes[files.at(p)]); it != hash_counts.end() && it->second > 1)
+            result.push_back(p);
+    return result;
+}
+
+std::vector<int> Player::search(Playlist::Type which, std::string_view query) const
 {
-    for (auto i : tracks.order)
-        fn(i, track_cache[i]);
+    std::lock_guard<SDLMutex> lock(audio.mutex);
+    const auto &list  = which == Playlist::Track ? tracks      : files;
+    const auto &index = which == Playlist::Track ? track_index : file_index;
+    std::vector<bool> found(which == Playlist::Track ? track_cache.size() : file_list.size());
+    for (auto id : index.find(query))
+        found[id] = true;
+    std::vector<int> positions;
+    for (int i = 0; i < list.size(); i++)
+        if (found[list.at(i)])
+            positions.push_back(i);
+    return positions;
 }
 
-void Player::loop_files(std::function<void(int, const io::MappedFile &)> fn) const
+Levels Player::levels() const
 {
-    for (auto i : files.order)
-        fn(i, file_cache[i]);
+    Levels l;
+    for (auto t = 0u; t < NUM_VOICES; t++)
+        l.voices[t] = { meters.peak[t].load(std::memory_order_relaxed), meters.rms[t].load(std::memory_order_relaxed) };
+    l.master = { meters.master_peak.load(std::memory_order_relaxed), meters.master_rms.load(std::memory_order_relaxed) };
+    l.clips = meters.clips.load(std::memory_order_relaxed);
+    return l;
+}
+
+void Player::clear_meters()
+{
+    for (auto t = 0u; t < NUM_VOICES; t++) {
+        meters.peak[t].store(0, std::memory_order_relaxed);
+        meters.rms[t].store(0, std::memory_order_relaxed);
+    }
+    meters.master_peak.store(0, std::memory_order_relaxed);
+    meters.master_rms.store(0, std::memory_order_relaxed);
+}
+
+// everything is read under a single lock, so that the status is consistent
+FormatContext Player::status_context() const
+{
+    std::lock_guard<SDLMutex> lock(audio.mutex);
+    if (loaded_record == -1 || tracks.current < 0 || tracks.current >= tracks.size())
+        return {};
+    return {
+        .track_id    = tracks.current,
+        .track_count = int(tracks.size()),
+        .file_id     = files.current,
+        .file_count  = int(files.size()),
+        .metadata    = track_cache[tracks.at(tracks.current)],
+        .file        = file_list[loaded_record],
+    };
 }
 
 std::vector<std::string> Player::channel_names()
@@ -432,105 +1766,109 @@ std::vector<std::string> Player::channel_names()
 
 void Player::mute_channel(int index, bool mute)
 {
-    std::lock_guard<SDLMutex> lock(audio.mutex);
-    format->mute_channel(index, mute);
+    send({ .kind = Command::Mute, .index = index, .value = mute });
 }
 
 void Player::set_channel_volume(int index, int value)
 {
-    std::lock_guard<SDLMutex> lock(audio.mutex);
-    effects.volume[index] = value;
+    send({ .kind = Command::ChannelVolume, .index = index, .value = value });
     channel_volume_changed(index, value);
 }
 
 mpris::Server &Player::mpris_server() { return *mpris; }
 
-tl::expected<std::vector<fs::path>, std::error_code> open_playlist(fs::path file_path)
+FormatString::FormatString(std::string_view fmt)
 {
-    return io::File::open(file_path, io::Access::Read).map([&](io::File &&file) {
-        std::vector<std::filesystem::path> paths;
-        for (std::string line; file.get_line(line); ) {
-            auto p = fs::path(line);
-            if (p.is_relative())
-                p = file_path.parent_path() / p;
-            paths.push_back(p);
+    for (std::size_t i = 0; i < fmt.size(); i++) {
+        if (fmt[i] != '%') {
+            if (pieces.empty() || pieces.back().token != Token::Literal)
+                pieces.push_back({ Token::Literal, u32(literals.size()), 0 });
+            literals += fmt[i];
+            pieces.back().size++;
+            continue;
         }
-        return paths;
-    });
+        if (++i == fmt.size())
+            break;
+        auto num_pieces = pieces.size();
+        switch (fmt[i]) {
+        case 'n': pieces.push_back({ Token::TrackId    }); break;
+        case 'm': pieces.push_back({ Token::TrackCount }); break;
+        case 's': pieces.push_back({ Token::Song       }); break;
+        case 'a': pieces.push_back({ Token::Author     }); break;
+        case 'g': pieces.push_back({ Token::Game       }); break;
+        case 'y': pieces.push_back({ Token::System     }); break;
+        case 'c': pieces.push_back({ Token::Comment    }); break;
+        case 'd': pieces.push_back({ Token::Dumper     }); break;
+        case 'l': pieces.push_back({ Token::Length     }); break;
+        case 'f': pieces.push_back({ Token::FileName   }); break;
+        case 'v': pieces.push_back({ Token::FileId     }); break;
+        case 'b': pieces.push_back({ Token::FileCount  }); break;
+        }
+        if (pieces.size() != num_pieces)
+            specifiers += fmt[i];
+    }
 }
 
-auto format(std::string_view fmt, auto &&get_info)
+void FormatString::render(std::string &out, const FormatContext &ctx) const
 {
-    std::string out;
-    for (int i = 0; i < fmt.size(); i++) {
-        if (fmt[i] != '%')
-            out += fmt[i];
-        else
-            out += get_info(fmt[++i]);
+    auto number = [&](int n) {
+        if (n < 0)
+            return;
+        char buf[16];
+        auto res = std::to_chars(buf, buf + sizeof(buf), n);
+        out.append(buf, res.ptr);
+    };
+    auto info = [&](Metadata::Field field) {
+        if (ctx.metadata)
+            out += ctx.metadata->info[field].view();
+    };
+
+    for (auto p : pieces) {
+        switch (p.token) {
+        case Token::Literal:    out.append(literals, p.offset, p.size); break;
+        case Token::TrackId:    number(ctx.track_id);                   break;
+        case Token::TrackCount: number(ctx.track_count);                break;
+        case Token::Song:       info(Metadata::Song);                   break;
+        case Token::Author:     info(Metadata::Author);                 break;
+        case Token::Game:       info(Metadata::Game);                   break;
+        case Token::System:     info(Metadata::System);                 break;
+        case Token::Comment:    info(Metadata::Comment);                break;
+        case Token::Dumper:     info(Metadata::Dumper);                 break;
+        case Token::Length:     number(ctx.metadata ? ctx.metadata->length : -1); break;
+        case Token::FileName:   if (ctx.file) out += ctx.file->name.view(); break;
+        case Token::FileId:     number(ctx.file_id);                    break;
+        case Token::FileCount:  number(ctx.file_count);                 break;
+        }
     }
+}
+
+std::string format_metadata(std::string_view fmt, int track_id, const Metadata &m, int track_count)
+{
+    std::string out;
+    FormatString(fmt).render(out, { .track_id = track_id, .track_count = track_count, .metadata = m });
     return out;
 }
 
-std::string format_metadata(
-    std::string_view fmt,
-    int track_id,
-    const Metadata &m,
-    int track_count
-)
-{
-    return format(fmt, [&](char c) -> std::string {
-        switch (c) {
-        case 'n': return fmt::format("{}", track_id);
-        case 'm': return fmt::format("{}", track_count);
-        case 's': return m.info[Metadata::Song];
-        case 'a': return m.info[Metadata::Author];
-        case 'g': return m.info[Metadata::Game];
-        case 'y': return m.info[Metadata::System];
-        case 'c': return m.info[Metadata::Comment];
-        case 'd': return m.info[Metadata::Dumper];
-        case 'l': return fmt::format("{}", m.length);
-        default: return "";
-        }
-    });
+std::string format_file(std::string_view fmt, int file_id, const FileRecord &file, int file_count)
+{
+    std::string out;
+    FormatString(fmt).render(out, { .file_id = file_id, .file_count = file_count, .file = file });
+    return out;
 }
 
-std::string format_file(std::string_view fmt, int file_id, const io::MappedFile &file, int file_count)
+std::string format_status(const FormatString &fmt, const gmplayer::Player &player)
 {
-    return format(fmt, [&](char c) -> std::string {
-        switch (c) {
-        case 'f': return file.name();
-        case 'v': return fmt::format("{}", file_id);
-        case 'b': return fmt::format("{}", file_count);
-        default: return "";
-        }
-    });
+    auto ctx = player.status_context();
+    if (!ctx.file || ctx.track_id == -1)
+        return "";
+    std::string out;
+    fmt.render(out, ctx);
+    return out;
 }
 
 std::string format_status(std::string_view fmt, const gmplayer::Player &player)
 {
-    auto file_id = player.current_file();
-    auto track_id = player.current_track();
-    if (file_id == -1 || track_id == -1)
-        return "";
-    const auto &file = player.file_info(file_id);
-    const auto &m = player.track_info(track_id);
-    return format(fmt, [&](char c) -> std::string {
-        switch (c) {
-        case 'n': return fmt::format("{}", track_id);
-        case 'm': return fmt::format("{}", player.track_count());
-        case 's': return m.info[Metadata::Song];
-        case 'a': return m.info[Metadata::Author];
-        case 'g': return m.info[Metadata::Game];
-        case 'y': return m.info[Metadata::System];
-        case 'c': return m.info[Metadata::Comment];
-        case 'd': return m.info[Metadata::Dumper];
-        case 'l': return fmt::format("{}", m.length);
-        case 'f': return file.name();
-        case 'v': return fmt::format("{}", file_id);
-        case 'b': return fmt::format("{}", player.file_count());
-        default: return "";
-        }
-    });
+    return format_status(FormatString(fmt), player);
 }
 
 } // namespace gmplayer
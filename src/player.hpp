@@ -1,27 +1,35 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
 #include <filesystem>
 #include <functional>
+#include <mutex>
 #include <optional>
 #include <span>
+#include <thread>
+#include <unordered_map>
 #include <vector>
-#include <SDL_audio.h> // SDL_AudioDeviceID
 #include "common.hpp"
 #include "format.hpp"
 #include "callback_handler.hpp"
+#include "command_queue.hpp"
+#include "engine.hpp"
+#include "event_queue.hpp"
+#include "intern.hpp"
+#include "random.hpp"
+#include "search.hpp"
+#include "seqlock.hpp"
+#include "session_file.hpp"
+#include "triple_buffer.hpp"
+#include "watch.hpp"
 
 namespace mpris { struct Server; }
 namespace io { class File; class MappedFile; }
 
 namespace gmplayer {
 
-struct SDLMutex {
-    SDL_AudioDeviceID id;
-    SDLMutex() = default;
-    SDLMutex(SDL_AudioDeviceID id) : id{id} {}
-    void lock()   { SDL_LockAudioDevice(id); }
-    void unlock() { SDL_UnlockAudioDevice(id); }
-};
+struct FormatContext;
 
 struct PlayerOptions {
     int fade_out;
@@ -33,26 +41,68 @@ struct PlayerOptions {
     int volume;
 };
 
-struct Playlist {
+enum class SortKey { Game, Author, System, Title, Length, Path };
+
+/*
+ * A playlist is an ordering of the ids [0, size). The order is only stored
+ * once it stops being the identity (i.e. after items are removed, moved or
+ * sorted), and shuffling doesn't store anything at all: a shuffled playlist is
+ * a random permutation computed on the fly over the stored order. This way
+ * creating or shuffling a playlist is O(1), no matter how big it is.
+ * Editing a shuffled playlist fixes its current order as the stored one.
+ *
+ * Edits are done in batches, each in a single pass, and return a description
+ * of what changed (see Change), which views can replay instead of reloading
+ * the whole list. The current position follows the item it points to.
+ *
+ * @at: returns the id at position @pos;
+ * @regen: resets the playlist to the identity of @size ids;
+ * @assign: replaces the whole order;
+ * @insert: inserts @ids before position @pos;
+ * @remove: removes the items at every position in @positions. Removed ranges
+ *          are returned from last to first;
+ * @move: moves the range [@first, @first + @count) so that it starts at @to;
+ * @unshuffle: goes back to the order before shuffle() was called;
+ * @stored_order, @permutation: the stored order (empty while it's the
+ *                              identity) and the shuffle, which together with
+ *                              the size make up the whole playlist;
+ * @restore: rebuilds a playlist from the above;
+ */
+class Playlist {
+    std::vector<int> custom;
+    int length = 0;
+    std::optional<rng::Permutation> perm;
+
+    int base_at(int i) const { return custom.empty() ? i : custom[i]; }
+    void materialize();
+
+public:
     enum Type { Track, File };
 
-    std::vector<int> order;
+    // positions of Remove and Move are relative to the list as it is before
+    // the change; @to is the position of the first moved item after the move.
+    struct Change {
+        enum Kind { Insert, Remove, Move } kind;
+        int first, count;
+        int to = 0;
+    };
+
     int current = -1;
     bool repeat = false;
 
-    void regen();
+    int at(int pos) const { return base_at(perm ? int(perm->map(pos)) : pos); }
     void regen(int size);
+    void assign(std::vector<int> order);
+    Change insert(int pos, std::span<const int> ids);
+    std::vector<Change> remove(std::span<const int> positions);
+    std::optional<Change> move(int first, int count, int to);
     void shuffle();
-    void clear()         { order.clear(); current = -1; }
-    void remove(int i)   { order.erase(order.begin() + i); }
-
-    int move(int i, int pos)
-    {
-        if (i + pos < 0 || i + pos > order.size() - 1)
-            return i;
-        std::swap(order[i], order[i+pos]);
-        return i+pos;
-    }
+    void unshuffle();
+    bool is_shuffled() const { return perm.has_value(); }
+    std::span<const int> stored_order() const                  { return custom; }
+    const std::optional<rng::Permutation> &permutation() const { return perm; }
+    void restore(std::vector<int> order, int size, std::optional<rng::Permutation> shuffle);
+    void clear()             { custom.clear(); length = 0; perm.reset(); current = -1; }
 
     std::optional<int> get(int off, int min, int max) const
     {
@@ -61,23 +111,100 @@ struct Playlist {
              : std::nullopt;
     }
 
-    std::optional<int> next() const { return get(+1, -1, order.size()); }
-    std::optional<int> prev() const { return get(-1, -1, order.size()); }
-    std::size_t size() const { return order.size(); }
+    std::optional<int> next() const { return get(+1, -1, length); }
+    std::optional<int> prev() const { return get(-1, -1, length); }
+    std::size_t size() const { return length; }
+};
+
+// An entry of the file list. Both the directory and the file name are
+// interned, so that a record is only a pair of handles.
+struct FileRecord {
+    intern::Dir dir;
+    intern::String name;
+
+    std::filesystem::path path() const { return dir.path() / name.view(); }
+};
+
+// The size and modification time of a file, which tell whether it changed
+// without reading it. Members of archives go by their archive.
+struct FileStamp {
+    u64 size;
+    i64 mtime;
+
+    bool operator==(const FileStamp &) const = default;
+    static std::optional<FileStamp> of(const std::filesystem::path &path);
+};
+
+// The samples of one played buffer, both split by voice (only for
+// multi-channel formats, zeroes otherwise) and mixed.
+struct AudioBuffer {
+    std::array<i16, NUM_FRAMES * NUM_CHANNELS * NUM_VOICES> voices;
+    std::array<f32, NUM_FRAMES * NUM_CHANNELS>              mix;
+};
+
+// Peak and RMS levels, as linear amplitudes where 1 is full scale.
+struct Level {
+    f32 peak = 0;
+    f32 rms  = 0;
+};
+
+// The levels of the last played buffer. @clips counts the buffers which had
+// at least one clipped sample in the master bus since the player started.
+struct Levels {
+    std::array<Level, NUM_VOICES> voices;
+    Level master;
+    u64 clips = 0;
 };
 
-class Player {
+// What the player is doing, published as a whole so that any thread can read
+// it without locking. Times are in milliseconds.
+struct PlaybackState {
+    int position    = 0;
+    int length      = 0;
+    int track       = -1;
+    int file        = -1;
+    int track_count = 0;
+    int file_count  = 0;
+    bool playing         = false;
+    bool has_next        = false;
+    bool has_prev        = false;
+    bool multi_channel   = false;
+    bool tracks_shuffled = false;
+    bool files_shuffled  = false;
+};
+
+// A single playback session with everything the frontends need around it:
+// playlists, MPRIS, signals and meters. It plays through its engine's device
+// (see engine.hpp), along with whatever other sessions the engine has.
+class Player : public Session {
+    Engine &engine;
     std::unique_ptr<FormatInterface> format;
-    std::vector<io::MappedFile> file_cache;
+    std::vector<io::MappedFile> loaded_files;
+    std::vector<FileRecord> file_list;
+    // the hash of each record's contents (see hash.hpp), 0 if the file
+    // couldn't be read
+    std::vector<u64> file_hashes;
+    // each record's stamp when it was hashed, if known (it isn't for files
+    // restored from a session)
+    std::vector<std::optional<FileStamp>> file_stamps;
+    // the metadata of the first track of the files read so far, by record id
+    std::unordered_map<int, Metadata> file_metadata;
     std::vector<Metadata> track_cache;
     Playlist files;
     Playlist tracks;
+    search::Index file_index;
+    search::Index track_index;
+    // how many listed files have each hash, and the metadata of files read
+    // so far by hash, which holds for any other copy of them. Files that
+    // aren't listed anymore are only remembered up to MAX_UNLISTED_METADATA
+    std::unordered_map<u64, int> hash_counts;
+    std::unordered_map<u64, Metadata> known_metadata;
     std::unique_ptr<mpris::Server> mpris;
+    TripleBuffer<AudioBuffer> buffers;
 
+    // the engine's device lock (see engine.hpp)
     struct {
-        SDL_AudioDeviceID dev_id = 0;
         mutable SDLMutex mutex;
-        SDL_AudioSpec spec;
     } audio;
 
     struct {
@@ -92,20 +219,144 @@ class Player {
                                                MAX_VOLUME_VALUE / 2, MAX_VOLUME_VALUE / 2, };
     } effects;
 
-    void audio_callback(std::span<u8> stream);
+    // written by the audio callback, read by anyone
+    struct {
+        std::array<std::atomic<f32>, NUM_VOICES> peak = {}, rms = {};
+        std::atomic<f32> master_peak = 0, master_rms = 0;
+        std::atomic<u64> clips = 0;
+    } meters;
+
+    // events recorded by the audio callback, delivered by dispatch_events();
+    // high rate ones only keep their latest value. Events are only recorded
+    // with the lock held, which keeps the queue single producer.
+    struct AudioEvent {
+        enum Kind : u8 { Paused, TrackEnded, Seeked, SeekFailed } kind;
+        int value = 0;
+    };
+    EventQueue<AudioEvent, 64> audio_events;
+    Error seek_error;
+    struct {
+        std::atomic<int> position = -1;
+        std::atomic<bool> samples = false;
+    } coalesced;
+
+    // control operations, sent by any thread and applied by the audio
+    // callback (see send())
+    struct Command {
+        enum Kind : u8 { Volume, Mute, ChannelVolume, Tempo, Seek, SeekRelative } kind;
+        int index = 0;
+        int value = 0;
+    };
+    CommandQueue<Command, 64> commands;
+
+    // emulators of tracks that were left halfway, most recent first, kept as
+    // they were: going back to one of them resumes it right away, instead of
+    // emulating everything up to where it was again
+    struct ParkedFormat {
+        std::filesystem::path path;
+        int track;
+        std::unique_ptr<FormatInterface> format;
+        std::vector<io::MappedFile> files;
+    };
+    std::vector<ParkedFormat> parked;
+    // the record of the loaded file. It stays loaded (and playing) when its
+    // entry is removed from the list: files.current is then -1, and
+    // @removed_at is the position of the entry that came after it
+    int loaded_record = -1;
+    int removed_at = -1;
+    // the track format is playing, -1 if it hasn't started any, and whether
+    // it was just taken back from the parked ones, still where it was left
+    int format_track = -1;
+    bool format_unparked = false;
+
+    // the records of the entries removed last, for MPRIS (see update_tracklist())
+    std::vector<int> removed_records;
+
+    // files changed on disk are read again (and added ones hashed) on a
+    // thread of their own, as are files never read that a sort needs. Finished jobs are applied by dispatch_events(),
+    // unless the list was cleared in the meantime (see @list_generation)
+    struct LibraryJob {
+        u64 generation;
+        // listed records to read again, along with what's known of them
+        std::vector<std::pair<int, FileRecord>> records;
+        std::vector<u64> hashes;
+        std::vector<std::optional<FileStamp>> stamps;
+        std::vector<std::filesystem::path> added;
+        // files whose metadata was never read, and the sort to redo once it
+        // is, unless the files were sorted again meanwhile
+        std::vector<std::pair<int, FileRecord>> unread;
+        std::vector<SortKey> sort_keys;
+        u64 sort_generation = 0;
+        // filled by the thread
+        std::vector<u64> new_hashes, added_hashes;
+        std::vector<std::optional<FileStamp>> new_stamps;
+        std::vector<std::optional<Metadata>> metadata, unread_metadata;
+    };
+    struct {
+        std::mutex mutex;
+        std::condition_variable_any cond;
+        std::vector<LibraryJob> queue, done;
+        std::jthread thread;
+    } library;
+    u64 list_generation = 0;
+    u64 sort_generation = 0;
+
+    // the writer's copy of the state: only touched with the lock held, then
+    // published for readers
+    PlaybackState state;
+    SeqLock<PlaybackState> published;
+
+    bool is_rendering() const override;
+    void render(std::span<u8> stream) override;
+    void pause_device();
+    void send(Command cmd);
+    void apply_commands();
+    void apply(Command cmd);
+    void publish_state();
+    std::pair<int, int> tracklist_window() const;
+    void update_tracklist(std::span<const Playlist::Change> changes);
+    void tracks_changed(std::span<const int> ids);
+    void clear_meters();
+    const Metadata &metadata_of(int id) const;
+    void index_file(int id);
+    void count_hash(u64 hash, int delta);
+    void remember_metadata(u64 hash, const Metadata &metadata);
+    void run_library_jobs(std::stop_token stop);
+    void apply_library_job(LibraryJob &job);
+    std::vector<std::optional<Metadata>> read_metadata(std::span<const std::pair<int, FileRecord>> missing, bool notify);
+    std::vector<int> store_metadata(std::span<const std::pair<int, FileRecord>> files,
+                                    std::span<const std::optional<Metadata>> read);
+    void queue_library_job(LibraryJob job);
+    void sort_known(Playlist::Type which, std::span<const SortKey> keys);
+    bool worth_parking() const;
+    std::optional<ParkedFormat> unpark(const std::filesystem::path &path, int track = -1);
+    void switch_format(std::unique_ptr<FormatInterface> next, std::vector<io::MappedFile> mapped, int track);
+    void prefetch_next();
+    std::optional<int> neighbour_file(int off) const;
 
 public:
-    Player();
+    explicit Player(Engine &engine);
     ~Player();
 
     using AddFileError = std::pair<std::filesystem::path, std::error_code>;
 
     std::vector<AddFileError> add_file(std::filesystem::path path);
-    std::vector<AddFileError> add_files(std::span<std::filesystem::path> paths);
+    // @hashes, if given, are those of @paths: files are hashed otherwise.
+    // Files already listed are refused (as existing) if skip_duplicates is set.
+    std::vector<AddFileError> add_files(std::span<std::filesystem::path> paths, std::span<const u64> hashes = {});
     void remove_file(int id);
     void remove_files(std::span<int> ids);
+    // follows changes made on disk to listed files: removed files leave the
+    // list, renamed ones keep their place under their new name, and files
+    // whose contents changed are read again. Added files are appended.
+    // Files are read on another thread: what it finds is applied by a later
+    // dispatch_events(). Files whose size and modification time didn't
+    // change aren't read at all.
+    void update_library(std::span<const watch::Change> changes);
 
-    void load_file(int id);
+    // files are read with the lock released, unless the caller holds it.
+    // @track is the track that will be started next in the file, if known
+    void load_file(int id, int track = -1);
     void load_track(int num);
     void load_pair(int file, int track);
     void clear();
@@ -118,7 +369,17 @@ public:
     void next();
     void prev();
     void shuffle(Playlist::Type which);
+    void unshuffle(Playlist::Type which);
     int move(Playlist::Type which, int n, int pos);
+    void move_range(Playlist::Type which, int first, int count, int to);
+    // files never read yet are sorted by their name at first, and sorted
+    // again once their metadata is read in the background
+    void sort(Playlist::Type which, std::span<const SortKey> keys);
+    // the file list, both playlists and where playback is, for the next run
+    SavedSession session() const;
+    // replaces everything with a saved session, reloading its current track
+    // and seeking to where it was
+    void restore(const SavedSession &session);
 
     bool is_playing() const;
     int position() const;
@@ -129,14 +390,31 @@ public:
     int current_track() const;
     int current_file() const;
     int current_of(Playlist::Type type) const;
+    // the number of the track at position @id within its file
+    int track_number(int id) const;
     int track_count() const;
     int file_count() const;
     int count_of(Playlist::Type type) const;
+    bool is_shuffled(Playlist::Type type) const;
     const Metadata & track_info(int id) const;
-    const io::MappedFile & file_info(int id) const;
+    const FileRecord & file_info(int id) const;
+    // the path of the loaded file, empty if there's none
+    std::filesystem::path loaded_path() const;
     const std::vector<Metadata> file_tracks(int id);
-    void loop_tracks(std::function<void(int, const Metadata &)> fn) const;
-    void loop_files(std::function<void(int, const io::MappedFile &)> fn) const;
+    void loop_tracks(std::function<void(int, const Metadata &)> fn, int first = 0, int count = -1) const;
+    void loop_files(std::function<void(int, const FileRecord &)> fn, int first = 0, int count = -1) const;
+    std::vector<int> search(Playlist::Type which, std::string_view query) const;
+    // positions of the listed files which have the same contents as another
+    // listed file, in playlist order
+    std::vector<int> duplicates() const;
+    FormatContext status_context() const;
+    // lock-free, as are the getters above reading from it
+    PlaybackState playback_state() const { return published.load(); }
+    // returns the last played buffer, or nullptr if there's nothing new since
+    // the last call. There must be only one thread calling this.
+    const AudioBuffer *latest_samples() { return buffers.read(); }
+    // lock-free, can be called at any rate
+    Levels levels() const;
 
     std::vector<std::string> channel_names();
     void mute_channel(int index, bool mute);
@@ -144,6 +422,11 @@ public:
 
     mpris::Server &mpris_server();
 
+    // delivers the signals raised by the audio thread since the last call, on
+    // the calling thread. Frontends must call this regularly from the thread
+    // owning the UI; positions and samples are coalesced into one signal each.
+    void dispatch_events();
+
 #define MAKE_SIGNAL(name, ...) \
 private:                                            \
     CallbackHandler<void(__VA_ARGS__)> name;        \
@@ -163,19 +446,70 @@ public:                                             \
     MAKE_SIGNAL(error, Error)
     MAKE_SIGNAL(cleared, void)
     MAKE_SIGNAL(playlist_changed, Playlist::Type)
+    MAKE_SIGNAL(playlist_edited, Playlist::Type, std::span<const Playlist::Change>)
     MAKE_SIGNAL(files_removed, std::span<int>)
-    MAKE_SIGNAL(samples_played, std::span<i16>, std::span<f32>)
+    MAKE_SIGNAL(files_updated, std::span<const int>)
+    MAKE_SIGNAL(samples_played, void)
     MAKE_SIGNAL(channel_volume_changed, int, int)
     MAKE_SIGNAL(first_file_load, void)
 
 #undef MAKE_SIGNAL
 };
 
-inline bool is_playlist(std::filesystem::path filename) { return filename.extension() == ".playlist"; }
-tl::expected<std::vector<std::filesystem::path>, std::error_code> open_playlist(std::filesystem::path file_path);
+// Everything a format string can refer to. Unknown values are -1 or empty.
+// Metadata and records are copies (both only hold interned ids), so that a
+// context stays valid after the lock it was filled under is released.
+struct FormatContext {
+    int track_id    = -1;
+    int track_count = -1;
+    int file_id     = -1;
+    int file_count  = -1;
+    std::optional<Metadata> metadata;
+    std::optional<FileRecord> file;
+};
+
+/*
+ * A format string, compiled once into a list of tokens so that it can be
+ * rendered any number of times without being parsed again. Text is copied as
+ * is, while these specifiers are replaced:
+ *     %n, %m: track number, track count;
+ *     %s, %a, %g, %y, %c, %d: song, author, game, system, comment, dumper;
+ *     %l: track length;
+ *     %f, %v, %b: file name, file number (its position in the list), file
+ *                 count;
+ * Anything missing from the context renders as nothing, as do unknown
+ * specifiers.
+ *
+ * @render: appends the result to @out, so that one buffer can be reused for
+ *          many renders;
+ * @uses: whether the string has specifier @c (e.g. 'b' for %b), which tells
+ *        what a rendered string goes stale with;
+ */
+class FormatString {
+    enum class Token : u8 {
+        Literal, TrackId, TrackCount, Song, Author, Game, System, Comment, Dumper,
+        Length, FileName, FileId, FileCount,
+    };
+
+    struct Piece {
+        Token token;
+        u32 offset = 0, size = 0;
+    };
+
+    std::string literals;
+    std::vector<Piece> pieces;
+    std::string specifiers;
+
+public:
+    FormatString() = default;
+    explicit FormatString(std::string_view fmt);
+    void render(std::string &out, const FormatContext &ctx) const;
+    bool uses(char c) const { return specifiers.find(c) != specifiers.npos; }
+};
 
 std::string format_metadata(std::string_view fmt, int track_id, const Metadata &m, int track_count);
-std::string format_file(std::string_view fmt, int file_id, const io::MappedFile &file, int file_count);
+std::string format_file(std::string_view fmt, int file_id, const FileRecord &file, int file_count);
+std::string format_status(const FormatString &fmt, const gmplayer::Player &player);
 std::string format_status(std::string_view fmt, const gmplayer::Player &player);
 
 } // namespace gmplayer
@@ -0,0 +1,126 @@
+#include "playlist_file.hpp"
+
+#include <cstring>
+#include <string>
+#include "common.hpp"
+#include "io.hpp"
+#include "parallel.hpp"
+
+namespace fs = std::filesystem;
+
+namespace gmplayer {
+
+namespace {
+
+constexpr std::string_view UTF8_BOM = "\xEF\xBB\xBF";
+
+bool is_absolute(std::string_view path)
+{
+#ifdef PLATFORM_WINDOWS
+    return path.starts_with('/') || path.starts_with('\\')
+        || (path.size() >= 3 && path[1] == ':' && (path[2] == '/' || path[2] == '\\'));
+#else
+    return path.starts_with('/');
+#endif
+}
+
+int hex_digit(char c)
+{
+    return c >= '0' && c <= '9' ? c - '0'
+         : c >= 'a' && c <= 'f' ? c - 'a' + 10
+         : c >= 'A' && c <= 'F' ? c - 'A' + 10
+         : -1;
+}
+
+// file:///some/path%20with%20spaces -> /some/path with spaces
+std::string decode_url(std::string_view url)
+{
+    url.remove_prefix(std::strlen("file://"));
+#ifdef PLATFORM_WINDOWS
+    // file:///C:/...
+    if (url.size() >= 3 && url[0] == '/' && url[2] == ':')
+        url.remove_prefix(1);
+#endif
+    std::string res;
+    res.reserve(url.size());
+    for (std::size_t i = 0; i < url.size(); i++) {
+        int hi, lo;
+        if (url[i] == '%' && i + 2 < url.size()
+         && (hi = hex_digit(url[i+1])) != -1 && (lo = hex_digit(url[i+2])) != -1) {
+            res += char(hi << 4 | lo);
+            i += 2;
+        } else
+            res += url[i];
+    }
+    return res;
+}
+
+} // namespace
+
+bool is_playlist(const fs::path &filename)
+{
+    auto ext = filename.extension();
+    return ext == ".playlist" || ext == ".m3u" || ext == ".m3u8";
+}
+
+std::vector<fs::path> parse_playlist(std::string_view text, const fs::path &dir)
+{
+    if (text.starts_with(UTF8_BOM))
+        text.remove_prefix(UTF8_BOM.size());
+
+    // splitting is cheap, while building a path allocates and parses it:
+    // collect the lines first, then build all paths over multiple threads
+    std::vector<std::string_view> lines;
+    std::string_view prev;
+    for (std::size_t pos = 0; pos < text.size(); ) {
+        auto nl = static_cast<const char *>(std::memchr(text.data() + pos, '\n', text.size() - pos));
+        auto end = nl ? std::size_t(nl - text.data()) : text.size();
+        auto line = text.substr(pos, end - pos);
+        pos = end + 1;
+        if (line.ends_with('\r'))
+            line.remove_suffix(1);
+        // comments and M3U directives
+        if (line.empty() || line.starts_with('#'))
+            continue;
+        // extended M3U: file::TYPE,track,...
+        if (auto i = line.find("::"); i != line.npos)
+            line = line.substr(0, i);
+        if (line.empty() || line == prev)
+            continue;
+        prev = line;
+        lines.push_back(line);
+    }
+
+    // joining strings is much cheaper than operator/ on every single path
+    auto prefix = dir.empty() ? std::string{} : (dir / "").string();
+    std::vector<fs::path> paths(lines.size());
+    parallel::for_each_index(lines.size(), [&](std::size_t i) {
+        auto line = lines[i];
+        if (line.starts_with("file://"))
+            paths[i] = decode_url(line);
+        else if (is_absolute(line))
+            paths[i] = line;
+        else {
+            std::string buf;
+            buf.reserve(prefix.size() + line.size());
+            buf.append(prefix);
+            buf.append(line);
+            paths[i] = std::move(buf);
+        }
+    });
+    return paths;
+}
+
+tl::expected<std::vector<fs::path>, std::error_code> open_playlist(const fs::path &file_path)
+{
+    // empty files can't be mapped
+    std::error_code ec;
+    if (fs::is_empty(file_path, ec))
+        return std::vector<fs::path>{};
+    return io::MappedFile::open(file_path, io::Access::Read).map([&](io::MappedFile &&file) {
+        auto text = std::string_view(reinterpret_cast<const char *>(file.data()), file.size());
+        return parse_playlist(text, file_path.parent_path());
+    });
+}
+
+} // namespace gmplayer
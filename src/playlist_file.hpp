@@ -0,0 +1,39 @@
+/*
+ * Reading playlist files. Recognized are:
+ *
+ *  - plain lists of paths, one per line (.playlist, or anything not below);
+ *  - M3U and M3U8, where lines starting with # are comments or directives
+ *    (#EXTM3U, #EXTINF etc.) and paths may also be file:// URLs. Both are
+ *    accepted in any playlist;
+ *  - the extended M3U used by GME and other chiptune players, where every
+ *    entry reads "file::TYPE,track,title,length,...". Only the file is kept,
+ *    as the player lists files, not single tracks; consecutive entries for the
+ *    same file are read as one.
+ *
+ * Relative paths are taken relative to the playlist's directory.
+ * The file is mapped instead of being read line by line: splitting it is a
+ * memchr() per line, which libc vectorizes, so that most of the time goes to
+ * building the resulting paths, which is spread over multiple threads.
+ *
+ * @is_playlist: whether a file should be opened as a playlist, based on its
+ *               extension;
+ * @parse_playlist: parses the contents of a playlist, resolving relative
+ *                  paths against @dir;
+ * @open_playlist: opens and parses a playlist file;
+ */
+
+#pragma once
+
+#include <filesystem>
+#include <string_view>
+#include <system_error>
+#include <vector>
+#include <tl/expected.hpp>
+
+namespace gmplayer {
+
+bool is_playlist(const std::filesystem::path &filename);
+std::vector<std::filesystem::path> parse_playlist(std::string_view text, const std::filesystem::path &dir);
+tl::expected<std::vector<std::filesystem::path>, std::error_code> open_playlist(const std::filesystem::path &file_path);
+
+} // namespace gmplayer
@@ -0,0 +1,176 @@
+#include "prefetch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+#include <utility>
+#include "archive.hpp"
+#include "io.hpp"
+
+#ifdef PLATFORM_LINUX
+#include <fcntl.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace prefetch {
+
+namespace {
+
+constexpr std::size_t CHUNK_SIZE = 256 * 1024;
+constexpr std::size_t MAX_RECENT = 32;
+// GSF libraries can refer to libraries of their own
+constexpr int MAX_LIB_DEPTH = 4;
+constexpr u64 MAX_TAG_SIZE = 64 * 1024;
+constexpr std::size_t PSF_HEADER_SIZE = 16;
+
+u32 read_u32(const u8 *p) { return u32(p[0]) | u32(p[1]) << 8 | u32(p[2]) << 16 | u32(p[3]) << 24; }
+
+// The libraries listed in a PSF file's tags (_lib, _lib2, _lib3...), which
+// come after the reserved area and the program.
+std::vector<fs::path> psf_libs(const fs::path &path)
+{
+    auto file = archive::open(path);
+    if (!file)
+        return {};
+    auto data = file.value().bytes();
+    if (data.size() < PSF_HEADER_SIZE || std::memcmp(data.data(), "PSF", 3) != 0)
+        return {};
+    auto tag_offset = u64(PSF_HEADER_SIZE) + read_u32(&data[4]) + read_u32(&data[8]);
+    if (tag_offset >= data.size())
+        return {};
+    auto tags = std::string_view(reinterpret_cast<const char *>(data.data()) + tag_offset,
+                                 std::min<u64>(data.size() - tag_offset, MAX_TAG_SIZE));
+    if (!tags.starts_with("[TAG]"))
+        return {};
+
+    std::vector<fs::path> libs;
+    for (std::size_t pos = 5; pos < tags.size(); ) {
+        auto end = std::min(tags.find('\n', pos), tags.size());
+        auto line = tags.substr(pos, end - pos);
+        pos = end + 1;
+        auto eq = line.find('=');
+        if (eq == line.npos || !line.starts_with("_lib"))
+            continue;
+        auto value = line.substr(eq + 1);
+        while (!value.empty() && (value.back() == '\r' || value.back() == ' '))
+            value.remove_suffix(1);
+        if (!value.empty())
+            libs.push_back(path.parent_path() / value);
+    }
+    return libs;
+}
+
+} // namespace
+
+std::vector<fs::path> sidecars(const fs::path &path)
+{
+    std::vector<fs::path> result;
+    if (auto m3u = fs::path(path).replace_extension("m3u"); m3u != path && archive::read_header(m3u, 0))
+        result.push_back(m3u);
+    std::vector<fs::path> libs = { path };
+    for (int depth = 0; depth < MAX_LIB_DEPTH && !libs.empty(); depth++) {
+        std::vector<fs::path> next;
+        for (auto &p : libs)
+            for (auto &lib : psf_libs(p))
+                if (std::find(result.begin(), result.end(), lib) == result.end() && lib != path) {
+                    result.push_back(lib);
+                    next.push_back(lib);
+                }
+        libs = std::move(next);
+    }
+    return result;
+}
+
+Prefetcher::Prefetcher()
+{
+    thread = std::jthread([this] (std::stop_token stop) { run(stop); });
+}
+
+Prefetcher::~Prefetcher()
+{
+    generation++;
+    thread.request_stop();
+}
+
+void Prefetcher::fetch(const void *owner, std::vector<fs::path> paths, u64 max_bytes)
+{
+    {
+        std::lock_guard lock(mutex);
+        std::erase_if(queue, [&](const Request &r) { return r.owner == owner; });
+        queue.push_back({ owner, std::move(paths), max_bytes });
+        if (serving == owner)
+            generation++;
+    }
+    cond.notify_one();
+}
+
+// Reads up to @max_bytes of @path, stopping early if another fetch came in.
+// Returns how much was read.
+u64 Prefetcher::read_ahead(const fs::path &path, u64 max_bytes, u64 gen)
+{
+    auto file = io::File::open(path, io::Access::Read);
+    if (!file)
+        return 0;
+    auto *fp = file.value().data();
+#ifdef PLATFORM_LINUX
+    // lets the kernel read ahead in bigger requests than the reads below
+    posix_fadvise(fileno(fp), 0, off_t(max_bytes), POSIX_FADV_WILLNEED);
+#endif
+    static thread_local std::array<char, CHUNK_SIZE> buf;
+    u64 total = 0;
+    while (total < max_bytes && generation.load(std::memory_order_relaxed) == gen) {
+        auto n = std::fread(buf.data(), 1, std::min<u64>(buf.size(), max_bytes - total), fp);
+        total += n;
+        if (n == 0)
+            break;
+    }
+    return total;
+}
+
+void Prefetcher::run(std::stop_token stop)
+{
+    while (!stop.stop_requested()) {
+        std::vector<fs::path> paths;
+        u64 left, gen;
+        {
+            std::unique_lock lock(mutex);
+            serving = nullptr;
+            if (!cond.wait(lock, stop, [&] { return !queue.empty(); }))
+                return;
+            auto req = std::move(queue.front());
+            queue.erase(queue.begin());
+            serving = req.owner;
+            paths   = std::move(req.paths);
+            left    = req.budget;
+            gen     = generation.load();
+        }
+        for (auto &path : paths) {
+            auto deps = sidecars(path);
+            deps.insert(deps.begin(), path);
+            for (auto &p : deps) {
+                if (left == 0 || generation.load(std::memory_order_relaxed) != gen)
+                    break;
+                if (std::find(recent.begin(), recent.end(), p) != recent.end())
+                    continue;
+                // a member is read along with its whole archive, then
+                // decompressed into the cache
+                auto parts = archive::split(p);
+                auto n = read_ahead(parts ? parts->first : p, left, gen);
+                if (parts && n < left)
+                    archive::open(p);
+                // only what was read whole counts, a part is read again
+                if (n < left && generation.load(std::memory_order_relaxed) == gen) {
+                    recent.push_back(p);
+                    if (recent.size() > MAX_RECENT)
+                        recent.erase(recent.begin());
+                }
+                left -= n;
+            }
+        }
+    }
+}
+
+} // namespace prefetch
@@ -0,0 +1,62 @@
+/*
+ * Reading files ahead of time, so that they're already in the page cache by
+ * the time they're loaded.
+ *
+ * Loading a file touches all of it at once, while the audio lock is held: on
+ * slow or network storage, that's where playback stalls. A Prefetcher reads
+ * the files that are going to be played next on a thread of its own, along
+ * with whatever they need to be loaded: the .m3u next to a GME file and the
+ * libraries (.gsflib) a GSF file refers to.
+ *
+ * @fetch: replaces whatever was still to be read for @owner with @paths, in
+ *         order. At most @budget bytes are read in total, files past that
+ *         are only read in part or not at all. Files read recently are
+ *         skipped. Requests of different owners (e.g. the sessions sharing
+ *         an engine, see engine.hpp) are served in turn;
+ * @sidecars: the files @path needs in order to be loaded, as far as they
+ *            exist;
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "common.hpp"
+
+namespace prefetch {
+
+class Prefetcher {
+    std::mutex mutex;
+    std::condition_variable_any cond;
+    struct Request {
+        const void *owner;
+        std::vector<std::filesystem::path> paths;
+        u64 budget;
+    };
+    std::vector<Request> queue;
+    // the owner whose request is being read
+    const void *serving = nullptr;
+    // bumped on every fetch() of the owner being served, which stops the
+    // work for its previous request
+    std::atomic<u64> generation = 0;
+    // only touched by the thread: the files read last, most recent last
+    std::vector<std::filesystem::path> recent;
+    std::jthread thread;
+
+    void run(std::stop_token stop);
+    u64 read_ahead(const std::filesystem::path &path, u64 budget, u64 gen);
+
+public:
+    Prefetcher();
+    ~Prefetcher();
+
+    void fetch(const void *owner, std::vector<std::filesystem::path> paths, u64 budget);
+};
+
+std::vector<std::filesystem::path> sidecars(const std::filesystem::path &path);
+
+} // namespace prefetch
@@ -1,7 +1,7 @@
 /*
  * This is a small random library. It offers a thread-safe generator portable
  * to any platform (I.E. generates the same sequences everywhere). It also
- * offers some helpful functions.
+ * offers some helpful functions and a lazily computed random permutation.
  */
 
 #pragma once
@@ -13,6 +13,7 @@
 #include <numeric>
 #include <random>
 #include <span>
+#include <utility>
 #include <vector>
 #include "common.hpp"
 
@@ -76,4 +77,89 @@ template <std::floating_point T = float> T between(T x, T y) { return std::unifo
 template <typename T> T pick(std::span<T> from)                    { return from        [between(0ul, from.size()-1)]; }
 template <typename T> T pick(const std::initializer_list<T> &from) { return from.begin()[between(0ul, from.size()-1)]; }
 
+/*
+ * A random permutation of the integers [0, n), computed on the fly in
+ * constant space and time, instead of being stored.
+ * A balanced Feistel network is a bijection over [0, 2^2k) for any round
+ * function; values falling outside [0, n) are fed back to the network until
+ * they don't (cycle walking), which restricts the bijection to [0, n). The
+ * domain is never bigger than 4n, so the walk is short.
+ *
+ * @map: returns the element at position @i of the permutation;
+ * @unmap: the inverse of map(), i.e. returns the position of element @x;
+ * @resize: changes the domain while keeping the same keys. Note that the
+ *          resulting permutation is a different one;
+ * @get_keys: returns the keys, which together with the size are all it takes
+ *            to build the same permutation again;
+ */
+class Permutation {
+    static constexpr int ROUNDS = 4;
+
+    u64 n = 0;
+    int half_bits = 1;
+    u64 mask = 1;
+    std::array<u64, ROUNDS> keys = {};
+
+    u64 round(u64 x, u64 key) const
+    {
+        x ^= key;
+        x *= 0xbf58476d1ce4e5b9ull;
+        x ^= x >> 31;
+        x *= 0x94d049bb133111ebull;
+        x ^= x >> 29;
+        return x & mask;
+    }
+
+    u64 encrypt(u64 x) const
+    {
+        u64 l = x >> half_bits, r = x & mask;
+        for (auto k : keys)
+            l = std::exchange(r, l ^ round(r, k));
+        return l << half_bits | r;
+    }
+
+    u64 decrypt(u64 x) const
+    {
+        u64 l = x >> half_bits, r = x & mask;
+        for (auto i = ROUNDS; i-- > 0; )
+            r = std::exchange(l, r ^ round(l, keys[i]));
+        return l << half_bits | r;
+    }
+
+public:
+    using Keys = std::array<u64, ROUNDS>;
+
+    Permutation() = default;
+    Permutation(u64 size, Generator &gen)
+    {
+        for (auto &k : keys)
+            k = gen();
+        resize(size);
+    }
+
+    Permutation(u64 size, const Keys &keys) : keys{keys} { resize(size); }
+
+    void resize(u64 size)
+    {
+        n = size;
+        half_bits = std::max(1, int(std::bit_width(n > 0 ? n - 1 : 0) + 1) / 2);
+        mask = (u64(1) << half_bits) - 1;
+    }
+
+    u64 map(u64 i) const
+    {
+        do i = encrypt(i); while (i >= n);
+        return i;
+    }
+
+    u64 unmap(u64 x) const
+    {
+        do x = decrypt(x); while (x >= n);
+        return x;
+    }
+
+    u64 size() const { return n; }
+    const Keys &get_keys() const { return keys; }
+};
+
 } // namespace random
@@ -0,0 +1,270 @@
+#include "scan.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstring>
+#include "archive.hpp"
+#include "hash.hpp"
+#include "parallel.hpp"
+#include "gme/gme.h"
+
+namespace fs = std::filesystem;
+
+namespace scan {
+
+namespace {
+
+bool is_gsf_library(const fs::path &path)
+{
+    auto ext = path.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+    return ext == ".gsflib";
+}
+
+} // namespace
+
+Kind classify(std::span<const u8> header)
+{
+    if (header.size() < 4)
+        return Kind::None;
+    // PSF container, version 0x22 is the GBA
+    if (std::memcmp(header.data(), "PSF\x22", 4) == 0)
+        return Kind::GSF;
+    std::array<u8, HEADER_SIZE> buf = {};
+    std::copy_n(header.begin(), std::min(header.size(), buf.size()), buf.begin());
+    return std::strcmp(gme_identify_header(buf.data()), "") != 0 ? Kind::GME : Kind::None;
+}
+
+Kind classify_file(const fs::path &path)
+{
+    if (is_gsf_library(path))
+        return Kind::None;
+    auto header = archive::read_header(path, HEADER_SIZE);
+    return header ? classify(header.value()) : Kind::None;
+}
+
+DirectoryScan::DirectoryScan(std::span<const fs::path> paths, unsigned num_threads)
+{
+    num_threads = num_threads == 0 ? parallel::num_threads() : num_threads;
+    for (auto i = 0u; i < num_threads; i++)
+        queues.push_back(std::make_unique<Queue>());
+    add(paths);
+}
+
+void DirectoryScan::add(std::span<const fs::path> paths)
+{
+    std::vector<Job> jobs;
+    Job picked;
+    for (const auto &p : paths) {
+        std::error_code ec;
+        if (fs::is_directory(p, ec) || (archive::is_archive(p) && fs::is_regular_file(p, ec)))
+            jobs.push_back({ .dir = p });
+        else
+            picked.files.push_back(p);
+    }
+    if (!picked.files.empty())
+        jobs.push_back(std::move(picked));
+    if (jobs.empty())
+        return;
+    if (!threads.empty() && threads[0].get_stop_token().stop_requested()) {
+        threads.clear();
+        for (auto &q : queues)
+            q->jobs.clear();
+        pending = 0;
+        queued  = 0;
+    }
+    bool restart;
+    {
+        std::lock_guard lock(idle_mutex);
+        pending.fetch_add(jobs.size());
+        for (auto i = 0u; i < jobs.size(); i++) {
+            auto &q = *queues[i % queues.size()];
+            std::lock_guard queue_lock(q.mutex);
+            q.jobs.push_back(std::move(jobs[i]));
+        }
+        queued.fetch_add(jobs.size());
+        restart = running == 0;
+        if (restart)
+            running = queues.size();
+    }
+    if (!restart) {
+        work_ready.notify_all();
+        return;
+    }
+    // the old threads have all quit, there's only joining them left
+    threads.clear();
+    for (auto i = 0u; i < queues.size(); i++)
+        threads.emplace_back([this, i] (std::stop_token stop) { run(stop, i); });
+}
+
+DirectoryScan::~DirectoryScan()
+{
+    cancel();
+}
+
+Found DirectoryScan::take()
+{
+    std::lock_guard lock(found_mutex);
+    return std::exchange(found, {});
+}
+
+void DirectoryScan::cancel()
+{
+    for (auto &t : threads)
+        t.request_stop();
+}
+
+Progress DirectoryScan::progress() const
+{
+    return {
+        .dirs  = counters.dirs .load(std::memory_order_relaxed),
+        .files = counters.files.load(std::memory_order_relaxed),
+        .found = counters.found.load(std::memory_order_relaxed),
+    };
+}
+
+// Takes from the back of our own queue, or else steals from the front of
+// someone else's.
+bool DirectoryScan::next_job(std::size_t self, Job &job)
+{
+    for (auto i = 0u; i < queues.size(); i++) {
+        auto &q = *queues[(self + i) % queues.size()];
+        std::lock_guard lock(q.mutex);
+        if (q.jobs.empty())
+            continue;
+        if (i == 0) {
+            job = std::move(q.jobs.back());
+            q.jobs.pop_back();
+        } else {
+            job = std::move(q.jobs.front());
+            q.jobs.pop_front();
+        }
+        return true;
+    }
+    return false;
+}
+
+// Going through the mutex makes sure that a thread about to wait either sees
+// what changed or is already waiting when notified. The counters are updated
+// before @idle is read, while waiters do the opposite, so one can't miss the
+// other.
+void DirectoryScan::wake_idle()
+{
+    if (idle.load() == 0)
+        return;
+    { std::lock_guard lock(idle_mutex); }
+    work_ready.notify_all();
+}
+
+void DirectoryScan::run(std::stop_token stop, std::size_t self)
+{
+    Job job;
+    for (;;) {
+        if (!stop.stop_requested() && next_job(self, job)) {
+            queued.fetch_sub(1);
+            if (!job.files.empty())
+                scan_files(std::move(job.files), stop);
+            else {
+                scan_dir(job.dir, self, stop);
+                counters.dirs.fetch_add(1, std::memory_order_relaxed);
+            }
+            if (pending.fetch_sub(1) == 1)
+                wake_idle();
+            continue;
+        }
+        // someone still scanning may find more
+        std::unique_lock lock(idle_mutex);
+        idle.fetch_add(1);
+        work_ready.wait(lock, stop, [&] { return queued.load() > 0 || pending.load() == 0; });
+        idle.fetch_sub(1);
+        if (stop.stop_requested() || pending.load() == 0) {
+            running.fetch_sub(1, std::memory_order_release);
+            return;
+        }
+    }
+}
+
+// Archives are looked into as if they were directories, although only their
+// index and the first bytes of each member are read.
+void DirectoryScan::scan_archive(const fs::path &path, std::vector<fs::path> &files)
+{
+    auto members = archive::list(path, HEADER_SIZE);
+    if (!members)
+        return;
+    counters.files.fetch_add(members.value().size(), std::memory_order_relaxed);
+    for (auto &m : members.value())
+        if (!is_gsf_library(m.path) && classify(m.header) != Kind::None)
+            files.push_back(std::move(m.path));
+}
+
+void DirectoryScan::scan_dir(const fs::path &dir, std::size_t self, std::stop_token stop)
+{
+    std::vector<fs::path> files, subdirs;
+    std::error_code ec, entry_ec;
+    // one of the directories the scan started from
+    if (archive::is_archive(dir) && fs::is_regular_file(dir, ec))
+        scan_archive(dir, files);
+    for (auto it = fs::directory_iterator(dir, fs::directory_options::skip_permission_denied, ec);
+         !ec && it != fs::directory_iterator(); it.increment(ec)) {
+        if (stop.stop_requested())
+            return;
+        // symlinked directories aren't followed, as they may lead to loops
+        if (it->is_directory(entry_ec) && !it->is_symlink(entry_ec))
+            subdirs.push_back(it->path());
+        else if (it->is_regular_file(entry_ec) && archive::is_archive(it->path()))
+            scan_archive(it->path(), files);
+        else if (it->is_regular_file(entry_ec)) {
+            counters.files.fetch_add(1, std::memory_order_relaxed);
+            if (classify_file(it->path()) != Kind::None)
+                files.push_back(it->path());
+        }
+    }
+
+    if (!subdirs.empty()) {
+        // in reverse, as the back of the queue is taken first: this keeps
+        // the files found in order of name when there's a single thread
+        std::sort(subdirs.begin(), subdirs.end(), std::greater{});
+        pending.fetch_add(subdirs.size());
+        {
+            std::lock_guard lock(queues[self]->mutex);
+            for (auto &d : subdirs)
+                queues[self]->jobs.push_back({ .dir = std::move(d) });
+        }
+        queued.fetch_add(subdirs.size());
+        wake_idle();
+    }
+
+    std::sort(files.begin(), files.end());
+    hand_out(std::move(files), stop);
+}
+
+// Files given by name aren't classified: they're handed out as they are, so
+// that the owner opening them reports those it can't open (and headerless
+// formats aren't left out).
+void DirectoryScan::scan_files(std::vector<fs::path> files, std::stop_token stop)
+{
+    counters.files.fetch_add(files.size(), std::memory_order_relaxed);
+    hand_out(std::move(files), stop);
+}
+
+// Hashes the music files found and makes them available to take(), in the
+// same order.
+void DirectoryScan::hand_out(std::vector<fs::path> files, std::stop_token stop)
+{
+    if (files.empty())
+        return;
+    std::vector<u64> hashes;
+    hashes.reserve(files.size());
+    for (const auto &f : files) {
+        if (stop.stop_requested())
+            return;
+        hashes.push_back(hash::file(f));
+    }
+    counters.found.fetch_add(files.size(), std::memory_order_relaxed);
+    std::lock_guard lock(found_mutex);
+    found.paths.insert(found.paths.end(), std::make_move_iterator(files.begin()), std::make_move_iterator(files.end()));
+    found.hashes.insert(found.hashes.end(), hashes.begin(), hashes.end());
+}
+
+} // namespace scan
@@ -0,0 +1,134 @@
+/*
+ * Walking directories for music files.
+ *
+ * Directories are scanned by a pool of threads, each with its own queue of
+ * directories to visit: a thread pushes the subdirectories it finds on its
+ * own queue and takes from its back, while idle threads steal from the front
+ * of the others' queues, which is where the biggest subtrees usually are.
+ * Files are recognized by their first bytes, read without mapping the whole
+ * file. Archives are looked into like directories, and compressed files are
+ * recognized by what they decompress to (see archive.hpp). Each directory's
+ * files (including those of its archives) are handed out sorted by name, as
+ * soon as that directory is done. The order in which directories are handed
+ * out is whatever order they are finished in.
+ * Every music file found is also hashed (see hash.hpp) by the thread that
+ * found it, so that importing files doesn't have to read them again.
+ * Files can be given along with directories: those are hashed by one of the
+ * threads and handed out together in the order they were given in, without
+ * being classified, so that whoever opens them can tell which ones it can't.
+ * Threads with nothing to take sleep until either someone queues more
+ * directories or the last directory being scanned is done, at which point
+ * they all quit.
+ *
+ * @classify: tells what kind of music file a header belongs to. Only the
+ *            first HEADER_SIZE bytes are looked at;
+ * @classify_file: same as above, reading the header of a file. GSF libraries
+ *                 (.gsflib) aren't playable by themselves and are left out;
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stop_token>
+#include <thread>
+#include <vector>
+#include "common.hpp"
+
+namespace scan {
+
+inline constexpr std::size_t HEADER_SIZE = 16;
+
+enum class Kind { None, GME, GSF };
+
+Kind classify(std::span<const u8> header);
+Kind classify_file(const std::filesystem::path &path);
+
+struct Progress {
+    u64 dirs  = 0;  // directories scanned
+    u64 files = 0;  // files looked at
+    u64 found = 0;  // of which music files
+
+    friend bool operator==(const Progress &, const Progress &) = default;
+};
+
+// Files found, along with the hash of each.
+struct Found {
+    std::vector<std::filesystem::path> paths;
+    std::vector<u64> hashes;
+
+    bool empty() const { return paths.empty(); }
+};
+
+/*
+ * A scan of one or more directories, running in the background from creation
+ * until it's done or cancelled. Destroying it cancels it.
+ *
+ * @add: queues more directories (or files), which are scanned by the running
+ *       threads, or by new ones if they had all quit. Adding to a cancelled
+ *       scan drops whatever it had left before starting over. Files found
+ *       before are kept, and so is the progress;
+ * @take: returns the files found since the last call. Can be called from any
+ *        thread, although it's meant for a single consumer;
+ * @cancel: stops the scan as soon as possible. Files found up to then can
+ *          still be taken;
+ * @done: whether all threads have stopped. Once this is true, a last call to
+ *        take() gets every remaining file (until add() is called again);
+ * add() and cancel() are meant to be called by the scan's owner alone.
+ */
+class DirectoryScan {
+    // a directory to walk, or else files given one by one
+    struct Job {
+        std::filesystem::path dir;
+        std::vector<std::filesystem::path> files;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    // jobs queued or being done: the scan is over once it's zero
+    std::atomic<u64> pending = 0;
+    // jobs sitting in a queue. Only counted once they're in, so it
+    // can go below zero for a moment when one is taken right away
+    std::atomic<i64> queued = 0;
+    // threads waiting for work, and the threads that haven't quit. Both
+    // change under idle_mutex, so that quitting can't miss an add()
+    std::atomic<unsigned> idle = 0;
+    std::atomic<unsigned> running = 0;
+    std::mutex idle_mutex;
+    std::condition_variable_any work_ready;
+    struct {
+        std::atomic<u64> dirs = 0, files = 0, found = 0;
+    } counters;
+    std::mutex found_mutex;
+    Found found;
+    std::vector<std::jthread> threads;
+
+    void run(std::stop_token stop, std::size_t self);
+    void wake_idle();
+    bool next_job(std::size_t self, Job &job);
+    void scan_dir(const std::filesystem::path &dir, std::size_t self, std::stop_token stop);
+    void scan_files(std::vector<std::filesystem::path> files, std::stop_token stop);
+    void hand_out(std::vector<std::filesystem::path> files, std::stop_token stop);
+    void scan_archive(const std::filesystem::path &path, std::vector<std::filesystem::path> &files);
+
+public:
+    explicit DirectoryScan(std::span<const std::filesystem::path> paths, unsigned num_threads = 0);
+    ~DirectoryScan();
+
+    void add(std::span<const std::filesystem::path> paths);
+    Found take();
+    void cancel();
+    bool done() const { return running.load(std::memory_order_acquire) == 0; }
+    Progress progress() const;
+};
+
+} // namespace scan
@@ -0,0 +1,146 @@
+#include "search.hpp"
+
+#include <algorithm>
+#include <string>
+
+namespace search {
+
+namespace {
+
+char fold(char c) { return c >= 'A' && c <= 'Z' ? char(c - 'A' + 'a') : c; }
+
+u32 trigram(const char *p)
+{
+    return u32(u8(fold(p[0]))) << 16
+         | u32(u8(fold(p[1]))) << 8
+         | u32(u8(fold(p[2])));
+}
+
+void for_each_trigram(std::string_view s, auto &&fn)
+{
+    for (std::size_t i = 0; i + 3 <= s.size(); i++)
+        fn(trigram(s.data() + i));
+}
+
+// `needle` must be already folded
+bool contains_folded(std::string_view haystack, std::string_view needle)
+{
+    return std::search(haystack.begin(), haystack.end(), needle.begin(), needle.end(),
+                       [](char a, char b) { return fold(a) == b; }) != haystack.end();
+}
+
+} // namespace
+
+void Index::insert_postings(u32 id)
+{
+    for (auto field : docs[id]) {
+        for_each_trigram(field.view(), [&](u32 t) {
+            auto &list = postings[t];
+            if (list.empty() || list.back() < id)
+                list.push_back(id);
+            else if (auto it = std::lower_bound(list.begin(), list.end(), id); *it != id)
+                list.insert(it, id);
+        });
+    }
+}
+
+// stale entries only cost time when searching, so clean them when they're
+// more than the live ones.
+void Index::maybe_compact()
+{
+    if (stale < 1024 || stale < live)
+        return;
+    postings.clear();
+    stale = 0;
+    for (u32 id = 0; id < docs.size(); id++)
+        if (alive[id])
+            insert_postings(id);
+}
+
+bool Index::matches(u32 id, std::string_view folded_query) const
+{
+    return alive[id] && std::any_of(docs[id].begin(), docs[id].end(), [&](intern::String field) {
+        return contains_folded(field.view(), folded_query);
+    });
+}
+
+void Index::add(u32 id, std::span<const intern::String> fields)
+{
+    if (id >= docs.size()) {
+        docs.resize(id + 1);
+        alive.resize(id + 1);
+    }
+    if (alive[id])
+        stale++;
+    else
+        live++;
+    docs[id] = {};
+    std::copy_n(fields.begin(), std::min(fields.size(), MAX_FIELDS), docs[id].begin());
+    alive[id] = true;
+    insert_postings(id);
+    maybe_compact();
+}
+
+void Index::remove(u32 id)
+{
+    if (id >= docs.size() || !alive[id])
+        return;
+    alive[id] = false;
+    docs[id] = {};
+    live--;
+    stale++;
+    maybe_compact();
+}
+
+void Index::clear()
+{
+    postings.clear();
+    docs.clear();
+    alive.clear();
+    live = stale = 0;
+}
+
+std::vector<u32> Index::find(std::string_view query) const
+{
+    std::string q;
+    std::transform(query.begin(), query.end(), std::back_inserter(q), fold);
+    std::vector<u32> result;
+
+    if (q.size() < 3) {
+        for (u32 id = 0; id < docs.size(); id++)
+            if (matches(id, q))
+                result.push_back(id);
+        return result;
+    }
+
+    std::vector<const std::vector<u32> *> lists;
+    bool missing = false;
+    for_each_trigram(q, [&](u32 t) {
+        auto it = postings.find(t);
+        if (it == postings.end())
+            missing = true;
+        else
+            lists.push_back(&it->second);
+    });
+    if (missing)
+        return result;
+    std::sort(lists.begin(), lists.end());
+    lists.erase(std::unique(lists.begin(), lists.end()), lists.end());
+    std::sort(lists.begin(), lists.end(), [](auto *a, auto *b) { return a->size() < b->size(); });
+
+    std::vector<u32> candidates = *lists[0], tmp;
+    for (auto i = 1u; i < lists.size() && !candidates.empty(); i++) {
+        tmp.clear();
+        std::set_intersection(candidates.begin(), candidates.end(),
+                              lists[i]->begin(), lists[i]->end(),
+                              std::back_inserter(tmp));
+        std::swap(candidates, tmp);
+    }
+
+    for (auto id : candidates)
+        if (matches(id, q))
+            result.push_back(id);
+    return result;
+}
+
+} // namespace search
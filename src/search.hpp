@@ -0,0 +1,60 @@
+/*
+ * This is a small library for substring searches over a collection of
+ * documents. A document is identified by an integer id and is made of a few
+ * interned strings (fields). Searches are case insensitive (for ASCII
+ * characters only).
+ *
+ * The index is a trigram index: for every sequence of three characters found
+ * in a document, it keeps a sorted list of the documents containing it. A
+ * query is answered by intersecting the lists of the query's trigrams and
+ * then checking the (few) remaining candidates. Queries shorter than three
+ * characters fall back to checking every document.
+ *
+ * Documents can be added, replaced and removed at any time. Removing a
+ * document doesn't touch the lists; they are instead cleaned once enough
+ * stale entries are accumulated.
+ */
+
+#pragma once
+
+#include <array>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "common.hpp"
+#include "intern.hpp"
+
+namespace search {
+
+inline constexpr std::size_t MAX_FIELDS = 8;
+
+/*
+ * @add: adds a document, or replaces it if it already exists. Fields after
+ *       MAX_FIELDS are ignored;
+ * @remove: removes a document;
+ * @find: returns the ids of all documents which contain the query in any of
+ *        their fields, in ascending order. An empty query matches every
+ *        document;
+ */
+class Index {
+    using Fields = std::array<intern::String, MAX_FIELDS>;
+
+    std::unordered_map<u32, std::vector<u32>> postings;
+    std::vector<Fields> docs;
+    std::vector<bool> alive;
+    std::size_t live = 0, stale = 0;
+
+    void insert_postings(u32 id);
+    void maybe_compact();
+    bool matches(u32 id, std::string_view folded_query) const;
+
+public:
+    void add(u32 id, std::span<const intern::String> fields);
+    void remove(u32 id);
+    void clear();
+    std::vector<u32> find(std::string_view query) const;
+    std::size_t size() const { return live; }
+};
+
+} // namespace search
@@ -0,0 +1,58 @@
+/*
+ * A sequence lock: one writer at a time publishes a value, while any number of
+ * readers take consistent copies of it without ever waiting on the writer or
+ * making it wait. A reader that overlaps with a write simply tries again.
+ * The value is stored as relaxed atomic words, so that racing reads are not
+ * undefined behavior; it must therefore be trivially copyable and small.
+ *
+ * @store: publishes @value. Writers must be serialized by the caller;
+ * @load: returns a copy of the last published value;
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <type_traits>
+#include "common.hpp"
+
+template <typename T>
+class SeqLock {
+    static_assert(std::is_trivially_copyable_v<T>);
+    static constexpr std::size_t WORDS = (sizeof(T) + sizeof(u64) - 1) / sizeof(u64);
+
+    std::atomic<u64> seq = 0;
+    std::array<std::atomic<u64>, WORDS> data = {};
+
+public:
+    explicit SeqLock(const T &value = T{}) { store(value); }
+
+    void store(const T &value)
+    {
+        std::array<u64, WORDS> words = {};
+        std::memcpy(words.data(), &value, sizeof(T));
+        auto s = seq.load(std::memory_order_relaxed);
+        seq.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (auto i = 0u; i < WORDS; i++)
+            data[i].store(words[i], std::memory_order_relaxed);
+        seq.store(s + 2, std::memory_order_release);
+    }
+
+    T load() const
+    {
+        std::array<u64, WORDS> words;
+        u64 before, after;
+        do {
+            before = seq.load(std::memory_order_acquire);
+            for (auto i = 0u; i < WORDS; i++)
+                words[i] = data[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = seq.load(std::memory_order_relaxed);
+        } while (before != after || (before & 1));
+        T value;
+        std::memcpy(&value, words.data(), sizeof(T));
+        return value;
+    }
+};
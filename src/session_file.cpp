@@ -0,0 +1,186 @@
+#include "session_file.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <span>
+#include "io.hpp"
+#include "const.hpp"
+
+namespace fs = std::filesystem;
+
+namespace gmplayer {
+
+namespace {
+
+constexpr std::array<char, 4> MAGIC = { 'G', 'M', 'P', 'S' };
+constexpr u32 VERSION = 2;
+
+struct PlaylistHeader {
+    i32 size;
+    i32 current;
+    u32 order_count;
+    u32 shuffled;
+    rng::Permutation::Keys keys;
+};
+
+// followed by: u64 ends[dir_count + file_count], u64 hashes[file_count],
+// u32 file_dirs[file_count], i32 files order[], i32 tracks order[],
+// char strings[strings_size]
+struct Header {
+    std::array<char, 4> magic;
+    u32 version;
+    u32 dir_count;
+    u32 file_count;
+    u64 strings_size;
+    PlaylistHeader files;
+    PlaylistHeader tracks;
+    i32 position;
+    u32 reserved;
+};
+
+PlaylistHeader make_header(const SavedPlaylist &p)
+{
+    return {
+        .size        = p.size,
+        .current     = p.current,
+        .order_count = u32(p.order.size()),
+        .shuffled    = p.shuffle.has_value(),
+        .keys        = p.shuffle.value_or(rng::Permutation::Keys{}),
+    };
+}
+
+// A playlist over @ids ids: a stored order has to cover the whole playlist
+// and only refer to existing ids, while an identity can't be bigger than that.
+// Track playlists are checked against their file once it's loaded.
+bool is_valid(const PlaylistHeader &h, std::span<const int> order, std::size_t ids)
+{
+    return h.size >= 0 && h.current >= -1 && h.current < h.size
+        && (order.empty() ? std::size_t(h.size) <= ids : order.size() == std::size_t(h.size))
+        && std::all_of(order.begin(), order.end(), [&](int id) { return id >= 0 && std::size_t(id) < ids; });
+}
+
+// Reads consecutive arrays out of a buffer, failing once it runs out.
+class Reader {
+    std::span<const u8> data;
+    bool failed = false;
+
+public:
+    explicit Reader(std::span<const u8> data) : data{data} {}
+
+    template <typename T>
+    void read(T *out, std::size_t count)
+    {
+        if (failed || data.size() < count * sizeof(T)) {
+            failed = true;
+            return;
+        }
+        std::memcpy(out, data.data(), count * sizeof(T));
+        data = data.subspan(count * sizeof(T));
+    }
+
+    template <typename T>
+    std::vector<T> read(std::size_t count)
+    {
+        std::vector<T> v(failed || data.size() < count * sizeof(T) ? 0 : count);
+        read(v.data(), count);
+        return v;
+    }
+
+    std::size_t remaining() const { return data.size(); }
+    bool has_failed() const { return failed; }
+    // whether everything was read, with nothing left over
+    bool done() const { return !failed && data.empty(); }
+};
+
+SavedPlaylist make_playlist(const PlaylistHeader &h, std::vector<int> order)
+{
+    return {
+        .order   = std::move(order),
+        .size    = h.size,
+        .current = h.current,
+        .shuffle = h.shuffled ? std::optional{h.keys} : std::nullopt,
+    };
+}
+
+} // namespace
+
+fs::path session_path()
+{
+    return io::directory::data() / APP_NAME / "session";
+}
+
+std::error_code write_session(const fs::path &path, const SavedSession &session)
+{
+    std::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+    auto tmp = fs::path(path).concat(".tmp");
+    auto file = io::File::open(tmp, io::Access::Write);
+    if (!file)
+        return file.error();
+    auto header = Header {
+        .magic        = MAGIC,
+        .version      = VERSION,
+        .dir_count    = session.dir_count,
+        .file_count   = u32(session.file_count()),
+        .strings_size = session.strings.size(),
+        .files        = make_header(session.files),
+        .tracks       = make_header(session.tracks),
+        .position     = session.position,
+        .reserved     = 0,
+    };
+    auto write = [&](const auto *p, std::size_t count) {
+        return count == 0 || std::fwrite(p, sizeof(*p), count, file.value().data()) == count;
+    };
+    auto ok = write(&header, 1)
+           && write(session.ends.data(),         session.ends.size())
+           && write(session.hashes.data(),       session.hashes.size())
+           && write(session.file_dirs.data(),    session.file_dirs.size())
+           && write(session.files.order.data(),  session.files.order.size())
+           && write(session.tracks.order.data(), session.tracks.order.size())
+           && write(session.strings.data(),      session.strings.size());
+    if (file.value().close() != 0 || !ok) {
+        fs::remove(tmp, ec);
+        return std::make_error_code(std::errc::io_error);
+    }
+    fs::rename(tmp, path, ec);
+    return ec;
+}
+
+tl::expected<SavedSession, std::error_code> read_session(const fs::path &path)
+{
+    auto file = io::MappedFile::open(path, io::Access::Read);
+    if (!file)
+        return tl::unexpected(file.error());
+    auto invalid = tl::unexpected(std::make_error_code(std::errc::illegal_byte_sequence));
+
+    Reader reader(file.value().bytes());
+    Header header;
+    reader.read(&header, 1);
+    if (reader.has_failed() || header.magic != MAGIC || header.version != VERSION)
+        return invalid;
+
+    SavedSession session;
+    session.dir_count = header.dir_count;
+    session.ends      = reader.read<u64>(u64(header.dir_count) + header.file_count);
+    session.hashes    = reader.read<u64>(header.file_count);
+    session.file_dirs = reader.read<u32>(header.file_count);
+    auto files_order  = reader.read<int>(header.files.order_count);
+    auto tracks_order = reader.read<int>(header.tracks.order_count);
+    session.strings.resize(std::min<u64>(header.strings_size, reader.remaining()));
+    reader.read(session.strings.data(), header.strings_size);
+    if (!reader.done()
+     || !std::is_sorted(session.ends.begin(), session.ends.end())
+     || (session.ends.empty() ? 0 : session.ends.back()) != header.strings_size
+     || std::any_of(session.file_dirs.begin(), session.file_dirs.end(), [&](u32 d) { return d >= header.dir_count; })
+     || !is_valid(header.files, files_order, header.file_count)
+     || !is_valid(header.tracks, tracks_order, std::max<std::size_t>(header.tracks.size, tracks_order.size())))
+        return invalid;
+    session.files    = make_playlist(header.files,  std::move(files_order));
+    session.tracks   = make_playlist(header.tracks, std::move(tracks_order));
+    session.position = header.position;
+    return session;
+}
+
+} // namespace gmplayer
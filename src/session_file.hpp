@@ -0,0 +1,68 @@
+/*
+ * Saved sessions, i.e. everything needed to come back where the user left:
+ * the file list, both playlists and the position within the current track.
+ *
+ * A session is stored as a fixed header followed by flat arrays, so that
+ * reading it back is mapping the file once and copying each array out of it
+ * in one go, without parsing anything. Numbers are stored in native byte
+ * order, as a session is only ever read back by the machine that wrote it.
+ * Files that weren't written by this same version of the format are refused.
+ *
+ * @SavedPlaylist: a playlist's stored order (empty if it's the identity), its
+ *                 size, current position and shuffle keys, if shuffled;
+ * @SavedSession: the file list is a table of directories, then the index of
+ *                each file's directory along with its name and hash;
+ * @session_path: where frontends keep their session;
+ * @write_session: writes a session, replacing the old one only once it's
+ *                 entirely written;
+ * @read_session: reads a session, checking that everything in it is in range;
+ */
+
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+#include <tl/expected.hpp>
+#include "common.hpp"
+#include "random.hpp"
+
+namespace gmplayer {
+
+struct SavedPlaylist {
+    std::vector<int> order;
+    int size    = 0;
+    int current = -1;
+    std::optional<rng::Permutation::Keys> shuffle;
+};
+
+struct SavedSession {
+    // every directory, followed by every file name
+    std::string strings;
+    std::vector<u64> ends;
+    u32 dir_count = 0;
+    std::vector<u32> file_dirs;
+    std::vector<u64> hashes;
+    SavedPlaylist files;
+    SavedPlaylist tracks;
+    int position = 0; // in milliseconds
+
+    std::size_t file_count() const { return file_dirs.size(); }
+    std::string_view string(std::size_t i) const
+    {
+        auto start = i == 0 ? 0 : ends[i-1];
+        return std::string_view(strings).substr(start, ends[i] - start);
+    }
+    std::string_view dir(std::size_t i)  const { return string(i); }
+    std::string_view name(std::size_t i) const { return string(dir_count + i); }
+    void add_string(std::string_view s)        { strings += s; ends.push_back(strings.size()); }
+};
+
+std::filesystem::path session_path();
+std::error_code write_session(const std::filesystem::path &path, const SavedSession &session);
+tl::expected<SavedSession, std::error_code> read_session(const std::filesystem::path &path);
+
+} // namespace gmplayer
@@ -0,0 +1,50 @@
+/*
+ * A lock-free triple buffer, for handing data from one producer thread to one
+ * consumer thread without either of them ever waiting for the other.
+ *
+ * There are three slots: the producer owns one (the back buffer), the
+ * consumer owns one (the front buffer), and the third one sits in the middle.
+ * Publishing swaps the back buffer with the middle one; reading swaps the
+ * front buffer with the middle one, but only if something new was published.
+ * Nothing is ever copied: the producer writes directly into its slot.
+ *
+ * @write: returns the back buffer. Only the producer may call this;
+ * @publish: makes the back buffer available to the consumer;
+ * @read: swaps in the latest published buffer, if any, and returns it (or
+ *        nullptr if nothing new was published since the last call). The
+ *        returned buffer stays valid until the next call. Only the consumer
+ *        may call this;
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include "common.hpp"
+
+template <typename T>
+class TripleBuffer {
+    static constexpr u8 INDEX_MASK = 0x3;
+    static constexpr u8 FRESH      = 0x4;
+
+    std::array<T, 3> slots = {};
+    u8 back = 0;
+    std::atomic<u8> middle = 1;
+    u8 front = 2;
+
+public:
+    T &write() { return slots[back]; }
+
+    void publish()
+    {
+        back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX_MASK;
+    }
+
+    const T *read()
+    {
+        if (!(middle.load(std::memory_order_relaxed) & FRESH))
+            return nullptr;
+        front = middle.exchange(front, std::memory_order_acq_rel) & INDEX_MASK;
+        return &slots[front];
+    }
+};
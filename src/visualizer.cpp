@@ -1,82 +1,183 @@
 #include "visualizer.hpp"
 
+#include <algorithm>
+#include <QCheckBox>
+#include <QPainter>
+#include <QScreen>
+#include <QTimer>
 #include <QVBoxLayout>
 #include "qtutils.hpp"
 #include "player.hpp"
 #include "const.hpp"
 #include "math.hpp"
+#include "fft.hpp"
 
 namespace gui {
 
 template <typename T>
-auto get_minmax()
+constexpr f32 sample_scale()
 {
-    if constexpr(std::is_same_v<T, i16>) return std::pair { std::numeric_limits<i16>::min(), std::numeric_limits<i16>::max() };
-    if constexpr(std::is_same_v<T, f32>) return std::pair { -1.f, 1.f };
+    if constexpr(std::is_same_v<T, i16>) return 1.f / 32768.f;
+    if constexpr(std::is_same_v<T, f32>) return 1.f;
 }
 
+// Returns the sample of a voice at a frame, averaged over all channels and
+// normalized to [-1, 1]. When there's more than one voice, samples are stored
+// two frames at a time for each voice (see Player::render).
 template <typename T, i64 NUM_CHANNELS, i64 NUM_VOICES>
-void plot(std::span<T> data, i64 width, i64 height, i64 voice, auto &&draw)
+f32 sample_at(std::span<const T> data, i64 voice, i64 frame)
 {
-    auto [min, max] = get_minmax<T>();
-    auto m = [&](auto s) { return i64(math::map<T>(s, min, max, 0, height)); };
-    const auto FRAME_SIZE = NUM_VOICES * NUM_CHANNELS;
-    const auto num_frames = data.size() / FRAME_SIZE;
-    for (i64 f = 0; f < num_frames; f += 2) {
-        auto y0 = m(math::avg(data.subspan((f+0)*FRAME_SIZE + voice*NUM_CHANNELS*2 + 0, NUM_CHANNELS)));
-        auto y1 = m(math::avg(data.subspan((f+0)*FRAME_SIZE + voice*NUM_CHANNELS*2 + 2, NUM_CHANNELS)));
-        auto y2 = m(math::avg(data.subspan((f+2)*FRAME_SIZE + voice*NUM_CHANNELS*2 + 0, NUM_CHANNELS)));
-        draw(std::array{f+0, y0}, std::array{f+1, y1});
-        draw(std::array{f+1, y1}, std::array{f+2, y2});
-    }
+    auto base = NUM_VOICES == 1 ? frame * NUM_CHANNELS
+              : (frame & ~1) * NUM_VOICES * NUM_CHANNELS + voice * NUM_CHANNELS * 2 + (frame & 1) * NUM_CHANNELS;
+    f32 sum = 0;
+    for (i64 c = 0; c < NUM_CHANNELS; c++)
+        sum += f32(data[base + c]);
+    return sum / NUM_CHANNELS * sample_scale<T>();
 }
 
 template <typename T, i64 NUM_CHANNELS, i64 NUM_VOICES>
-Visualizer<T, NUM_CHANNELS, NUM_VOICES>::Visualizer(std::span<T> data, i64 voice, const QString &name, QWidget *parent)
-    : QGraphicsView(parent)
-    , scene{new QGraphicsScene(this)}
-    , data{data}
+Visualizer<T, NUM_CHANNELS, NUM_VOICES>::Visualizer(i64 voice, const QString &name, QWidget *parent)
+    : QWidget(parent)
     , voice{voice}
     , name{name}
 {
-    setScene(scene);
-    setHorizontalScrollBarPolicy(Qt::ScrollBarAlwaysOff);
-    setVerticalScrollBarPolicy(Qt::ScrollBarAlwaysOff);
-    render();
+    setAttribute(Qt::WA_OpaquePaintEvent);
+    setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Expanding);
+    setMinimumSize(64, 48);
 }
 
 template <typename T, i64 NUM_CHANNELS, i64 NUM_VOICES>
-void Visualizer<T, NUM_CHANNELS, NUM_VOICES>::render()
+void Visualizer<T, NUM_CHANNELS, NUM_VOICES>::resizeEvent(QResizeEvent *ev)
 {
-    auto size   = viewport()->size();
-    auto width  = size.width();
-    auto height = size.height();
-    QPixmap image{width, height};
-    image.fill({0, 0, 0});
-    QPainter painter{&image};
-    painter.setPen({0xff, 0xff, 0xff});
-    plot<T, NUM_CHANNELS, NUM_VOICES>(data, width, height, voice, [&] (auto p, auto q) {
-        painter.drawLine(QPoint(p[0], p[1]), QPoint(q[0], q[1]));
-    });
-    painter.drawText(8, height - 8, name);
-    scene->clear();
-    scene->addPixmap(image);
+    image = QImage(size(), QImage::Format_RGB32);
+    image.fill(Qt::black);
+    QWidget::resizeEvent(ev);
+}
+
+template <typename T, i64 NUM_CHANNELS, i64 NUM_VOICES>
+void Visualizer<T, NUM_CHANNELS, NUM_VOICES>::paintEvent(QPaintEvent *)
+{
+    QPainter painter{this};
+    painter.drawImage(0, 0, image);
+    painter.setPen(Qt::white);
+    painter.drawText(8, height() - 8, name);
+}
+
+template <typename T, i64 NUM_CHANNELS, i64 NUM_VOICES>
+void Visualizer<T, NUM_CHANNELS, NUM_VOICES>::render(std::span<const T> data)
+{
+    if (image.isNull())
+        return;
+    i64 width  = image.width();
+    i64 height = image.height();
+    i64 num_frames = data.size() / (NUM_CHANNELS * NUM_VOICES);
+    auto *bits  = reinterpret_cast<u32 *>(image.bits());
+    auto stride = image.bytesPerLine() / sizeof(u32);
+    auto to_y = [&](f32 s) { return std::clamp<i64>((1.f - s) * 0.5f * (height - 1), 0, height - 1); };
+
+    image.fill(Qt::black);
+    auto prev = sample_at<T, NUM_CHANNELS, NUM_VOICES>(data, voice, 0);
+    for (i64 x = 0; x < width; x++) {
+        auto first = x * num_frames / width;
+        auto last  = std::max(first + 1, (x + 1) * num_frames / width);
+        // starting from the last sample of the previous column keeps the
+        // columns connected
+        auto lo = prev, hi = prev;
+        for (auto f = first; f < last; f++) {
+            prev = sample_at<T, NUM_CHANNELS, NUM_VOICES>(data, voice, f);
+            lo = std::min(lo, prev);
+            hi = std::max(hi, prev);
+        }
+        for (auto y = to_y(hi), end = to_y(lo); y <= end; y++)
+            bits[y * stride + x] = 0xffffffff;
+    }
+    update();
+}
+
+// one bar per band, stretched over the whole width
+template <typename T, i64 NUM_CHANNELS, i64 NUM_VOICES>
+void Visualizer<T, NUM_CHANNELS, NUM_VOICES>::render_spectrum(std::span<const f32> bands)
+{
+    if (image.isNull() || bands.empty())
+        return;
+    i64 width  = image.width();
+    i64 height = image.height();
+    auto *bits  = reinterpret_cast<u32 *>(image.bits());
+    auto stride = image.bytesPerLine() / sizeof(u32);
+
+    image.fill(Qt::black);
+    for (i64 x = 0; x < width; x++) {
+        auto value = bands[x * bands.size() / width];
+        auto top = height - std::clamp<i64>(value * height, 0, height);
+        for (auto y = top; y < height; y++)
+            bits[y * stride + x] = 0xff40c0ff;
+    }
+    update();
+}
+
+SpectrumAnalyzer::SpectrumAnalyzer()
+    : worker{[this] (std::stop_token stop) { run(stop); }}
+{ }
+
+SpectrumAnalyzer::~SpectrumAnalyzer()
+{
+    worker.request_stop();
+    pending.fetch_add(1);
+    pending.notify_one();
+}
+
+void SpectrumAnalyzer::submit(const gmplayer::AudioBuffer &buffer, bool voices)
+{
+    input.write() = buffer;
+    input.publish();
+    with_voices = voices;
+    pending.fetch_add(1);
+    pending.notify_one();
+}
+
+void SpectrumAnalyzer::run(std::stop_token stop)
+{
+    fft::Plan plan(NUM_FRAMES);
+    std::vector<f32> signal(plan.size()), magnitudes(plan.size() / 2 + 1);
+    auto analyze = [&](auto &&sample, auto &bands) {
+        for (std::size_t f = 0; f < signal.size(); f++)
+            signal[f] = sample(f);
+        plan.magnitudes(signal, magnitudes);
+        fft::log_bands(magnitudes, SAMPLE_RATE, bands);
+    };
+
+    for (u32 seen = 0; !stop.stop_requested(); ) {
+        pending.wait(seen);
+        seen = pending.load();
+        auto *buffer = input.read();
+        if (!buffer)
+            continue;
+        auto &spectra = output.write();
+        analyze([&](i64 f) { return sample_at<f32, NUM_CHANNELS, 1>(buffer->mix, 0, f); }, spectra[0]);
+        for (i64 v = 0; v < NUM_VOICES; v++) {
+            if (with_voices)
+                analyze([&](i64 f) { return sample_at<i16, NUM_CHANNELS, NUM_VOICES>(buffer->voices, v, f); }, spectra[v+1]);
+            else
+                spectra[v+1].fill(0);
+        }
+        output.publish();
+    }
 }
 
 VisualizerTab::VisualizerTab(gmplayer::Player *player, QWidget *parent)
     : QWidget(parent)
+    , player{player}
+    , timer{new QTimer(this)}
+    , analyzer{std::make_unique<SpectrumAnalyzer>()}
 {
-    full = new Visualizer<f32, 2, 1>(full_data, 0, tr("Full"));
+    full = new Visualizer<f32, 2, 1>(0, tr("Full"));
     for (int i = 0; i < NUM_VOICES; i++) {
-        single[i] = new Visualizer<i16, 2, 8>(single_data, i);
+        single[i] = new Visualizer<i16, 2, 8>(i);
         single[i]->setVisible(false);
     }
 
-    connect(this, &VisualizerTab::updated, this, [=, this] {
-        full->render();
-        for (auto &s : single)
-            s->render();
-    });
+    timer->setTimerType(Qt::PreciseTimer);
+    connect(timer, &QTimer::timeout, this, [=, this] { update_scopes(); });
 
     player->on_file_changed([=, this] (int) {
         for (auto &s : single)
@@ -90,14 +191,11 @@ VisualizerTab::VisualizerTab(gmplayer::Player *player, QWidget *parent)
         }
     });
 
-    player->on_samples_played([=, this] (std::span<i16> single, std::span<f32> full) {
-        std::copy(single.begin(), single.begin() + 32768, single_data.begin());
-        std::copy(full.begin(),   full.end(),   full_data.begin());
-        emit updated();
-    });
+    auto *spectrum = make_checkbox(tr("Spectrum"), false, this, [=, this] (int state) { show_spectrum = state; });
 
     setLayout(
         make_layout<QVBoxLayout>(
+            spectrum,
             full,
             make_layout<QGridLayout>(
                 std::make_tuple(single[0], 0, 0), std::make_tuple(single[1], 0, 1),
@@ -109,4 +207,42 @@ VisualizerTab::VisualizerTab(gmplayer::Player *player, QWidget *parent)
     );
 }
 
+VisualizerTab::~VisualizerTab() = default;
+
+void VisualizerTab::showEvent(QShowEvent *ev)
+{
+    auto rate = screen() ? screen()->refreshRate() : 60.0;
+    timer->start(std::max(1, int(1000.0 / rate)));
+    QWidget::showEvent(ev);
+}
+
+void VisualizerTab::hideEvent(QHideEvent *ev)
+{
+    timer->stop();
+    QWidget::hideEvent(ev);
+}
+
+void VisualizerTab::update_scopes()
+{
+    auto *buffer = player->latest_samples();
+    if (show_spectrum) {
+        // results come one tick later, as they're computed on the worker
+        if (buffer)
+            analyzer->submit(*buffer, single[0]->isVisible());
+        if (auto *spectra = analyzer->read(); spectra) {
+            full->render_spectrum((*spectra)[0]);
+            for (auto i = 0u; i < single.size(); i++)
+                if (single[i]->isVisible())
+                    single[i]->render_spectrum((*spectra)[i+1]);
+        }
+        return;
+    }
+    if (!buffer)
+        return;
+    full->render(buffer->mix);
+    for (auto &s : single)
+        if (s->isVisible())
+            s->render(buffer->voices);
+}
+
 } // namespace gui
@@ -1,43 +1,92 @@
 #pragma once
 
 #include <array>
+#include <atomic>
+#include <memory>
 #include <span>
+#include <thread>
 #include <QWidget>
-#include <QGraphicsView>
+#include <QImage>
 #include "common.hpp"
 #include "const.hpp"
+#include "player.hpp"
+#include "triple_buffer.hpp"
 
-namespace gmplayer { class Player; }
+class QTimer;
 
 namespace gui {
 
+/*
+ * An oscilloscope for a single voice of the samples. Each column of pixels
+ * shows the minimum and maximum of the samples falling into it, which is
+ * drawn directly into an image.
+ */
 template <typename T, i64 NUM_CHANNELS, i64 NUM_VOICES>
-class Visualizer : public QGraphicsView {
-    QGraphicsScene *scene;
-    std::span<T> data;
+class Visualizer : public QWidget {
+    QImage image;
     i64 voice;
     QString name;
 
-    void showEvent(QShowEvent *ev)     override { render(); QGraphicsView::showEvent(ev); }
-    void resizeEvent(QResizeEvent *ev) override { render(); QGraphicsView::resizeEvent(ev); }
-    void wheelEvent(QWheelEvent *)     override { }
+    void paintEvent(QPaintEvent *ev)   override;
+    void resizeEvent(QResizeEvent *ev) override;
 
 public:
-    Visualizer(std::span<T> data, i64 voice, const QString &name = "", QWidget *parent = nullptr);
-    void set_name(const QString &name) { this->name = name; }
-    void render();
+    Visualizer(i64 voice, const QString &name = "", QWidget *parent = nullptr);
+    void set_name(const QString &name) { this->name = name; update(); }
+    void render(std::span<const T> data);
+    void render_spectrum(std::span<const f32> bands);
 };
 
+/*
+ * Computes the spectrum of the mix and of every voice on a worker thread,
+ * which sleeps until a buffer is submitted. Buffers and results are
+ * exchanged through triple buffers, so neither side ever waits.
+ * Only one thread may submit and read.
+ *
+ * @submit: copies @buffer and wakes up the worker. Voices are analyzed only
+ *          if @voices is true;
+ * @read: returns the latest spectra, or nullptr if there are no new ones.
+ *        Index 0 is the mix, the rest are the voices;
+ */
+class SpectrumAnalyzer {
+public:
+    static constexpr int NUM_BANDS = 64;
+    using Spectra = std::array<std::array<f32, NUM_BANDS>, NUM_VOICES + 1>;
+
+private:
+    TripleBuffer<gmplayer::AudioBuffer> input;
+    TripleBuffer<Spectra> output;
+    std::atomic<u32> pending = 0;
+    std::atomic<bool> with_voices = false;
+    std::jthread worker;
+
+    void run(std::stop_token stop);
+
+public:
+    SpectrumAnalyzer();
+    ~SpectrumAnalyzer();
+    void submit(const gmplayer::AudioBuffer &buffer, bool voices);
+    const Spectra *read() { return output.read(); }
+};
+
+// Scopes are only updated while the tab is shown, and no more than once per
+// display refresh.
 class VisualizerTab : public QWidget {
     Q_OBJECT
-    std::array<i16, NUM_FRAMES * NUM_CHANNELS * NUM_VOICES> single_data = {};
-    std::array<f32, NUM_FRAMES * NUM_CHANNELS>              full_data   = {};
+    gmplayer::Player *player;
+    QTimer *timer;
     std::array<Visualizer<i16, 2, 8> *, 8> single;
     Visualizer<f32, 2, 1> *full;
+    std::unique_ptr<SpectrumAnalyzer> analyzer;
+    bool show_spectrum = false;
+
+    void showEvent(QShowEvent *ev) override;
+    void hideEvent(QHideEvent *ev) override;
+    void update_scopes();
+
 public:
     VisualizerTab(gmplayer::Player *player, QWidget *parent = nullptr);
-signals:
-    void updated();
+    ~VisualizerTab();
 };
 
 } // namespace gui
@@ -0,0 +1,311 @@
+#include "watch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <fmt/core.h>
+#include "common.hpp"
+#include "scan.hpp"
+
+#ifdef PLATFORM_LINUX
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace watch {
+
+namespace {
+
+bool is_music_file(const fs::path &path) { return scan::classify_file(path) != scan::Kind::None; }
+
+#ifdef PLATFORM_LINUX
+
+constexpr u32 WATCH_MASK = IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+                         | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+/*
+ * All watches are handled by a single thread, which owns the table of watched
+ * directories; others only queue requests for it and wake it up.
+ * inotify has one watch per directory and tells which file changed by name.
+ * Renames come as two events sharing a cookie, which are paired up within
+ * each read; a half without the other is a move from or to outside of the
+ * watched directories, i.e. a removal or an addition.
+ */
+class InotifyWatcher : public Watcher {
+    int fd   = -1;
+    int wake = -1;
+
+    std::mutex mutex;
+    std::vector<std::pair<bool, fs::path>> requests; // add or remove
+    std::vector<Change> changes;
+
+    // only touched by the thread
+    std::unordered_map<int, fs::path> dirs;
+    std::vector<fs::path> roots;
+    // files created and not yet closed after writing, which are reported
+    // once they're complete
+    std::unordered_set<std::string> created;
+    bool warned_limit = false;
+
+    std::jthread thread;
+
+    void watch_tree(const fs::path &root, std::vector<Change> &out, bool report);
+    void unwatch_tree(const fs::path &root);
+    void rename_tree(const fs::path &from, const fs::path &to);
+    void read_events(std::vector<Change> &out);
+    void rescan(std::vector<Change> &out);
+    void run(std::stop_token stop);
+
+public:
+    InotifyWatcher();
+    ~InotifyWatcher();
+
+    void add(const fs::path &dir) override;
+    void remove(const fs::path &dir) override;
+    std::vector<Change> take() override;
+    bool is_supported() const override { return fd != -1; }
+};
+
+InotifyWatcher::InotifyWatcher()
+{
+    fd   = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd == -1 || wake == -1) {
+        fmt::print(stderr, "warning: can't watch directories: inotify unavailable\n");
+        if (fd   != -1) ::close(fd);
+        if (wake != -1) ::close(wake);
+        fd = wake = -1;
+        return;
+    }
+    thread = std::jthread([this] (std::stop_token stop) { run(stop); });
+}
+
+InotifyWatcher::~InotifyWatcher()
+{
+    if (fd == -1)
+        return;
+    thread.request_stop();
+    u64 one = 1;
+    [[maybe_unused]] auto n = ::write(wake, &one, sizeof(one));
+    thread.join();
+    ::close(fd);
+    ::close(wake);
+}
+
+void InotifyWatcher::add(const fs::path &dir)
+{
+    if (fd == -1)
+        return;
+    std::lock_guard lock(mutex);
+    requests.emplace_back(true, dir);
+    u64 one = 1;
+    [[maybe_unused]] auto n = ::write(wake, &one, sizeof(one));
+}
+
+void InotifyWatcher::remove(const fs::path &dir)
+{
+    if (fd == -1)
+        return;
+    std::lock_guard lock(mutex);
+    requests.emplace_back(false, dir);
+    u64 one = 1;
+    [[maybe_unused]] auto n = ::write(wake, &one, sizeof(one));
+}
+
+std::vector<Change> InotifyWatcher::take()
+{
+    std::lock_guard lock(mutex);
+    return std::exchange(changes, {});
+}
+
+// With @report set, music files found are reported as added: that's for
+// directories appearing while watching, not for the ones being imported.
+void InotifyWatcher::watch_tree(const fs::path &root, std::vector<Change> &out, bool report)
+{
+    std::vector<fs::path> stack = { root };
+    while (!stack.empty()) {
+        auto dir = std::move(stack.back());
+        stack.pop_back();
+        int wd = inotify_add_watch(fd, dir.c_str(), WATCH_MASK);
+        if (wd == -1) {
+            if (errno == ENOSPC && !warned_limit) {
+                fmt::print(stderr, "warning: too many directories to watch (see fs.inotify.max_user_watches)\n");
+                warned_limit = true;
+            }
+            continue;
+        }
+        dirs[wd] = dir;
+        std::error_code ec;
+        for (auto it = fs::directory_iterator(dir, fs::directory_options::skip_permission_denied, ec);
+             !ec && it != fs::directory_iterator(); it.increment(ec)) {
+            std::error_code entry_ec;
+            if (it->is_directory(entry_ec) && !it->is_symlink(entry_ec))
+                stack.push_back(it->path());
+            else if (report && it->is_regular_file(entry_ec) && is_music_file(it->path()))
+                out.push_back({ Change::Added, it->path() });
+        }
+    }
+}
+
+void InotifyWatcher::unwatch_tree(const fs::path &root)
+{
+    std::erase_if(dirs, [&](const auto &p) {
+        if (!is_within(p.second, root))
+            return false;
+        inotify_rm_watch(fd, p.first);
+        return true;
+    });
+}
+
+void InotifyWatcher::rename_tree(const fs::path &from, const fs::path &to)
+{
+    for (auto &[wd, path] : dirs)
+        if (is_within(path, from))
+            path = path == from ? to : to / path.lexically_relative(from);
+}
+
+// Events were lost: every root is walked again, also watching whatever
+// directory was created in the meantime.
+void InotifyWatcher::rescan(std::vector<Change> &out)
+{
+    for (auto &root : roots) {
+        out.push_back({ Change::Rescan, root });
+        watch_tree(root, out, true);
+    }
+}
+
+void InotifyWatcher::read_events(std::vector<Change> &out)
+{
+    alignas(inotify_event) char buf[64 * 1024];
+    auto overflowed = false;
+    for (;;) {
+        auto n = ::read(fd, buf, sizeof(buf));
+        if (n <= 0)
+            break;
+        std::unordered_map<u32, std::pair<fs::path, bool>> moved_from;
+        for (auto *p = buf; p < buf + n; ) {
+            const auto &ev = *reinterpret_cast<const inotify_event *>(p);
+            p += sizeof(inotify_event) + ev.len;
+            if (ev.mask & IN_Q_OVERFLOW) {
+                overflowed = true;
+                continue;
+            }
+            auto it = dirs.find(ev.wd);
+            if (it == dirs.end())
+                continue;
+            if (ev.mask & IN_IGNORED) {
+                dirs.erase(it);
+                continue;
+            }
+            if (ev.len == 0)
+                continue;
+            auto path = it->second / ev.name;
+            bool is_dir = ev.mask & IN_ISDIR;
+            if (ev.mask & IN_CREATE) {
+                if (is_dir)
+                    watch_tree(path, out, true);
+                else
+                    created.insert(path.native());
+            } else if (ev.mask & IN_CLOSE_WRITE) {
+                auto is_new = created.erase(path.native()) > 0;
+                if (is_music_file(path))
+                    out.push_back({ is_new ? Change::Added : Change::Modified, path });
+            } else if (ev.mask & IN_DELETE) {
+                created.erase(path.native());
+                out.push_back({ Change::Removed, path });
+            } else if (ev.mask & IN_MOVED_FROM) {
+                moved_from[ev.cookie] = { path, is_dir };
+            } else if (ev.mask & IN_MOVED_TO) {
+                if (auto from = moved_from.find(ev.cookie); from != moved_from.end()) {
+                    if (is_dir)
+                        rename_tree(from->second.first, path);
+                    out.push_back({ Change::Renamed, from->second.first, path });
+                    moved_from.erase(from);
+                } else if (is_dir)
+                    watch_tree(path, out, true);
+                else if (is_music_file(path))
+                    out.push_back({ Change::Added, path });
+            }
+        }
+        // moved out of sight (halves split across two reads end up here too,
+        // which only costs reading those files again)
+        for (auto &[cookie, from] : moved_from) {
+            if (from.second)
+                unwatch_tree(from.first);
+            out.push_back({ Change::Removed, from.first });
+        }
+    }
+    if (overflowed)
+        rescan(out);
+}
+
+void InotifyWatcher::run(std::stop_token stop)
+{
+    std::array<pollfd, 2> fds = {{ { fd, POLLIN, 0 }, { wake, POLLIN, 0 } }};
+    while (!stop.stop_requested()) {
+        if (::poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR)
+            return;
+        if (fds[1].revents & POLLIN) {
+            u64 count;
+            [[maybe_unused]] auto n = ::read(wake, &count, sizeof(count));
+        }
+        std::vector<std::pair<bool, fs::path>> reqs;
+        {
+            std::lock_guard lock(mutex);
+            reqs = std::exchange(requests, {});
+        }
+        std::vector<Change> out;
+        for (auto &[add, dir] : reqs) {
+            if (add) {
+                watch_tree(dir, out, false);
+                roots.push_back(dir);
+            } else {
+                unwatch_tree(dir);
+                std::erase_if(roots, [&](const fs::path &r) { return is_within(r, dir); });
+            }
+        }
+        read_events(out);
+        if (!out.empty()) {
+            std::lock_guard lock(mutex);
+            changes.insert(changes.end(), std::make_move_iterator(out.begin()), std::make_move_iterator(out.end()));
+        }
+    }
+}
+
+#endif
+
+struct NullWatcher : public Watcher {
+    void add(const fs::path &dir) override { }
+    void remove(const fs::path &dir) override { }
+    std::vector<Change> take() override { return {}; }
+    bool is_supported() const override { return false; }
+};
+
+} // namespace
+
+std::unique_ptr<Watcher> make_watcher()
+{
+#ifdef PLATFORM_LINUX
+    return std::make_unique<InotifyWatcher>();
+#else
+    return std::make_unique<NullWatcher>();
+#endif
+}
+
+bool is_within(const fs::path &path, const fs::path &dir)
+{
+    auto [d, p] = std::mismatch(dir.begin(), dir.end(), path.begin(), path.end());
+    // a trailing separator shows up as an empty last component
+    return d == dir.end() || (std::next(d) == dir.end() && d->empty());
+}
+
+} // namespace watch
@@ -0,0 +1,51 @@
+/*
+ * Watching directories for changes, so that the file list can follow what
+ * happens on disk without ever rescanning it.
+ *
+ * Changes are reported per file, as they happen: new music files (recognized
+ * the same way as in scan.hpp, once they're completely written), removed
+ * files, files whose contents changed, and renames. A directory that is
+ * removed or renamed is reported as a single change of the directory itself,
+ * which applies to every file under it.
+ * When inotify loses events (its queue overflowed), each watched directory is
+ * walked again: it's reported as rescanned, followed by every music file
+ * found under it as added. Anything under it that isn't reported is gone.
+ * Only Linux is supported for now, through inotify; elsewhere, watching
+ * silently does nothing.
+ *
+ * @add: starts watching @dir and everything under it. Directories created
+ *       later are watched as well;
+ * @remove: stops watching @dir and everything under it;
+ * @take: returns the changes since the last call. Can be called from any
+ *        thread, although it's meant for a single consumer;
+ * @is_supported: whether watching works at all on this platform;
+ * @is_within: whether @path is @dir or anything under it;
+ */
+
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+namespace watch {
+
+struct Change {
+    enum Kind { Added, Removed, Modified, Renamed, Rescan } kind;
+    std::filesystem::path path;
+    std::filesystem::path to = {}; // for Renamed
+};
+
+struct Watcher {
+    virtual ~Watcher() = default;
+    virtual void add(const std::filesystem::path &dir) = 0;
+    virtual void remove(const std::filesystem::path &dir) = 0;
+    virtual std::vector<Change> take() = 0;
+    virtual bool is_supported() const = 0;
+};
+
+std::unique_ptr<Watcher> make_watcher();
+
+bool is_within(const std::filesystem::path &path, const std::filesystem::path &dir);
+
+} // namespace watch
@@ -0,0 +1,251 @@
+#include "waveform.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#include <fmt/core.h>
+#include "format.hpp"
+#include "io.hpp"
+#include "const.hpp"
+
+namespace fs = std::filesystem;
+
+namespace waveform {
+
+namespace {
+
+constexpr std::array<char, 4> MAGIC = { 'G', 'M', 'P', 'W' };
+constexpr u32 VERSION = 1;
+
+struct Header {
+    std::array<char, 4> magic;
+    u32 version;
+    u64 file_size;
+    i64 file_time;
+    i32 track;
+    i32 length;
+    u64 count;
+};
+
+Peak merge(Peak a, Peak b)
+{
+    return { std::min(a.min, b.min), std::max(a.max, b.max) };
+}
+
+// Identifies the version of the file a pyramid was rendered from.
+std::optional<std::pair<u64, i64>> file_stamp(const fs::path &path)
+{
+    std::error_code ec;
+    auto size = fs::file_size(path, ec);
+    if (ec)
+        return std::nullopt;
+    auto time = fs::last_write_time(path, ec);
+    if (ec)
+        return std::nullopt;
+    return std::make_pair(u64(size), i64(time.time_since_epoch().count()));
+}
+
+} // namespace
+
+Pyramid::Pyramid(std::vector<Peak> base)
+{
+    if (base.empty())
+        return;
+    levels.push_back(std::move(base));
+    while (levels.back().size() > 1) {
+        const auto &prev = levels.back();
+        std::vector<Peak> next((prev.size() + 1) / 2);
+        for (auto i = 0u; i < prev.size() / 2; i++)
+            next[i] = merge(prev[i*2], prev[i*2 + 1]);
+        if (prev.size() % 2 != 0)
+            next.back() = prev.back();
+        levels.push_back(std::move(next));
+    }
+}
+
+Peak Pyramid::range(std::size_t first, std::size_t last) const
+{
+    last = std::min(last, size());
+    if (first >= last)
+        return {};
+    // a pair of level l covers 2^l pairs of the first level: walk the range
+    // with the biggest aligned blocks that fit, which takes O(log n) steps
+    Peak res = { INT16_MAX, INT16_MIN };
+    while (first < last) {
+        auto level = std::min<std::size_t>(std::countr_zero(first | (1ul << 62)), levels.size() - 1);
+        while ((1ul << level) > last - first)
+            level--;
+        res = merge(res, levels[level][first >> level]);
+        first += 1ul << level;
+    }
+    return res;
+}
+
+void Pyramid::columns(std::span<Peak> out) const
+{
+    auto n = size();
+    for (auto c = 0u; c < out.size(); c++)
+        out[c] = range(c * n / out.size(), std::max((c + 1) * n / out.size(), c * n / out.size() + 1));
+}
+
+Pyramid render(const Source &source, std::function<bool()> cancelled)
+{
+    // a separate emulator, so that playback is left alone
+    auto file = io::MappedFile::open(source.path, io::Access::Read);
+    if (!file)
+        return {};
+    std::vector<io::MappedFile> mapped;
+    auto format = gmplayer::read_file(file.value(), mapped, SAMPLE_RATE, source.default_length);
+    if (!format || format.value()->start_track(source.track))
+        return {};
+    auto &emu = *format.value();
+    emu.set_fade_out(source.fade);
+
+    auto multi = emu.is_multi_channel();
+    std::array<i16, NUM_FRAMES * NUM_CHANNELS * NUM_VOICES> separated;
+    std::array<i16, NUM_FRAMES * NUM_CHANNELS>              mixed;
+    auto max_frames = i64(source.length) * SAMPLE_RATE / 1000;
+    std::vector<Peak> base;
+    base.reserve(max_frames / BASE_FRAMES + 1);
+    Peak cur = { INT16_MAX, INT16_MIN };
+    int filled = 0;
+    for (i64 frames = 0; frames < max_frames && !emu.track_ended(); frames += NUM_FRAMES) {
+        if (cancelled())
+            return {};
+        if (multi ? emu.play(separated) : emu.play(mixed))
+            break;
+        if (multi) {
+            // same layout as in Player::render
+            mixed.fill(0);
+            for (auto f = 0u; f < NUM_FRAMES; f += 2)
+                for (auto t = 0u; t < NUM_VOICES; t++)
+                    for (auto i = 0u; i < NUM_CHANNELS*2; i++)
+                        mixed[f*2 + i] = std::clamp(mixed[f*2 + i] + separated[f*FRAME_SIZE + t*NUM_CHANNELS*2 + i],
+                                                    INT16_MIN, INT16_MAX);
+        }
+        for (auto f = 0u; f < NUM_FRAMES; f++) {
+            for (auto c = 0u; c < NUM_CHANNELS; c++) {
+                cur.min = std::min(cur.min, mixed[f*NUM_CHANNELS + c]);
+                cur.max = std::max(cur.max, mixed[f*NUM_CHANNELS + c]);
+            }
+            if (++filled == BASE_FRAMES) {
+                base.push_back(cur);
+                cur = { INT16_MAX, INT16_MIN };
+                filled = 0;
+            }
+        }
+    }
+    if (filled != 0)
+        base.push_back(cur);
+    return Pyramid(std::move(base));
+}
+
+fs::path cache_path(const Source &source)
+{
+    // FNV-1a over the path and track number
+    u64 hash = 0xcbf29ce484222325ull;
+    auto add = [&](std::string_view s) {
+        for (auto c : s)
+            hash = (hash ^ u8(c)) * 0x100000001b3ull;
+    };
+    add(source.path.string());
+    add(fmt::format(":{}", source.track));
+    return io::directory::cache() / APP_NAME / "waveforms" / fmt::format("{:016x}", hash);
+}
+
+std::optional<Pyramid> load(const Source &source)
+{
+    auto stamp = file_stamp(source.path);
+    auto file = io::MappedFile::open(cache_path(source), io::Access::Read);
+    if (!stamp || !file || file.value().size() < sizeof(Header))
+        return std::nullopt;
+    Header header;
+    std::memcpy(&header, file.value().data(), sizeof(Header));
+    if (header.magic != MAGIC || header.version != VERSION
+     || header.file_size != stamp->first || header.file_time != stamp->second
+     || header.track != source.track || header.length != source.length
+     || file.value().size() != sizeof(Header) + header.count * sizeof(Peak))
+        return std::nullopt;
+    std::vector<Peak> base(header.count);
+    std::memcpy(base.data(), file.value().data() + sizeof(Header), header.count * sizeof(Peak));
+    return Pyramid(std::move(base));
+}
+
+void save(const Source &source, const Pyramid &pyramid)
+{
+    auto stamp = file_stamp(source.path);
+    if (!stamp)
+        return;
+    auto path = cache_path(source);
+    std::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+    // only the first level is stored, the others are cheap to rebuild;
+    // writing to a temporary file means a reader never sees half of one
+    auto tmp = fs::path(path).concat(".tmp");
+    auto file = io::File::open(tmp, io::Access::Write);
+    if (!file)
+        return;
+    auto base = pyramid.base();
+    auto header = Header {
+        .magic     = MAGIC,
+        .version   = VERSION,
+        .file_size = stamp->first,
+        .file_time = stamp->second,
+        .track     = source.track,
+        .length    = source.length,
+        .count     = base.size(),
+    };
+    auto ok = std::fwrite(&header, sizeof(Header), 1, file.value().data()) == 1
+           && std::fwrite(base.data(), sizeof(Peak), base.size(), file.value().data()) == base.size();
+    if (file.value().close() != 0 || !ok) {
+        fs::remove(tmp, ec);
+        return;
+    }
+    fs::rename(tmp, path, ec);
+}
+
+Generator::Generator(Callback callback)
+    : callback{std::move(callback)}
+    , worker{[this] (std::stop_token stop) { run(stop); }}
+{ }
+
+u64 Generator::request(Source source)
+{
+    std::lock_guard lock(mutex);
+    pending = std::move(source);
+    auto n = serial.fetch_add(1, std::memory_order_relaxed) + 1;
+    cond.notify_one();
+    return n;
+}
+
+void Generator::run(std::stop_token stop)
+{
+    while (!stop.stop_requested()) {
+        Source source;
+        u64 n;
+        {
+            std::unique_lock lock(mutex);
+            if (!cond.wait(lock, stop, [&] { return pending.has_value(); }))
+                return;
+            source = std::move(pending.value());
+            pending.reset();
+            n = serial.load(std::memory_order_relaxed);
+        }
+        auto superseded = [&] {
+            return stop.stop_requested() || serial.load(std::memory_order_relaxed) != n;
+        };
+        auto pyramid = load(source);
+        if (!pyramid) {
+            pyramid = render(source, superseded);
+            if (superseded())
+                continue;
+            if (!pyramid->empty())
+                save(source, pyramid.value());
+        }
+        if (!superseded())
+            callback(n, std::make_shared<const Pyramid>(std::move(pyramid.value())));
+    }
+}
+
+} // namespace waveform
@@ -0,0 +1,106 @@
+/*
+ * Waveform overviews, i.e. the shape of a whole track, to be drawn behind a
+ * seek bar.
+ *
+ * A track is rendered once, as fast as the emulator can go, into a pyramid of
+ * min/max pairs: the first level has one pair for every BASE_FRAMES frames of
+ * audio, and every level after it merges two pairs of the previous one. Any
+ * number of columns can then be drawn by reading from the coarsest level that
+ * still has enough detail, without ever touching the audio again.
+ * Pyramids are cached on disk, keyed by file and track, so that each track is
+ * rendered only once.
+ *
+ * @render: renders a track into a pyramid. Returns an empty pyramid on errors
+ *          or if @cancelled returns true, which is checked between buffers;
+ * @cache_path: returns where the pyramid of a track is stored;
+ * @load, @save: read and write a pyramid from the disk cache. A cached
+ *               pyramid is only valid if the file didn't change since and
+ *               if it was rendered for the same length;
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <thread>
+#include <vector>
+#include "common.hpp"
+
+namespace waveform {
+
+inline constexpr int BASE_FRAMES = 256;
+
+struct Peak {
+    i16 min = 0;
+    i16 max = 0;
+};
+
+/*
+ * @size: the number of pairs of the first level;
+ * @range: merges the pairs of the first level within [@first, @last), using
+ *         the coarsest pairs that fit in the range;
+ * @columns: fills @out with the track split into out.size() equal columns;
+ */
+class Pyramid {
+    std::vector<std::vector<Peak>> levels;
+
+public:
+    Pyramid() = default;
+    explicit Pyramid(std::vector<Peak> base);
+
+    bool empty() const                     { return levels.empty(); }
+    std::size_t size() const               { return levels.empty() ? 0 : levels[0].size(); }
+    std::span<const Peak> base() const     { return levels.empty() ? std::span<const Peak>{} : levels[0]; }
+    Peak range(std::size_t first, std::size_t last) const;
+    void columns(std::span<Peak> out) const;
+};
+
+struct Source {
+    std::filesystem::path path;
+    int track;
+    int length;         // in milliseconds, fade included
+    int fade;
+    int default_length; // for tracks without length information
+};
+
+Pyramid render(const Source &source, std::function<bool()> cancelled);
+std::filesystem::path cache_path(const Source &source);
+std::optional<Pyramid> load(const Source &source);
+void save(const Source &source, const Pyramid &pyramid);
+
+/*
+ * Builds overviews on a background thread, one at a time. A new request
+ * supersedes the previous one, which is abandoned even if it's half rendered.
+ *
+ * @request: asks for the overview of @source. Returns a serial number, which
+ *           is passed back along with the result;
+ * @Callback: called from the worker thread once a pyramid is ready (from the
+ *            cache or freshly rendered). Results of superseded requests are
+ *            never delivered;
+ */
+class Generator {
+public:
+    using Callback = std::function<void(u64 serial, std::shared_ptr<const Pyramid>)>;
+
+private:
+    Callback callback;
+    std::mutex mutex;
+    std::condition_variable_any cond;
+    std::optional<Source> pending;
+    std::atomic<u64> serial = 0;
+    std::jthread worker;
+
+    void run(std::stop_token stop);
+
+public:
+    explicit Generator(Callback callback);
+    u64 request(Source source);
+};
+
+} // namespace waveform